@@ -12,240 +12,2385 @@
 #include <cstring>
 #include <cassert>
 
+#include <limits>
+#include <type_traits>
+
+#include <unistd.h>
+
 #include "CNN.hh"
 #include "imgproc.hh"
+#include "halo.hh"
+#include "embedded_rk.hh"
 
 
-// Get a matrix element, subject to boundary conditions
-static double get_matrix_element(
-	const double *RESTRICT mat,
-	std::ptrdiff_t r,
-	std::ptrdiff_t c,
+// Decide how to apply a coupling matrix. Zeros around the edges are cropped
+// first, so that e.g. a 5x5 matrix with only its central 3x3 coefficients
+// set is as fast as a 3x3 one. For 3x3 matrices, the zero pattern selects
+// the kernel, and the algebraic structure determines whether the symmetric
+// or the separable version of it should be used.
+template<typename T>
+static StencilPlan<T> make_stencil_plan(const CouplingMat &full_M, const StencilKernels<T> &kernels)
+{
+	StencilPlan<T> plan = {};
+	const CouplingMat M = crop_coupling_mat(full_M, effective_radius(full_M));
+
+	std::copy_n(&M[0][0], M.size() * M.size(), plan.coeffs);
+	plan.radius = M.radius;
+	plan.structure = CouplingGeneral;
+
+	if (plan.radius > 1) {
+		plan.shape = StencilFull;
+		plan.wide_stencil_row = kernels.wide_stencil_row[plan.radius];
+		return plan;
+	}
+
+	CouplingFactorization factors = factorize_coupling_mat(M);
+
+	plan.shape = classify_stencil(&M[0][0]);
+	plan.stencil_row = kernels.stencil_row[plan.shape];
+
+	switch (plan.shape) {
+	case StencilCross:
+	case StencilFull:
+		if (factors.structure == CouplingSymmetric) {
+			plan.structure = CouplingSymmetric;
+			plan.stencil_row = kernels.symmetric_stencil_row[plan.shape];
+		} else if (factors.structure == CouplingSeparable) {
+			plan.structure = CouplingSeparable;
+			plan.row_pass = kernels.stencil_row[StencilRow];
+			plan.column_pass = kernels.stencil_row[StencilColumn];
+
+			for (int k = 0; k < 3; k++) {
+				plan.row_coeffs[3 + k] = factors.row[k];
+				plan.column_coeffs[3 * k + 1] = factors.col[k];
+			}
+		}
+		break;
+
+	default:
+		// at most 3 nonzero coefficients, can't do better than that
+		break;
+	}
+
+	return plan;
+}
+
+// out += M * img for rows r_begin...r_end - 1, where 'img' is halo-padded
+// and 'out' is not; rows of 'out' are 'out_stride' apart, so that it may be
+// a part of a larger image. init_row(out_row, r) is called right before
+// accumulating into each row, and finish_row(out_row, r) right after it, so
+// that the caller can fuse its own row-wise computation into the loop, while
+// the row is still in the cache. 'H' must have space for 3 rows; it is only
+// used by separable stencils. The halo must be at least as wide as plan.radius.
+template<typename T, typename InitFn, typename FinishFn>
+static void apply_stencil(
+	const StencilPlan<T> &plan,
+	const T *RESTRICT img,
+	T *RESTRICT out,
+	T *RESTRICT H,
 	std::ptrdiff_t width,
-	std::ptrdiff_t height,
-	Template tem
+	std::ptrdiff_t halo,
+	std::ptrdiff_t out_stride,
+	std::ptrdiff_t r_begin,
+	std::ptrdiff_t r_end,
+	const InitFn &init_row,
+	const FinishFn &finish_row
+)
+{
+	auto img_row = [&](std::ptrdiff_t r) {
+		return img + to_padded_index(r, 0, width, halo);
+	};
+
+	if (plan.radius > 1) {
+		const T *rows[2 * MaxTemplateRadius + 1];
+
+		for (std::ptrdiff_t r = r_begin; r < r_end; r++) {
+			T *out_row = out + to_index(r, 0, out_stride);
+
+			for (std::ptrdiff_t i = 0; i < 2 * plan.radius + 1; i++) {
+				rows[i] = img_row(r - plan.radius + i);
+			}
+
+			init_row(out_row, r);
+			plan.wide_stencil_row(out_row, rows, plan.coeffs, width);
+			finish_row(out_row, r);
+		}
+
+		return;
+	}
+
+	if (plan.structure != CouplingSeparable) {
+		for (std::ptrdiff_t r = r_begin; r < r_end; r++) {
+			T *out_row = out + to_index(r, 0, out_stride);
+			init_row(out_row, r);
+			plan.stencil_row(out_row, img_row(r - 1), img_row(r), img_row(r + 1), plan.coeffs, width);
+			finish_row(out_row, r);
+		}
+
+		return;
+	}
+
+	// Separable: the horizontal pass of rows r - 1...r + 1 is kept in a
+	// ring buffer, so each row goes through it only once, and the vertical
+	// pass then only reads the (non-halo) cells directly above and below.
+	auto H_row = [&](std::ptrdiff_t r) {
+		return H + to_index((r + 1) % 3, 0, width);
+	};
+
+	auto row_pass = [&](std::ptrdiff_t r) {
+		T *dst = H_row(r);
+		std::fill_n(dst, width, T(0));
+		plan.row_pass(dst, img_row(r), img_row(r), img_row(r), plan.row_coeffs, width);
+	};
+
+	row_pass(r_begin - 1);
+	row_pass(r_begin);
+
+	for (std::ptrdiff_t r = r_begin; r < r_end; r++) {
+		T *out_row = out + to_index(r, 0, out_stride);
+
+		row_pass(r + 1);
+		init_row(out_row, r);
+		plan.column_pass(out_row, H_row(r - 1), H_row(r), H_row(r + 1), plan.column_coeffs, width);
+		finish_row(out_row, r);
+	}
+}
+
+// Accumulate the stencil over cells c_begin...c_end - 1 of row 'r' only, into
+// 'out_row', which points to the first cell of the row. Separable stencils
+// are applied in a single pass, using the general kernel of their shape,
+// since a 3-row ring buffer doesn't pay off for a few cells.
+template<typename T>
+static void apply_stencil_segment(
+	const StencilPlan<T> &plan,
+	const T *RESTRICT img,
+	T *RESTRICT out_row,
+	std::ptrdiff_t width,
+	std::ptrdiff_t halo,
+	std::ptrdiff_t r,
+	std::ptrdiff_t c_begin,
+	std::ptrdiff_t c_end
+)
+{
+	auto img_row = [&](std::ptrdiff_t i) {
+		return img + to_padded_index(i, c_begin, width, halo);
+	};
+
+	if (plan.radius > 1) {
+		const T *rows[2 * MaxTemplateRadius + 1];
+
+		for (std::ptrdiff_t i = 0; i < 2 * plan.radius + 1; i++) {
+			rows[i] = img_row(r - plan.radius + i);
+		}
+
+		plan.wide_stencil_row(out_row + c_begin, rows, plan.coeffs, c_end - c_begin);
+	} else {
+		plan.stencil_row(out_row + c_begin, img_row(r - 1), img_row(r), img_row(r + 1), plan.coeffs, c_end - c_begin);
+	}
+}
+
+// Size of the (per core) L2 cache in bytes, which determines the automatic
+// tile size. Not every platform can tell; then assume a typical size.
+static std::ptrdiff_t l2_cache_size()
+{
+#ifdef _SC_LEVEL2_CACHE_SIZE
+	long size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+
+	if (size > 0) {
+		return size;
+	}
+#endif
+
+	return 256 << 10;
+}
+
+// Default width and height of the tiles of the active set
+static const std::ptrdiff_t active_set_tile_size = 32;
+
+// Incremental feedback: the width of the blocks of a row whose change is
+// tracked, and the fraction of changed blocks above which it is cheaper
+// to recompute the whole feedback image
+static const std::ptrdiff_t feedback_block_width = 64;
+static const double feedback_refresh_threshold = 0.5;
+
+// Runge-Kutta-Fehlberg 4(5), as in GSL's rkf45 stepper
+static const EmbeddedRKTableau rkf45_tableau = {
+	6,
+	false,
+	{
+		{},
+		{ 1.0 / 4 },
+		{ 3.0 / 32, 9.0 / 32 },
+		{ 1932.0 / 2197, -7200.0 / 2197, 7296.0 / 2197 },
+		{ 439.0 / 216, -8.0, 3680.0 / 513, -845.0 / 4104 },
+		{ -8.0 / 27, 2.0, -3544.0 / 2565, 1859.0 / 4104, -11.0 / 40 },
+	},
+	{ 16.0 / 135, 0.0, 6656.0 / 12825, 28561.0 / 56430, -9.0 / 50, 2.0 / 55 },
+	{ 1.0 / 360, 0.0, -128.0 / 4275, -2197.0 / 75240, 1.0 / 50, 2.0 / 55 },
+};
+
+// Dormand-Prince 5(4): one more stage, but thanks to FSAL, it costs
+// 6 RHS evaluations per step too, and its error constants are smaller.
+static const EmbeddedRKTableau dopri5_tableau = {
+	7,
+	true,
+	{
+		{},
+		{ 1.0 / 5 },
+		{ 3.0 / 40, 9.0 / 40 },
+		{ 44.0 / 45, -56.0 / 15, 32.0 / 9 },
+		{ 19372.0 / 6561, -25360.0 / 2187, 64448.0 / 6561, -212.0 / 729 },
+		{ 9017.0 / 3168, -355.0 / 33, 46732.0 / 5247, 49.0 / 176, -5103.0 / 18656 },
+		{ 35.0 / 384, 0.0, 500.0 / 1113, 125.0 / 192, -2187.0 / 6784, 11.0 / 84 },
+	},
+	{ 35.0 / 384, 0.0, 500.0 / 1113, 125.0 / 192, -2187.0 / 6784, 11.0 / 84, 0.0 },
+	{ 71.0 / 57600, 0.0, -71.0 / 16695, 71.0 / 1920, -17253.0 / 339200, 22.0 / 525, -1.0 / 40 },
+};
+
+const EmbeddedRKTableau &embedded_rk_tableau(IntegrationMethod method)
+{
+	switch (method) {
+	case MethodRKF45:
+		return rkf45_tableau;
+	case MethodDOPRI5:
+		return dopri5_tableau;
+	default:
+		assert(0 && "not an embedded Runge-Kutta method");
+		return rkf45_tableau;
+	}
+}
+
+
+// The actual CNN dynamic equation. finish(dxdt_part, offset, n, thread) is
+// called with each part of 'dxdt' as soon as it is complete, where
+// 'dxdt_part' is 'dxdt + offset', and has 'n' elements, so that integrators
+// can fuse their next pass over it into this one, while it is still in the
+// cache. Parts of different threads (0...pool->size() - 1) may be finished
+// concurrently.
+template<typename T>
+template<typename Fn>
+void BasicCNN<T>::dynamic_eq(const T *RESTRICT x, T *RESTRICT dxdt, const Fn &finish)
+{
+	if (tile_width > 0) {
+		dynamic_eq_tiled(x, dxdt, finish);
+		return;
+	}
+
+	if (incremental_feedback) {
+		dynamic_eq_incremental(x, dxdt, finish);
+		return;
+	}
+
+	// Everything is accessed by reference or raw pointer: this function is called
+	// several times per integration step, so it must not copy or allocate anything.
+	const T *RESTRICT FF = this->FF.data();
+	T *RESTRICT Y = this->Y.data();
+
+	// Without feedback, the output image is not needed at all
+	if (feedback.shape != StencilZero) {
+		// Stage 1: materialize the output image y(x). Each output is used by
+		// 9 neighborhoods, so computing it only once per cell saves 8/9 of the
+		// nonlinearity evaluations. This loop is trivially vectorizable.
+		pool->parallel_for(height, [&](std::ptrdiff_t r_begin, std::ptrdiff_t r_end, std::ptrdiff_t) {
+			for (std::ptrdiff_t r = r_begin; r < r_end; r++) {
+				const T *RESTRICT x_row = x + to_index(r, 0, width);
+				T *RESTRICT Y_row = Y + to_padded_index(r, 0, width, halo);
+
+				for (std::ptrdiff_t c = 0; c < width; c++) {
+					Y_row[c] = y(x_row[c]);
+				}
+			}
+		});
+
+		// Stage 2: boundary condition. The ghost border is refilled once per
+		// evaluation, so that the stencil below needs no boundary special case.
+		fill_halo(Y, width, height, halo, tem.boundary_condition, y(T(tem.virtual_cell)));
+
+		statistics.output_evaluations += dimension;
+	}
+
+	// Stage 3: feedback (A-template) stencil over the output image,
+	// split into one band of rows per thread, like stage 1.
+	pool->parallel_for(height, [&](std::ptrdiff_t r_begin, std::ptrdiff_t r_end, std::ptrdiff_t k) {
+		apply_stencil(
+			feedback, Y, dxdt, &H[3 * width * k], width, halo, width, r_begin, r_end,
+			[&](T *RESTRICT dxdt_row, std::ptrdiff_t r) {
+				const T *RESTRICT FF_row = FF + to_index(r, 0, width);
+				const T *RESTRICT x_row = x + to_index(r, 0, width);
+
+				for (std::ptrdiff_t c = 0; c < width; c++) {
+					dxdt_row[c] = FF_row[c] - x_row[c];
+				}
+			},
+			[&](T *RESTRICT dxdt_row, std::ptrdiff_t r) {
+				finish(dxdt_row, to_index(r, 0, width), width, k);
+			}
+		);
+	});
+
+	statistics.rhs_evaluations++;
+}
+
+template<typename T>
+void BasicCNN<T>::dynamic_eq(const T *RESTRICT x, T *RESTRICT dxdt)
+{
+	dynamic_eq(x, dxdt, [](T *, std::ptrdiff_t, std::ptrdiff_t, std::ptrdiff_t) {});
+}
+
+// Compute the output image of the tw x th tile at (r0, c0), including its
+// halo, into a halo-padded buffer of that size. Cells in the halo that are
+// inside the image are recomputed from the state; the ones outside of it are
+// resolved according to the boundary condition, like fill_halo() would.
+template<typename T>
+void BasicCNN<T>::fill_output_tile(
+	const T *RESTRICT x,
+	T *RESTRICT Y_tile,
+	std::ptrdiff_t r0,
+	std::ptrdiff_t c0,
+	std::ptrdiff_t tw,
+	std::ptrdiff_t th
+)
+{
+	const T y_virtual = y(T(tem.virtual_cell));
+
+	// The range of columns that can be read without any boundary handling
+	const std::ptrdiff_t c_begin = std::max(c0 - halo, std::ptrdiff_t(0));
+	const std::ptrdiff_t c_end = std::min(c0 + tw + halo, width);
+
+	for (std::ptrdiff_t r = -halo; r < th + halo; r++) {
+		const std::ptrdiff_t r_src = boundary_index(r0 + r, height, tem.boundary_condition);
+		T *RESTRICT Y_row = Y_tile + to_padded_index(r, 0, tw, halo);
+
+		if (r_src < 0) {
+			std::fill_n(Y_row - halo, tw + 2 * halo, y_virtual);
+			continue;
+		}
+
+		const T *RESTRICT x_row = x + to_index(r_src, 0, width);
+
+		for (std::ptrdiff_t c = c_begin; c < c_end; c++) {
+			Y_row[c - c0] = y(x_row[c]);
+		}
+
+		for (std::ptrdiff_t c = c0 - halo; c < c_begin; c++) {
+			const std::ptrdiff_t c_src = boundary_index(c, width, tem.boundary_condition);
+			Y_row[c - c0] = c_src < 0 ? y_virtual : y(x_row[c_src]);
+		}
+
+		for (std::ptrdiff_t c = c_end; c < c0 + tw + halo; c++) {
+			const std::ptrdiff_t c_src = boundary_index(c, width, tem.boundary_condition);
+			Y_row[c - c0] = c_src < 0 ? y_virtual : y(x_row[c_src]);
+		}
+	}
+}
+
+// The same as dynamic_eq(), but FF + A * y(x) is kept from the previous
+// evaluation, and is updated by A * (y(x) - y(x_prev)), which is 0 except
+// around the cells whose output changed. Saturated cells don't change their
+// output at all, so late in a simulation, this is a small fraction of the
+// image. The change of the output image is tracked per block of a row; the
+// stencil is only applied to the blocks whose neighborhood contains a changed
+// one. If too many blocks changed, or after 'feedback_refresh' evaluations,
+// the feedback image is recomputed from scratch instead.
+template<typename T>
+template<typename Fn>
+void BasicCNN<T>::dynamic_eq_incremental(const T *RESTRICT x, T *RESTRICT dxdt, const Fn &finish)
+{
+	const T *RESTRICT FF = this->FF.data();
+	T *RESTRICT Y = this->Y.data();
+	T *RESTRICT D = Y_delta.data();
+	T *RESTRICT FF_AY = this->FF_AY.data();
+	unsigned char *RESTRICT changed = block_changed.data();
+	const std::ptrdiff_t R = feedback.radius;
+	const bool periodic = tem.boundary_condition == Periodic;
+
+	// Stage 1: the new output image and its change, block by block, and the
+	// derivative as if the feedback image hadn't changed. Blocks of 'D' are
+	// only written if they changed now, or did the last time.
+	pool->parallel_for(height, [&](std::ptrdiff_t r_begin, std::ptrdiff_t r_end, std::ptrdiff_t k) {
+		std::ptrdiff_t changed_blocks = 0;
+
+		for (std::ptrdiff_t r = r_begin; r < r_end; r++) {
+			const T *RESTRICT x_row = x + to_index(r, 0, width);
+			const T *RESTRICT FF_AY_row = FF_AY + to_index(r, 0, width);
+			T *RESTRICT dxdt_row = dxdt + to_index(r, 0, width);
+			T *RESTRICT Y_row = Y + to_padded_index(r, 0, width, halo);
+			T *RESTRICT D_row = D + to_padded_index(r, 0, width, halo);
+
+			for (std::ptrdiff_t b = 0; b < blocks_across; b++) {
+				const std::ptrdiff_t c_begin = b * feedback_block_width;
+				const std::ptrdiff_t c_end = std::min(width, c_begin + feedback_block_width);
+				unsigned char &block = changed[to_index(r, b, blocks_across)];
+				std::ptrdiff_t count = 0;
+
+				for (std::ptrdiff_t c = c_begin; c < c_end; c++) {
+					dxdt_row[c] = FF_AY_row[c] - x_row[c];
+					count += y(x_row[c]) != Y_row[c];
+				}
+
+				if (count > 0) {
+					for (std::ptrdiff_t c = c_begin; c < c_end; c++) {
+						const T y_c = y(x_row[c]);
+						D_row[c] = y_c - Y_row[c];
+						Y_row[c] = y_c;
+					}
+				} else if (block) {
+					std::fill(D_row + c_begin, D_row + c_end, T(0));
+				}
+
+				block = count > 0;
+				changed_blocks += count > 0;
+			}
+		}
+
+		incremental_partials[2 * k] = changed_blocks;
+	});
+
+	statistics.output_evaluations += dimension;
+	statistics.rhs_evaluations++;
+
+	std::ptrdiff_t changed_blocks = 0;
+
+	for (std::ptrdiff_t k = 0; k < pool->size(); k++) {
+		changed_blocks += incremental_partials[2 * k];
+	}
+
+	// Stage 2a: recompute the feedback image, fused with the rest of the RHS
+	if (feedback_age >= feedback_refresh || changed_blocks > feedback_refresh_threshold * height * blocks_across) {
+		fill_halo(Y, width, height, halo, tem.boundary_condition, y(T(tem.virtual_cell)));
+
+		pool->parallel_for(height, [&](std::ptrdiff_t r_begin, std::ptrdiff_t r_end, std::ptrdiff_t k) {
+			apply_stencil(
+				feedback, Y, FF_AY, &H[3 * width * k], width, halo, width, r_begin, r_end,
+				[&](T *RESTRICT FF_AY_row, std::ptrdiff_t r) {
+					std::copy_n(FF + to_index(r, 0, width), width, FF_AY_row);
+				},
+				[&](const T *RESTRICT FF_AY_row, std::ptrdiff_t r) {
+					const T *RESTRICT x_row = x + to_index(r, 0, width);
+					T *RESTRICT dxdt_row = dxdt + to_index(r, 0, width);
+
+					for (std::ptrdiff_t c = 0; c < width; c++) {
+						dxdt_row[c] = FF_AY_row[c] - x_row[c];
+					}
+
+					finish(dxdt_row, to_index(r, 0, width), width, k);
+				}
+			);
+		});
+
+		feedback_age = 1;
+		statistics.feedback_refreshes++;
+		return;
+	}
+
+	// Stage 2b: update the feedback image where the output changed nearby,
+	// and the derivative with it. The boundary condition applies to the
+	// change of the output as well, so with a periodic one, changes wrap
+	// around to the opposite edge.
+	fill_halo(D, width, height, halo, tem.boundary_condition, T(0));
+
+	auto block_needs_update = [&](std::ptrdiff_t r, std::ptrdiff_t b) {
+		for (std::ptrdiff_t i = r - R; i <= r + R; i++) {
+			for (std::ptrdiff_t j = b - block_reach; j <= b + block_reach; j++) {
+				std::ptrdiff_t ri = i;
+				std::ptrdiff_t bj = j;
+
+				if (periodic) {
+					ri = (ri % height + height) % height;
+					bj = (bj % blocks_across + blocks_across) % blocks_across;
+				} else if (ri < 0 || ri >= height || bj < 0 || bj >= blocks_across) {
+					continue;
+				}
+
+				if (changed[to_index(ri, bj, blocks_across)]) {
+					return true;
+				}
+			}
+		}
+
+		return false;
+	};
+
+	pool->parallel_for(height, [&](std::ptrdiff_t r_begin, std::ptrdiff_t r_end, std::ptrdiff_t k) {
+		std::ptrdiff_t updated = 0;
+
+		for (std::ptrdiff_t r = r_begin; r < r_end; r++) {
+			const T *RESTRICT x_row = x + to_index(r, 0, width);
+			T *RESTRICT FF_AY_row = FF_AY + to_index(r, 0, width);
+			T *RESTRICT dxdt_row = dxdt + to_index(r, 0, width);
+
+			// Runs of consecutive blocks in a single kernel call each
+			for (std::ptrdiff_t b = 0; b < blocks_across; b++) {
+				if (!block_needs_update(r, b)) {
+					continue;
+				}
+
+				std::ptrdiff_t b_end = b + 1;
+
+				while (b_end < blocks_across && block_needs_update(r, b_end)) {
+					b_end++;
+				}
+
+				const std::ptrdiff_t c_begin = b * feedback_block_width;
+				const std::ptrdiff_t c_end = std::min(width, b_end * feedback_block_width);
+
+				apply_stencil_segment(feedback, D, FF_AY_row, width, halo, r, c_begin, c_end);
+
+				for (std::ptrdiff_t c = c_begin; c < c_end; c++) {
+					dxdt_row[c] = FF_AY_row[c] - x_row[c];
+				}
+
+				updated += c_end - c_begin;
+				b = b_end;
+			}
+
+			finish(dxdt_row, to_index(r, 0, width), width, k);
+		}
+
+		incremental_partials[2 * k + 1] = updated;
+	});
+
+	for (std::ptrdiff_t k = 0; k < pool->size(); k++) {
+		statistics.feedback_cells_updated += incremental_partials[2 * k + 1];
+	}
+
+	feedback_age++;
+}
+
+// The same as dynamic_eq(), but one tile at a time: the output image of each
+// tile (plus its halo) is computed into a small per thread buffer, and is
+// consumed by the stencil right away, while it is still in the cache. This
+// costs some redundant evaluations of y(x) in the halos of the tiles, but the
+// output image of the whole state never has to go through main memory.
+// The result is the same as that of the untiled version, bit by bit.
+//
+// With the active set, frozen tiles are skipped; since they need much less
+// work than the active ones, tiles are handed out to threads dynamically.
+// Tiles frozen for a whole step are not even visited: by then, every image
+// the integrator computed from their zero derivative is the same as the state.
+template<typename T>
+template<typename Fn>
+void BasicCNN<T>::dynamic_eq_tiled(const T *RESTRICT x, T *RESTRICT dxdt, const Fn &finish)
+{
+	const std::ptrdiff_t num_tiles = tiles_across * tiles_down;
+
+	if (active_set) {
+		pool->parallel_for_dynamic(visited_tiles, [&](std::ptrdiff_t j, std::ptrdiff_t k) {
+			if (j < active_tiles) {
+				evaluate_tile(x, dxdt, tile_order[j], k, finish);
+			} else {
+				skip_tile(x, dxdt, tile_order[j], k, finish);
+			}
+		});
+
+		statistics.output_evaluations += active_output_evaluations;
+		statistics.tile_evaluations += num_tiles;
+		statistics.frozen_tile_evaluations += num_tiles - active_tiles;
+	} else {
+		pool->parallel_for(num_tiles, [&](std::ptrdiff_t begin, std::ptrdiff_t end, std::ptrdiff_t k) {
+			for (std::ptrdiff_t i = begin; i < end; i++) {
+				evaluate_tile(x, dxdt, i, k, finish);
+			}
+		});
+
+		statistics.output_evaluations += tile_output_evaluations;
+	}
+
+	statistics.rhs_evaluations++;
+}
+
+// The RHS of tile 'i' (in row major order), using the scratch space of thread 'k'
+template<typename T>
+template<typename Fn>
+void BasicCNN<T>::evaluate_tile(const T *RESTRICT x, T *RESTRICT dxdt, std::ptrdiff_t i, std::ptrdiff_t k, const Fn &finish)
+{
+	const T *RESTRICT FF = this->FF.data();
+	const std::ptrdiff_t tile_size = (tile_width + 2 * halo) * (tile_height + 2 * halo);
+	T *RESTRICT Y_tile = &Y[tile_size * k];
+	T *RESTRICT H_tile = &H[3 * width * k];
+
+	const std::ptrdiff_t r0 = i / tiles_across * tile_height;
+	const std::ptrdiff_t c0 = i % tiles_across * tile_width;
+	const std::ptrdiff_t tw = std::min(tile_width, width - c0);
+	const std::ptrdiff_t th = std::min(tile_height, height - r0);
+
+	// Without feedback, the output image is not needed at all
+	if (feedback.shape != StencilZero) {
+		fill_output_tile(x, Y_tile, r0, c0, tw, th);
+	}
+
+	apply_stencil(
+		feedback, Y_tile, dxdt + to_index(r0, c0, width), H_tile, tw, halo, width, 0, th,
+		[&](T *RESTRICT dxdt_row, std::ptrdiff_t r) {
+			const T *RESTRICT FF_row = FF + to_index(r0 + r, c0, width);
+			const T *RESTRICT x_row = x + to_index(r0 + r, c0, width);
+
+			for (std::ptrdiff_t c = 0; c < tw; c++) {
+				dxdt_row[c] = FF_row[c] - x_row[c];
+			}
+		},
+		[&](T *RESTRICT dxdt_row, std::ptrdiff_t r) {
+			finish(dxdt_row, to_index(r0 + r, c0, width), tw, k);
+		}
+	);
+}
+
+// A frozen tile: its state is kept constant. The integrator still has to
+// see its (zero) derivative, since it builds the next state (and others,
+// which take the place of the state later) from it.
+template<typename T>
+template<typename Fn>
+void BasicCNN<T>::skip_tile(const T *RESTRICT, T *RESTRICT dxdt, std::ptrdiff_t i, std::ptrdiff_t k, const Fn &finish)
+{
+	const std::ptrdiff_t r0 = i / tiles_across * tile_height;
+	const std::ptrdiff_t c0 = i % tiles_across * tile_width;
+	const std::ptrdiff_t tw = std::min(tile_width, width - c0);
+	const std::ptrdiff_t th = std::min(tile_height, height - r0);
+
+	for (std::ptrdiff_t r = r0; r < r0 + th; r++) {
+		T *RESTRICT dxdt_row = dxdt + to_index(r, c0, width);
+		std::fill_n(dxdt_row, tw, T(0));
+		finish(dxdt_row, to_index(r, c0, width), tw, k);
+	}
+}
+
+// out = alpha * v + beta * A * (y'(x) * v). The Jacobian of the state
+// equation (alpha = -1, beta = 1) and the matrices of the linear systems of
+// implicit methods are all of this form. Constant virtual cells don't depend
+// on the state, so their part of the product is 0; otherwise the boundary
+// condition is the same as that of the output image.
+template<typename T>
+void BasicCNN<T>::coupling_product(const T *RESTRICT x, const T *RESTRICT v, T *RESTRICT out, T alpha, T beta)
+{
+	T *RESTRICT V = jacobian_image.data();
+
+	pool->parallel_for(height, [&](std::ptrdiff_t r_begin, std::ptrdiff_t r_end, std::ptrdiff_t) {
+		for (std::ptrdiff_t r = r_begin; r < r_end; r++) {
+			const T *RESTRICT x_row = x + to_index(r, 0, width);
+			const T *RESTRICT v_row = v + to_index(r, 0, width);
+			T *RESTRICT V_row = V + to_padded_index(r, 0, width, halo);
+
+			for (std::ptrdiff_t c = 0; c < width; c++) {
+				V_row[c] = T(-1) < x_row[c] && x_row[c] < T(1) ? v_row[c] : T(0);
+			}
+		}
+	});
+
+	fill_halo(V, width, height, halo, tem.boundary_condition, T(0));
+
+	pool->parallel_for(height, [&](std::ptrdiff_t r_begin, std::ptrdiff_t r_end, std::ptrdiff_t k) {
+		apply_stencil(
+			feedback, V, out, &H[3 * width * k], width, halo, width, r_begin, r_end,
+			[&](T *RESTRICT out_row, std::ptrdiff_t) {
+				std::fill_n(out_row, width, T(0));
+			},
+			[&](T *RESTRICT out_row, std::ptrdiff_t r) {
+				const T *RESTRICT v_row = v + to_index(r, 0, width);
+
+				for (std::ptrdiff_t c = 0; c < width; c++) {
+					out_row[c] = alpha * v_row[c] + beta * out_row[c];
+				}
+			}
+		);
+	});
+
+	statistics.jacobian_products++;
+}
+
+template<typename T>
+void BasicCNN<T>::jacobian_product(const std::vector<T> &x, const std::vector<T> &v, std::vector<T> *Jv)
+{
+	assert(x.size() == std::size_t(dimension) && v.size() == std::size_t(dimension) && "vectors must have one element per cell");
+
+	jacobian_image.resize((width + 2 * halo) * (height + 2 * halo));
+	Jv->resize(dimension);
+
+	coupling_product(x.data(), v.data(), Jv->data(), T(-1), T(1));
+}
+
+// Solves (I - gamma_h * J(x)) z = b using BiCGSTAB, which only needs products
+// of the (sparse, nonsymmetric) matrix with vectors, and is preconditioned
+// with the diagonal of the matrix (Jacobi): 1 + gamma_h in saturated cells,
+// and 1 + gamma_h * (1 - a_00) in linear ones, where a_00 is the centre of
+// the A template. The vector operations between two products are fused into
+// a single pass each, computing the dot products along the way.
+// Returns false if the solution didn't converge.
+template<typename T>
+bool BasicCNN<T>::solve_newton_system(const T *RESTRICT x, const T *RESTRICT b, T *RESTRICT z, T gamma_h)
+{
+	const int max_iterations = 100;
+	const double tol = std::max(1.0e-2 * std::min(rel_tol, abs_tol), 10.0 * std::numeric_limits<T>::epsilon());
+
+	const T alpha = 1 + gamma_h;
+	const T beta = -gamma_h;
+	const T centre = feedback.coeffs[(2 * feedback.radius + 1) * feedback.radius + feedback.radius];
+	const T inv_diag_linear = 1 / (alpha + beta * centre);
+	const T inv_diag_saturated = 1 / alpha;
+
+	auto inv_diag = [&](T x_i) {
+		return T(-1) < x_i && x_i < T(1) ? inv_diag_linear : inv_diag_saturated;
+	};
+
+	T *RESTRICT r = krylov[0].data();
+	T *RESTRICT r0 = krylov[1].data();
+	T *RESTRICT p = krylov[2].data();
+	T *RESTRICT v = krylov[3].data();
+	T *RESTRICT p_hat = krylov[4].data();
+	T *RESTRICT s_hat = krylov[5].data();
+	T *RESTRICT t = krylov[6].data();
+
+	// A parallel pass over the vectors, computing two sums along the way
+	auto reduce = [&](auto fn) {
+		std::fill(partial_sums.begin(), partial_sums.end(), 0.0);
+
+		pool->parallel_for(dimension, [&](std::ptrdiff_t begin, std::ptrdiff_t end, std::ptrdiff_t k) {
+			fn(begin, end, &partial_sums[2 * k]);
+		});
+
+		std::array<double, 2> sums = { 0.0, 0.0 };
+
+		for (std::ptrdiff_t k = 0; k < pool->size(); k++) {
+			sums[0] += partial_sums[2 * k];
+			sums[1] += partial_sums[2 * k + 1];
+		}
+
+		return sums;
+	};
+
+	// Initial guess: the solution of the diagonal part
+	pool->parallel_for(dimension, [&](std::ptrdiff_t begin, std::ptrdiff_t end, std::ptrdiff_t) {
+		for (std::ptrdiff_t i = begin; i < end; i++) {
+			z[i] = b[i] * inv_diag(x[i]);
+		}
+	});
+
+	coupling_product(x, z, r, alpha, beta);
+
+	auto norms = reduce([&](std::ptrdiff_t begin, std::ptrdiff_t end, double *sums) {
+		for (std::ptrdiff_t i = begin; i < end; i++) {
+			r[i] = b[i] - r[i];
+			r0[i] = r[i];
+			p[i] = 0;
+			v[i] = 0;
+			sums[0] += double(r[i]) * r[i];
+			sums[1] += double(b[i]) * b[i];
+		}
+	});
+
+	const double tol2 = tol * tol * norms[1];
+	double rho = 1, a = 1, omega = 1;
+	double rho_next = norms[0];
+
+	if (norms[0] <= tol2) {
+		return true;
+	}
+
+	for (int iteration = 0; iteration < max_iterations; iteration++) {
+		statistics.linear_iterations++;
+
+		if (rho_next == 0 || omega == 0) {
+			return false;
+		}
+
+		const T beta_k = T(rho_next / rho * (a / omega));
+		const T omega_k = T(omega);
+
+		pool->parallel_for(dimension, [&](std::ptrdiff_t begin, std::ptrdiff_t end, std::ptrdiff_t) {
+			for (std::ptrdiff_t i = begin; i < end; i++) {
+				p[i] = r[i] + beta_k * (p[i] - omega_k * v[i]);
+				p_hat[i] = p[i] * inv_diag(x[i]);
+			}
+		});
+
+		coupling_product(x, p_hat, v, alpha, beta);
+
+		auto r0v = reduce([&](std::ptrdiff_t begin, std::ptrdiff_t end, double *sums) {
+			for (std::ptrdiff_t i = begin; i < end; i++) {
+				sums[0] += double(r0[i]) * v[i];
+			}
+		});
+
+		if (r0v[0] == 0) {
+			return false;
+		}
+
+		rho = rho_next;
+		a = rho / r0v[0];
+		const T a_k = T(a);
+
+		// s = r - a * v, in place of r
+		auto s_norm = reduce([&](std::ptrdiff_t begin, std::ptrdiff_t end, double *sums) {
+			for (std::ptrdiff_t i = begin; i < end; i++) {
+				r[i] -= a_k * v[i];
+				s_hat[i] = r[i] * inv_diag(x[i]);
+				sums[0] += double(r[i]) * r[i];
+			}
+		});
+
+		if (s_norm[0] <= tol2) {
+			pool->parallel_for(dimension, [&](std::ptrdiff_t begin, std::ptrdiff_t end, std::ptrdiff_t) {
+				for (std::ptrdiff_t i = begin; i < end; i++) {
+					z[i] += a_k * p_hat[i];
+				}
+			});
+
+			return true;
+		}
+
+		coupling_product(x, s_hat, t, alpha, beta);
+
+		auto ts = reduce([&](std::ptrdiff_t begin, std::ptrdiff_t end, double *sums) {
+			for (std::ptrdiff_t i = begin; i < end; i++) {
+				sums[0] += double(t[i]) * r[i];
+				sums[1] += double(t[i]) * t[i];
+			}
+		});
+
+		if (ts[1] == 0) {
+			return false;
+		}
+
+		omega = ts[0] / ts[1];
+		const T omega_next = T(omega);
+
+		auto r_norms = reduce([&](std::ptrdiff_t begin, std::ptrdiff_t end, double *sums) {
+			for (std::ptrdiff_t i = begin; i < end; i++) {
+				z[i] += a_k * p_hat[i] + omega_next * s_hat[i];
+				r[i] -= omega_next * t[i];
+				sums[0] += double(r0[i]) * r[i];
+				sums[1] += double(r[i]) * r[i];
+			}
+		});
+
+		rho_next = r_norms[0];
+
+		if (r_norms[1] <= tol2) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Steady-state detection, and the active set. Each step observes the
+// derivative at the state it starts from, part by part (fused into the RHS
+// evaluation that computes it), then decides whether the simulation can stop
+// there, or which tiles can be frozen.
+//
+// If every cell is saturated, and so is its equilibrium, the output can't
+// change any more: with a constant output, dx/dt = -x + w for a constant w, so
+// x moves monotonically towards w = x + dx/dt, and if that is beyond the same
+// saturation limit (x >= 1 and w >= 1, or x <= -1 and w <= -1), so is x ever
+// after. This also holds for cells which approach w from beyond the limit, as
+// the adaptive integrators leave converged cells slightly around w.
+// Otherwise, the state is only considered steady once the largest |dx/dt| has
+// stayed below 'steady_tol' for 'steady_time', which is a heuristic. That
+// needs 'steady_tol' to be above the error the integrator leaves in dx/dt.
+template<typename T>
+void BasicCNN<T>::begin_steady_check()
+{
+	for (std::ptrdiff_t k = 0; k < pool->size(); k++) {
+		steady_partials[2 * k] = 0.0;
+		steady_partials[2 * k + 1] = 1.0;
+	}
+
+	for (auto &settled : tile_settled) {
+		settled.store(1, std::memory_order_relaxed);
+	}
+}
+
+// 'x' and 'dxdt' point to the part at 'offset', which has 'n' elements
+template<typename T>
+void BasicCNN<T>::observe_derivative(
+	const T *RESTRICT x,
+	const T *RESTRICT dxdt,
+	std::ptrdiff_t offset,
+	std::ptrdiff_t n,
+	std::ptrdiff_t thread
 )
 {
-	// regular case, inner cells
-	if (0 <= r && r < height && 0 <= c && c < width) {
-		return mat[to_index(r, c, width)];
+	if (!stop_when_steady && !active_set) {
+		return;
+	}
+
+	T rate = T(steady_partials[2 * thread]);
+	bool saturated = steady_partials[2 * thread + 1] != 0.0;
+
+	// With the active set, piece by piece within a single tile. Parts of a
+	// tiled RHS evaluation are always in a single tile, so this is one piece.
+	for (std::ptrdiff_t begin = 0, end; begin < n; begin = end) {
+		const std::ptrdiff_t r = (offset + begin) / width;
+		const std::ptrdiff_t c = (offset + begin) % width;
+		std::ptrdiff_t unsettled = 0;
+
+		end = active_set ? std::min(n, begin + std::min(width, (c / tile_width + 1) * tile_width) - c) : n;
+
+		// Frozen tiles are known to be saturated, with a zero derivative
+		if (active_set && tile_frozen[r / tile_height * tiles_across + c / tile_width]) {
+			continue;
+		}
+
+		for (std::ptrdiff_t i = begin; i < end; i++) {
+			const T w = x[i] + dxdt[i];
+			const bool settled = (x[i] >= T(1) && w >= T(1)) || (x[i] <= T(-1) && w <= T(-1));
+			rate = std::max(rate, std::fabs(dxdt[i]));
+			unsettled += !settled;
+		}
+
+		if (unsettled > 0) {
+			saturated = false;
+
+			if (active_set) {
+				tile_settled[r / tile_height * tiles_across + c / tile_width].store(0, std::memory_order_relaxed);
+			}
+		}
+	}
+
+	steady_partials[2 * thread] = rate;
+	steady_partials[2 * thread + 1] = saturated;
+}
+
+// 't' is the time of the observed state. Returns true if it's steady.
+template<typename T>
+bool BasicCNN<T>::end_steady_check(double t)
+{
+	double rate = 0.0;
+	bool saturated = true;
+
+	for (std::ptrdiff_t k = 0; k < pool->size(); k++) {
+		rate = std::max(rate, steady_partials[2 * k]);
+		saturated = saturated && steady_partials[2 * k + 1] != 0.0;
+	}
+
+	if (rate < steady_tol) {
+		if (steady_since < 0) {
+			steady_since = t;
+		}
+	} else {
+		steady_since = -1.0;
+	}
+
+	if (saturated || (steady_since >= 0 && t - steady_since >= steady_time)) {
+		statistics.steady = true;
+		statistics.settling_time = steady_since >= 0 ? steady_since : t;
+		return true;
+	}
+
+	return false;
+}
+
+// A tile is frozen for the next step if its cells, and their equilibria, were
+// found saturated in this one (or it was frozen already), and so was every
+// tile its neighborhood reaches into: then its output, and that of its
+// neighbors, are constant. Otherwise it's active. Since a saturated cell only
+// enters the linear region after its equilibrium was found in it in a step,
+// which wakes up all tiles around it for the next one, frozen tiles miss at
+// most a step's worth of change of their neighborhood, with large steps and
+// sudden changes.
+//
+// Tiles are evaluated in the order: active ones, ones frozen in this step,
+// then ones that had been frozen before, which are skipped altogether.
+template<typename T>
+void BasicCNN<T>::update_active_set()
+{
+	const bool periodic = tem.boundary_condition == Periodic;
+	const std::ptrdiff_t num_tiles = tiles_across * tiles_down;
+	bool changed = false;
+
+	for (std::ptrdiff_t i = 0; i < num_tiles; i++) {
+		if (tile_frozen[i]) {
+			tile_settled[i].store(1, std::memory_order_relaxed);
+		}
+	}
+
+	active_output_evaluations = 0;
+
+	for (std::ptrdiff_t ti = 0; ti < tiles_down; ti++) {
+		for (std::ptrdiff_t tj = 0; tj < tiles_across; tj++) {
+			const std::ptrdiff_t i = ti * tiles_across + tj;
+			bool frozen = true;
+
+			for (std::ptrdiff_t di = -tile_reach_y; di <= tile_reach_y && frozen; di++) {
+				for (std::ptrdiff_t dj = -tile_reach_x; dj <= tile_reach_x && frozen; dj++) {
+					std::ptrdiff_t ni = ti + di;
+					std::ptrdiff_t nj = tj + dj;
+
+					// Other boundary conditions don't read from other tiles
+					if (periodic) {
+						ni = (ni % tiles_down + tiles_down) % tiles_down;
+						nj = (nj % tiles_across + tiles_across) % tiles_across;
+					} else if (ni < 0 || ni >= tiles_down || nj < 0 || nj >= tiles_across) {
+						continue;
+					}
+
+					frozen = tile_settled[ni * tiles_across + nj].load(std::memory_order_relaxed) != 0;
+				}
+			}
+
+			changed = changed || frozen != bool(tile_frozen[i]);
+			tile_frozen[i] = frozen ? (tile_frozen[i] ? 2 : 1) : 0;
+
+			if (!frozen && feedback.shape != StencilZero) {
+				const std::ptrdiff_t tw = std::min(tile_width, width - tj * tile_width);
+				const std::ptrdiff_t th = std::min(tile_height, height - ti * tile_height);
+				active_output_evaluations += (tw + 2 * halo) * (th + 2 * halo);
+			}
+		}
+	}
+
+	std::ptrdiff_t n = 0;
+
+	for (unsigned char state = 0; state <= 2; state++) {
+		for (std::ptrdiff_t i = 0; i < num_tiles; i++) {
+			if (tile_frozen[i] == state) {
+				tile_order[n++] = i;
+			}
+		}
+
+		if (state == 0) {
+			active_tiles = n;
+		} else if (state == 1) {
+			visited_tiles = n;
+		}
+	}
+
+	// A derivative that survived the step was computed with the old active set
+	if (changed) {
+		first_stage_valid = false;
+	}
+}
+
+// GSL glue: only the double precision simulator can be driven by GSL.
+template<typename T>
+int BasicCNN<T>::gsl_dynamic_eq(double, const double *RESTRICT, double *RESTRICT, void *)
+{
+	assert(0 && "GSL only supports double precision");
+	return GSL_FAILURE;
+}
+
+template<>
+int BasicCNN<double>::gsl_dynamic_eq(double, const double *RESTRICT x, double *RESTRICT dxdt, void *param)
+{
+	static_cast<BasicCNN<double> *>(param)->dynamic_eq(x, dxdt);
+	return GSL_SUCCESS;
+}
+
+template<typename T>
+void BasicCNN<T>::init_gsl()
+{
+	assert(0 && "GSL only supports double precision");
+}
+
+template<>
+void BasicCNN<double>::init_gsl()
+{
+	// The workspaces of the previous simulation do for one of the same size
+	if (stepper && evolver && ode.dimension == std::size_t(dimension)) {
+		gsl_odeiv2_step_reset(stepper.get());
+		gsl_odeiv2_evolve_reset(evolver.get());
+		return;
+	}
+
+	ode.function = gsl_dynamic_eq;
+	ode.jacobian = nullptr;
+	ode.dimension = dimension;
+	ode.params = this;
+
+	// Runge-Kutta-Fehlberg method of order 4-5
+	stepper.reset(gsl_odeiv2_step_alloc(gsl_odeiv2_step_rkf45, dimension));
+	evolver.reset(gsl_odeiv2_evolve_alloc(dimension));
+
+	if (!control) {
+		control.reset(gsl_odeiv2_control_standard_new(abs_tol, rel_tol, 1, 1));
+	}
+}
+
+template<typename T>
+bool BasicCNN<T>::step_gsl(double *)
+{
+	assert(0 && "GSL only supports double precision");
+	return false;
+}
+
+template<>
+bool BasicCNN<double>::step_gsl(double *t)
+{
+	ode.params = this;
+
+	int status = gsl_odeiv2_evolve_apply(
+		evolver.get(),
+		control.get(),
+		stepper.get(),
+		&ode,
+		t,
+		t_max,
+		&h,
+		&x[0]
+	);
+
+	return status == GSL_SUCCESS && *t < t_max;
+}
+
+// One adaptive step of a built-in embedded Runge-Kutta method; see
+// embedded_rk.hh. The first stage is fused with the steady-state check.
+template<typename T>
+bool BasicCNN<T>::step_embedded_rk(const EmbeddedRKTableau &tableau, double *t)
+{
+	return embedded_rk_step(this, tableau, t, [this] {
+		begin_steady_check();
+	}, [this](const T *x, const T *k1, std::ptrdiff_t offset, std::ptrdiff_t n, std::ptrdiff_t p) {
+		observe_derivative(x, k1, offset, n, p);
+	});
+}
+
+// One adaptive step of the 2-stage Rosenbrock method ROS2 (Verwer et al.).
+// It is L-stable, so the step size is only limited by the accuracy, and not
+// by the stiffness of strongly self-coupled templates, which force explicit
+// methods to take tiny steps. Being linearly implicit, it needs no Newton
+// iterations: each stage solves a linear system with the matrix
+// I - gamma * dt * J, where J is the Jacobian at the beginning of the step.
+// The error estimate is the difference from the embedded linearly implicit
+// Euler solution, x + dt * k1; step size control is the same as above.
+template<typename T>
+bool BasicCNN<T>::step_ros2(double *t)
+{
+	const double order = 2;
+	const double gamma = 1 + 1 / std::sqrt(2.0);
+
+	const T *RESTRICT x0 = x.data();
+	const T *RESTRICT f0 = k[0].data();
+	const T *RESTRICT k1 = k[1].data();
+	const T *RESTRICT k2 = k[3].data();
+	T *RESTRICT x1 = x_trial[0].data();
+	T *RESTRICT x_new = x_trial[1].data();
+
+	// f(x) doesn't depend on the step size, so it survives rejections
+	if (!first_stage_valid) {
+		begin_steady_check();
+
+		dynamic_eq(x0, k[0].data(), [&](T *f0p, std::ptrdiff_t offset, std::ptrdiff_t n, std::ptrdiff_t p) {
+			observe_derivative(x0 + offset, f0p, offset, n, p);
+		});
+
+		first_stage_valid = true;
+	}
+
+	for (;;) {
+		double dt = std::min(h, t_max - *t);
+		const T step = T(dt);
+		const T gamma_h = T(gamma * dt);
+
+		// Stage 1: (I - gamma * dt * J) k1 = f(x)
+		if (!solve_newton_system(x0, f0, k[1].data(), gamma_h)) {
+			h = dt / 2;
+			continue;
+		}
+
+		// Stage 2: (I - gamma * dt * J) k2 = f(x + dt * k1) - 2 * k1
+		pool->parallel_for(dimension, [&](std::ptrdiff_t begin, std::ptrdiff_t end, std::ptrdiff_t) {
+			for (std::ptrdiff_t i = begin; i < end; i++) {
+				x1[i] = x0[i] + step * k1[i];
+			}
+		});
+
+		dynamic_eq(x1, k[2].data(), [&](T *RESTRICT f1p, std::ptrdiff_t offset, std::ptrdiff_t n, std::ptrdiff_t) {
+			const T *RESTRICT k1p = k1 + offset;
+
+			for (std::ptrdiff_t i = 0; i < n; i++) {
+				f1p[i] -= 2 * k1p[i];
+			}
+		});
+
+		if (!solve_newton_system(x0, k[2].data(), k[3].data(), gamma_h)) {
+			h = dt / 2;
+			continue;
+		}
+
+		// New state, and the maximal scaled error estimate
+		pool->parallel_for(dimension, [&](std::ptrdiff_t begin, std::ptrdiff_t end, std::ptrdiff_t p) {
+			double err_max = 0.0;
+
+			for (std::ptrdiff_t i = begin; i < end; i++) {
+				T dx = step * (T(1.5) * k1[i] + T(0.5) * k2[i]);
+				T err = step * (T(0.5) * (k1[i] + k2[i]));
+
+				x_new[i] = x0[i] + dx;
+
+				double D = abs_tol + rel_tol * (std::fabs(double(x_new[i])) + std::fabs(double(dx)));
+				err_max = std::max(err_max, std::fabs(double(err)) / D);
+			}
+
+			partial_errors[p] = err_max;
+		});
+
+		double rmax = *std::max_element(partial_errors.begin(), partial_errors.begin() + pool->size());
+
+		if (rmax > 1.1) {
+			// reject, and retry with a smaller step
+			h = dt * std::max(0.2, 0.9 * std::pow(rmax, -1.0 / order));
+			continue;
+		}
+
+		std::swap(x, x_trial[1]);
+		*t += dt;
+		first_stage_valid = false;
+
+		if (rmax < 0.5) {
+			h = dt * std::min(5.0, std::max(1.0, 0.9 * std::pow(rmax, -1.0 / (order + 1))));
+		}
+
+		return *t < t_max;
+	}
+}
+
+// The fixed-step methods below fuse each of their passes over the state
+// into the RHS evaluation: the derivative of each part of the image is
+// combined into the next stage (or the new state) right after it's complete.
+// Since the RHS of a tiled image reads the state of neighboring tiles, the
+// result is always written into a separate buffer, never in place. The last
+// step is shortened so that the simulation ends exactly at t_max.
+
+// One step of the forward Euler method
+template<typename T>
+bool BasicCNN<T>::step_euler(double *t)
+{
+	if (time_block > 1) {
+		return step_blocked(t);
 	}
 
-	// boundary: r < 0 || r >= height || c < 0 || c >= width
-	switch (tem.boundary_condition) {
-		case Constant:
-			return tem.virtual_cell;
+	const T step = T(std::min(dt, t_max - *t));
+	const T *RESTRICT x0 = x.data();
+
+	begin_steady_check();
+
+	// k[0] is the derivative, then the new state, part by part
+	dynamic_eq(x0, k[0].data(), [&](T *RESTRICT k1, std::ptrdiff_t offset, std::ptrdiff_t n, std::ptrdiff_t p) {
+		const T *RESTRICT xp = x0 + offset;
+
+		observe_derivative(xp, k1, offset, n, p);
+
+		for (std::ptrdiff_t i = 0; i < n; i++) {
+			k1[i] = xp[i] + step * k1[i];
+		}
+	});
+
+	std::swap(x, k[0]);
+	*t = std::min(*t + dt, t_max);
+
+	return *t < t_max;
+}
+
+// One step of Heun's method (the explicit trapezoidal rule)
+template<typename T>
+bool BasicCNN<T>::step_heun(double *t)
+{
+	if (time_block > 1) {
+		return step_blocked(t);
+	}
+
+	const T step = T(std::min(dt, t_max - *t));
+	const T half_step = step / 2;
+	const T *RESTRICT x0 = x.data();
+	const T *RESTRICT k1 = k[0].data();
+	T *RESTRICT x1 = x_trial[0].data();
+
+	begin_steady_check();
+
+	dynamic_eq(x0, k[0].data(), [&](T *RESTRICT k1p, std::ptrdiff_t offset, std::ptrdiff_t n, std::ptrdiff_t p) {
+		const T *RESTRICT xp = x0 + offset;
+		T *RESTRICT x1p = x1 + offset;
+
+		observe_derivative(xp, k1p, offset, n, p);
+
+		for (std::ptrdiff_t i = 0; i < n; i++) {
+			x1p[i] = xp[i] + step * k1p[i];
+		}
+	});
+
+	// k[1] is the second derivative, then the new state
+	dynamic_eq(x1, k[1].data(), [&](T *RESTRICT k2p, std::ptrdiff_t offset, std::ptrdiff_t n, std::ptrdiff_t) {
+		const T *RESTRICT xp = x0 + offset;
+		const T *RESTRICT k1p = k1 + offset;
+
+		for (std::ptrdiff_t i = 0; i < n; i++) {
+			k2p[i] = xp[i] + half_step * (k1p[i] + k2p[i]);
+		}
+	});
+
+	std::swap(x, k[1]);
+	*t = std::min(*t + dt, t_max);
+
+	return *t < t_max;
+}
+
+// One step of the classic 4th order Runge-Kutta method
+template<typename T>
+bool BasicCNN<T>::step_rk4(double *t)
+{
+	const T step = T(std::min(dt, t_max - *t));
+	const T half_step = step / 2;
+	const T sixth_step = step / 6;
+	const T *RESTRICT x0 = x.data();
+	const T *RESTRICT k1 = k[0].data();
+	const T *RESTRICT k2 = k[1].data();
+	const T *RESTRICT k3 = k[2].data();
+
+	// The trial states alternate between two buffers, since
+	// a stage may not overwrite the state it is evaluated at
+	T *RESTRICT xa = x_trial[0].data();
+	T *RESTRICT xb = x_trial[1].data();
+
+	begin_steady_check();
+
+	dynamic_eq(x0, k[0].data(), [&](T *RESTRICT kp, std::ptrdiff_t offset, std::ptrdiff_t n, std::ptrdiff_t p) {
+		const T *RESTRICT xp = x0 + offset;
+		T *RESTRICT xt = xa + offset;
+
+		observe_derivative(xp, kp, offset, n, p);
+
+		for (std::ptrdiff_t i = 0; i < n; i++) {
+			xt[i] = xp[i] + half_step * kp[i];
+		}
+	});
+
+	dynamic_eq(xa, k[1].data(), [&](T *RESTRICT kp, std::ptrdiff_t offset, std::ptrdiff_t n, std::ptrdiff_t) {
+		const T *RESTRICT xp = x0 + offset;
+		T *RESTRICT xt = xb + offset;
+
+		for (std::ptrdiff_t i = 0; i < n; i++) {
+			xt[i] = xp[i] + half_step * kp[i];
+		}
+	});
+
+	dynamic_eq(xb, k[2].data(), [&](T *RESTRICT kp, std::ptrdiff_t offset, std::ptrdiff_t n, std::ptrdiff_t) {
+		const T *RESTRICT xp = x0 + offset;
+		T *RESTRICT xt = xa + offset;
+
+		for (std::ptrdiff_t i = 0; i < n; i++) {
+			xt[i] = xp[i] + step * kp[i];
+		}
+	});
+
+	// k[3] is the fourth derivative, then the new state
+	dynamic_eq(xa, k[3].data(), [&](T *RESTRICT k4p, std::ptrdiff_t offset, std::ptrdiff_t n, std::ptrdiff_t) {
+		const T *RESTRICT xp = x0 + offset;
+		const T *RESTRICT k1p = k1 + offset;
+		const T *RESTRICT k2p = k2 + offset;
+		const T *RESTRICT k3p = k3 + offset;
+
+		for (std::ptrdiff_t i = 0; i < n; i++) {
+			k4p[i] = xp[i] + sixth_step * (k1p[i] + 2 * (k2p[i] + k3p[i]) + k4p[i]);
+		}
+	});
+
+	std::swap(x, k[3]);
+	*t = std::min(*t + dt, t_max);
+
+	return *t < t_max;
+}
+
+// Up to 'time_block' steps of forward Euler or Heun's method at once, with
+// overlapped temporal blocking: each tile is loaded together with a halo as
+// wide as the region its cells depend on after that many steps (the radius
+// of the A template per RHS evaluation, so twice that per step of Heun's
+// method), and is advanced through all of them while it is in the cache.
+// Every RHS evaluation shrinks the region that is still valid by the radius,
+// so only the tile itself is correct after the last step, and is written back.
+//
+// The cells outside of the image are resolved like fill_halo() would, from
+// the current state of the tile: with a periodic boundary condition, they
+// are simply simulated too, since they are copies of cells of the image;
+// with zero-flux, they read the output of the nearest cell of the image.
+// Thus every cell goes through the same arithmetic as in step_euler() or
+// step_heun(), and the result is the same, bit by bit.
+template<typename T>
+bool BasicCNN<T>::step_blocked(double *t)
+{
+	// The step sizes of this block, the same as step_euler() would use
+	T steps[MaxTimeBlock];
+	std::ptrdiff_t n_steps = 0;
+
+	do {
+		steps[n_steps++] = T(std::min(dt, t_max - *t));
+		*t = std::min(*t + dt, t_max);
+	} while (n_steps < time_block && *t < t_max);
+
+	const bool heun = statistics.method == MethodHeun;
+	const std::ptrdiff_t stages = heun ? 2 : 1;
+	const std::ptrdiff_t R = feedback.radius;
+	const std::ptrdiff_t margin = n_steps * stages * R;
+	const BoundaryCondition bc = tem.boundary_condition;
+	const T x_virtual = T(tem.virtual_cell);
+	const T y_virtual = y(x_virtual);
+
+	const T *RESTRICT x = this->x.data();
+	const T *RESTRICT FF = this->FF.data();
+	T *RESTRICT x_next = k[0].data();
+
+	begin_steady_check();
+
+	pool->parallel_for(tiles_across * tiles_down, [&](std::ptrdiff_t begin, std::ptrdiff_t end, std::ptrdiff_t p) {
+		const std::ptrdiff_t ww_max = tile_width + 2 * time_block * stages * R;
+		const std::ptrdiff_t wh_max = tile_height + 2 * time_block * stages * R;
+		const std::ptrdiff_t window_max = ww_max * wh_max;
+
+		// Heun's method also keeps the trial state and the first derivative
+		T *RESTRICT X = &block_buffers[block_buffer_size * p];
+		T *RESTRICT F = X + window_max;
+		T *RESTRICT Y = F + window_max;
+		T *RESTRICT D = Y + window_max;
+		T *RESTRICT H = D + window_max;
+		T *RESTRICT X1 = H + 3 * ww_max;
+		T *RESTRICT K1 = X1 + window_max;
+		std::ptrdiff_t *RESTRICT row_src = &block_index[(ww_max + wh_max) * p];
+		std::ptrdiff_t *RESTRICT col_src = row_src + wh_max;
+
+		for (std::ptrdiff_t i = begin; i < end; i++) {
+			const std::ptrdiff_t r0 = i / tiles_across * tile_height - margin;
+			const std::ptrdiff_t c0 = i % tiles_across * tile_width - margin;
+			const std::ptrdiff_t th = std::min(tile_height, height - (r0 + margin));
+			const std::ptrdiff_t tw = std::min(tile_width, width - (c0 + margin));
+			const std::ptrdiff_t wh = th + 2 * margin;
+			const std::ptrdiff_t ww = tw + 2 * margin;
 
-		case ZeroFlux:
-			if (r < 0) {
-				r = 0;
-			} else if (r >= height) {
-				r = height - 1;
+			// The columns of the window that are inside the image, and
+			// need no boundary handling. With a periodic boundary, all of them.
+			const std::ptrdiff_t c_begin = bc == Periodic ? 0 : std::max(-c0, std::ptrdiff_t(0));
+			const std::ptrdiff_t c_end = bc == Periodic ? ww : std::min(width - c0, ww);
+
+			// Where each row and column of the window reads its output from,
+			// in window coordinates (-1 for the constant virtual cell)
+			for (std::ptrdiff_t r = 0; r < wh; r++) {
+				const std::ptrdiff_t src = boundary_index(r0 + r, height, bc);
+				row_src[r] = src < 0 ? -1 : bc == Periodic ? r : src - r0;
+			}
+
+			for (std::ptrdiff_t c = 0; c < ww; c++) {
+				const std::ptrdiff_t src = boundary_index(c0 + c, width, bc);
+				col_src[c] = src < 0 ? -1 : bc == Periodic ? c : src - c0;
 			}
 
-			if (c < 0) {
-				c = 0;
-			} else if (c >= width) {
-				c = width - 1;
+			// Load the state and the feed-forward image of the window
+			for (std::ptrdiff_t r = 0; r < wh; r++) {
+				const std::ptrdiff_t r_src = boundary_index(r0 + r, height, bc);
+				T *RESTRICT X_row = X + to_index(r, 0, ww);
+				T *RESTRICT F_row = F + to_index(r, 0, ww);
+
+				if (r_src < 0) {
+					std::fill_n(X_row, ww, x_virtual);
+					std::fill_n(F_row, ww, T(0));
+					continue;
+				}
+
+				for (std::ptrdiff_t c = 0; c < ww; c++) {
+					const std::ptrdiff_t c_src = boundary_index(c0 + c, width, bc);
+					X_row[c] = c_src < 0 ? x_virtual : x[to_index(r_src, c_src, width)];
+					F_row[c] = c_src < 0 ? T(0) : FF[to_index(r_src, c_src, width)];
+				}
 			}
 
-			return mat[to_index(r, c, width)];
+			// One RHS evaluation of the window at the state 'Xs', which is valid
+			// in a margin of m from the edges of the window: the output is
+			// computed in that margin, and the derivative in a margin of m + R,
+			// each row of which is passed to finish(D_row, u, r) as soon as it's
+			// complete, where r + u is its row in the window
+			auto evaluate = [&](const T *RESTRICT Xs, std::ptrdiff_t m, const auto &finish) {
+				const std::ptrdiff_t u = m + R;
+
+				for (std::ptrdiff_t r = m; r < wh - m; r++) {
+					T *RESTRICT Y_row = Y + to_index(r, 0, ww);
+
+					if (row_src[r] < 0) {
+						std::fill(Y_row + m, Y_row + ww - m, y_virtual);
+						continue;
+					}
+
+					const T *RESTRICT X_row = Xs + to_index(row_src[r], 0, ww);
+					const std::ptrdiff_t c_lo = std::max(c_begin, m);
+					const std::ptrdiff_t c_hi = std::min(c_end, ww - m);
+
+					for (std::ptrdiff_t c = c_lo; c < c_hi; c++) {
+						Y_row[c] = y(X_row[c]);
+					}
+
+					for (std::ptrdiff_t c = m; c < c_lo; c++) {
+						Y_row[c] = col_src[c] < 0 ? y_virtual : y(X_row[col_src[c]]);
+					}
+
+					for (std::ptrdiff_t c = std::max(c_hi, m); c < ww - m; c++) {
+						Y_row[c] = col_src[c] < 0 ? y_virtual : y(X_row[col_src[c]]);
+					}
+				}
+
+				// The window, shrunk by a margin of u, is an image with a halo of u
+				apply_stencil(
+					feedback, Y, D + to_index(u, u, ww), H, ww - 2 * u, u, ww, 0, wh - 2 * u,
+					[&](T *RESTRICT D_row, std::ptrdiff_t r) {
+						const T *RESTRICT F_row = F + to_index(r + u, u, ww);
+						const T *RESTRICT X_row = Xs + to_index(r + u, u, ww);
+
+						for (std::ptrdiff_t c = 0; c < ww - 2 * u; c++) {
+							D_row[c] = F_row[c] - X_row[c];
+						}
+					},
+					[&](const T *RESTRICT D_row, std::ptrdiff_t r) {
+						finish(D_row, u, r);
+					}
+				);
+			};
+
+			// The derivative of the tile itself in the first step is the one
+			// at the state of the whole block, for steady-state detection
+			auto observe = [&](const T *RESTRICT D_row, std::ptrdiff_t u, std::ptrdiff_t r) {
+				if (r + u >= margin && r + u < margin + th) {
+					observe_derivative(
+						X + to_index(r + u, margin, ww),
+						D_row + (margin - u),
+						to_index(r0 + r + u, c0 + margin, width),
+						tw,
+						p
+					);
+				}
+			};
+
+			for (std::ptrdiff_t s = 0; s < n_steps; s++) {
+				const T step = steps[s];
+				const T half_step = step / 2;
+				const std::ptrdiff_t m = s * stages * R;
+
+				// The state can be updated in place, as soon as a row of the
+				// derivative is complete, since the stencil only reads Y
+				if (!heun) {
+					evaluate(X, m, [&](const T *RESTRICT D_row, std::ptrdiff_t u, std::ptrdiff_t r) {
+						T *RESTRICT X_row = X + to_index(r + u, u, ww);
+
+						if (s == 0) {
+							observe(D_row, u, r);
+						}
+
+						for (std::ptrdiff_t c = 0; c < ww - 2 * u; c++) {
+							X_row[c] += step * D_row[c];
+						}
+					});
+					continue;
+				}
+
+				evaluate(X, m, [&](const T *RESTRICT D_row, std::ptrdiff_t u, std::ptrdiff_t r) {
+					const T *RESTRICT X_row = X + to_index(r + u, u, ww);
+					T *RESTRICT X1_row = X1 + to_index(r + u, u, ww);
+					T *RESTRICT K1_row = K1 + to_index(r + u, u, ww);
+
+					if (s == 0) {
+						observe(D_row, u, r);
+					}
+
+					for (std::ptrdiff_t c = 0; c < ww - 2 * u; c++) {
+						K1_row[c] = D_row[c];
+						X1_row[c] = X_row[c] + step * D_row[c];
+					}
+				});
+
+				evaluate(X1, m + R, [&](const T *RESTRICT D_row, std::ptrdiff_t u, std::ptrdiff_t r) {
+					T *RESTRICT X_row = X + to_index(r + u, u, ww);
+					const T *RESTRICT K1_row = K1 + to_index(r + u, u, ww);
 
-		case Periodic:
-			if (r < 0) {
-				r += height;
-			} else if (r >= height) {
-				r -= height;
+					for (std::ptrdiff_t c = 0; c < ww - 2 * u; c++) {
+						X_row[c] = X_row[c] + half_step * (K1_row[c] + D_row[c]);
+					}
+				});
 			}
 
-			if (c < 0) {
-				c += width;
-			} else if (c >= width) {
-				c -= width;
+			// Only the tile itself is valid by now
+			for (std::ptrdiff_t r = 0; r < th; r++) {
+				std::copy_n(
+					X + to_index(margin + r, margin, ww),
+					tw,
+					x_next + to_index(r0 + margin + r, c0 + margin, width)
+				);
 			}
+		}
+	});
 
-			return mat[to_index(r, c, width)];
+	std::swap(this->x, k[0]);
 
-	default:
-		assert(0 && "unreachable: invalid boundary condition");
-		return 0;
+	// Redundant work in the halos is counted too
+	for (std::ptrdiff_t s = 0; s < n_steps * stages; s++) {
+		const std::ptrdiff_t m = s * R;
+
+		for (std::ptrdiff_t i = 0; i < tiles_down; i++) {
+			for (std::ptrdiff_t j = 0; j < tiles_across; j++) {
+				const std::ptrdiff_t th = std::min(tile_height, height - i * tile_height);
+				const std::ptrdiff_t tw = std::min(tile_width, width - j * tile_width);
+				statistics.output_evaluations += (th + 2 * (margin - m)) * (tw + 2 * (margin - m));
+			}
+		}
 	}
+
+	statistics.rhs_evaluations += n_steps * stages;
+	statistics.steps += n_steps - 1; // step() counts one
+
+	return *t < t_max;
 }
 
-// Compute 3x3 neighborhood of the cell at (r, c)
-template<typename Fn>
-static double compute_neighborhood(
-	std::ptrdiff_t r,
-	std::ptrdiff_t c,
-	std::ptrdiff_t width,
-	std::ptrdiff_t height,
-	CouplingMat M,
-	Fn func
-)
+// The exact solution of the state equation of a cell which is not coupled to
+// its neighbors, dx/dt = -x + a * y(x) + f, at time t, where 'a' is the centre
+// of the A template, and 'f' is the feed-forward image at the cell. It is
+// linear in each of the 3 regions of y(x), so it is solved region by region.
+// The derivative is continuous, so a cell never goes back to a region it left,
+// and it passes through 3 of them at most. '*settled' is set to the time since
+// which the cell is saturated for good, and '*steady' to false then; or to
+// the time since which its |dx/dt| has been below 'tol', and '*steady' to
+// true; or to infinity, if neither happens until time t.
+double uncoupled_cell_state(double x, double a, double f, double t, double tol, double *settled, bool *steady)
 {
-	double result = 0.0;
-	const std::ptrdiff_t template_halfsize = M.size() / 2;
+	const double inf = std::numeric_limits<double>::infinity();
+	double elapsed = 0.0;
 
-	for (std::ptrdiff_t off_r = -template_halfsize; off_r <= +template_halfsize; off_r++) {
-		for (std::ptrdiff_t off_c = -template_halfsize; off_c <= +template_halfsize; off_c++) {
-			auto r_p = r + off_r;
-			auto c_p = c + off_c;
+	for (int segment = 0; segment < 3; segment++) {
+		// dx/dt = lambda * x + c within the region, which is [lo, hi]
+		double lambda = a - 1.0;
+		double c = f;
+		double lo = -1.0;
+		double hi = 1.0;
+		bool saturated = false;
 
-			result += func(r_p, c_p) * M[off_r + 1][off_c + 1];
+		if (x > 1.0 || (x == 1.0 && a + f > 1.0)) {
+			lambda = -1.0;
+			c = a + f;
+			lo = 1.0;
+			hi = inf;
+			saturated = true;
+		} else if (x < -1.0 || (x == -1.0 && f - a < -1.0)) {
+			lambda = -1.0;
+			c = f - a;
+			lo = -inf;
+			hi = -1.0;
+			saturated = true;
 		}
+
+		// When the cell would leave the region, if ever
+		const double rate = lambda * x + c;
+		const double bound = rate > 0 ? hi : lo;
+		const double eq = lambda != 0 ? -c / lambda : 0.0;
+		double leave = inf;
+
+		if (rate != 0 && std::isfinite(bound)) {
+			if (lambda == 0) {
+				leave = (bound - x) / c;
+			} else if ((bound - eq) / (x - eq) > 0) {
+				leave = std::log((bound - eq) / (x - eq)) / lambda;
+			}
+		}
+
+		if (leave >= t) {
+			*steady = !saturated;
+
+			if (saturated || rate == 0) {
+				*settled = elapsed;
+			} else if (lambda < 0) {
+				*settled = elapsed + std::max(0.0, std::log(std::abs(rate) / tol) / -lambda);
+			} else {
+				*settled = inf;
+			}
+
+			if (rate == 0) {
+				return x;
+			} else if (lambda == 0) {
+				return x + c * t;
+			} else {
+				return eq + (x - eq) * std::exp(lambda * t);
+			}
+		}
+
+		x = bound;
+		t -= leave;
+		elapsed += leave;
 	}
 
-	return result;
+	// not reached: the third region is always a saturated one, never left
+	*settled = elapsed;
+	*steady = false;
+	return x;
 }
 
-// The actual CNN dynamic equation
-int CNN::dynamic_eq(double t, const double *RESTRICT x, double *RESTRICT dxdt, void *param)
+// The same as uncoupled_cell_state() for a run of cells, without steady-state
+// detection. A cell that stays in the region of y(x) it starts in, like most
+// cells of a binary image, follows an exponential with one of two rates,
+// which are the same for all cells, so that is computed for every cell by a
+// loop without branches or calls, which vectorizes. Cells that end up close
+// to the edge of their region, or leave it, are marked with a NaN, and solved
+// region by region afterwards (with the logarithm and exponential of each).
+//
+// The regions are selected by multiplying with 0 or 1, and by choosing from
+// values that are computed anyway, rather than by conditional arithmetic,
+// which GCC won't if-convert, since floating-point operations may trap.
+// Multiplying by 0 or 1 is exact, so the result is the same as that of
+// uncoupled_cell_state(), unless a factor is infinite (e.g. the exponential
+// of the other region overflows), in which case the cell gets a NaN, too.
+template<typename T>
+void uncoupled_cell_states(const T *x, const T *FF, T *x_t, std::ptrdiff_t n, double a, double t)
 {
-	auto *cnn = static_cast<CNN *>(param);
+	const std::ptrdiff_t block_size = 256;
+	const double nan = std::numeric_limits<double>::quiet_NaN();
+	const double saturated_exp = std::exp(-1.0 * t);
+	const double linear_exp = std::exp((a - 1.0) * t);
+	const double margin = 1.0e-6;
+	double result[block_size];
+
+	for (std::ptrdiff_t begin = 0; begin < n; begin += block_size) {
+		const std::ptrdiff_t size = std::min(block_size, n - begin);
 
-	const auto width = cnn->width;
-	const auto height = cnn->height;
-	const auto tem = cnn->tem;
-	const auto FF = cnn->FF;
+		for (std::ptrdiff_t m = 0; m < size; m++) {
+			const double x0 = x[begin + m];
+			const double f = FF[begin + m];
+			const double c_high = a + f;
+			const double c_low = f - a;
+			const double high = (x0 > 1.0) | ((x0 == 1.0) & (c_high > 1.0)) ? 1.0 : 0.0;
+			const double low = (x0 < -1.0) | ((x0 == -1.0) & (c_low < -1.0)) ? 1.0 : 0.0;
+			const double linear = 1.0 - high - low;
 
-	const std::ptrdiff_t template_halfsize = tem.A.size() / 2;
+			// dx/dt = lambda * x + c, as in uncoupled_cell_state()
+			const double lambda = -1.0 + a * linear;
+			const double c = high != 0 ? c_high : low != 0 ? c_low : f;
+			const double rate = lambda * x0 + c;
+			const double eq = -c / lambda;
+			const double xt = eq + (x0 - eq) * (saturated_exp * (high + low) + linear_exp * linear);
 
-	for (std::ptrdiff_t r = 0; r < height; r++) {
-		for (std::ptrdiff_t c = 0; c < width; c++) {
-			std::ptrdiff_t i = to_index(r, c, width);
+			// Whether it ends up inside its region, by more than a margin that
+			// covers the rounding errors of the time it would leave it at
+			const double depth = high * xt - low * xt - linear * std::fabs(xt);
+			const double edge = 2.0 * (high + low) - 1.0;
+			result[m] = depth > edge + margin && rate != 0 ? xt : nan;
+		}
 
-			double diff = FF[i] - x[i];
+		for (std::ptrdiff_t m = 0; m < size; m++) {
+			if (std::isnan(result[m])) {
+				double settled;
+				bool steady;
+				result[m] = uncoupled_cell_state(x[begin + m], a, FF[begin + m], t, 0.0, &settled, &steady);
+			}
+		}
 
-			if (
-				   r < template_halfsize
-				|| c < template_halfsize
-				|| r >= height - template_halfsize
-				|| c >= width - template_halfsize
-			) {
-				// Boundary Condition
-				// This is separated from the regular case because it contains quite a few
-				// conditionals - and I don't want those to be right in the middle of the
-				// tight nested inner loops of neighborhood calculation.
-				// Note: I've measured this, and leaving off this condition makes simulation
-				// about 2 times slower, meaning that the compiler is not unswitching the loop.
-				diff += compute_neighborhood(
-					r, c, width, height, tem.A,
-					[=](auto r_p, auto c_p) {
-						double xij = get_matrix_element(x, r_p, c_p, width, height, tem);
-						return y(xij);
-					}
-				);
-			} else {
-				// Inner cells - just compute regularly
-				diff += compute_neighborhood(
-					r, c, width, height, tem.A,
-					[=](auto r_p, auto c_p) {
-						auto j = to_index(r_p, c_p, width);
-						return y(x[j]);
-					}
-				);
+		for (std::ptrdiff_t m = 0; m < size; m++) {
+			x_t[begin + m] = T(result[m]);
+		}
+	}
+}
+
+// Uncoupled templates: jump to t_max in a single step. With steady-state
+// detection, the simulation stops when the last cell has saturated for good;
+// or, if some of them don't saturate, 'steady_time' after the last one's
+// |dx/dt| has fallen below 'steady_tol', like with the integrators.
+template<typename T>
+bool BasicCNN<T>::step_closed_form(double *t)
+{
+	const T *RESTRICT FF = this->FF.data();
+	T *RESTRICT x = this->x.data();
+	double duration = t_max - *t;
+
+	if (stop_when_steady) {
+		pool->parallel_for(dimension, [&](std::ptrdiff_t begin, std::ptrdiff_t end, std::ptrdiff_t k) {
+			double latest = 0.0;
+			bool any_steady = false;
+
+			for (std::ptrdiff_t i = begin; i < end; i++) {
+				double settled;
+				bool steady;
+				uncoupled_cell_state(x[i], self_feedback, FF[i], duration, steady_tol, &settled, &steady);
+				latest = std::max(latest, settled);
+				any_steady = any_steady || steady;
 			}
 
-			dxdt[i] = diff;
+			steady_partials[2 * k] = latest;
+			steady_partials[2 * k + 1] = any_steady;
+		});
+
+		double latest = 0.0;
+		bool any_steady = false;
+
+		for (std::ptrdiff_t k = 0; k < pool->size(); k++) {
+			latest = std::max(latest, steady_partials[2 * k]);
+			any_steady = any_steady || steady_partials[2 * k + 1] != 0.0;
+		}
+
+		const double end = any_steady ? latest + steady_time : latest;
+
+		if (end < duration) {
+			statistics.steady = true;
+			statistics.settling_time = *t + latest;
+			duration = end;
 		}
 	}
 
-	return GSL_SUCCESS;
+	pool->parallel_for(dimension, [&](std::ptrdiff_t begin, std::ptrdiff_t end, std::ptrdiff_t) {
+		uncoupled_cell_states(x + begin, FF + begin, x + begin, end - begin, self_feedback, duration);
+	});
+
+	*t += duration;
+	return false;
+}
+
+IntegrationMethod integration_method_from_name(const char *name)
+{
+	for (int i = 0; i < NumIntegrationMethods; i++) {
+		auto method = static_cast<IntegrationMethod>(i);
+
+		if (std::strcmp(name, integration_method_name(method)) == 0) {
+			return method;
+		}
+	}
+
+	return NumIntegrationMethods;
+}
+
+const char *integration_method_name(IntegrationMethod method)
+{
+	static const char *const names[NumIntegrationMethods] = {
+		"gsl",
+		"rkf45",
+		"euler",
+		"heun",
+		"rk4",
+		"dopri5",
+		"ros2",
+	};
+
+	assert(method >= 0 && method < NumIntegrationMethods && "invalid integration method");
+
+	return names[method];
+}
+
+
+CNNOptions::CNNOptions(double prel_tol, double pabs_tol):
+	rel_tol(prel_tol),
+	abs_tol(pabs_tol),
+	kernel_isa(detect_kernel_isa()),
+	method(MethodGSL),
+	dt(1.0 / 16),
+	threads(0),
+	parallel_threshold(1 << 15),
+	first_cpu(0),
+	tile_width(0),
+	tile_height(0),
+	time_block(1),
+	stop_when_steady(false),
+	steady_tol(1.0e-4),
+	steady_time(1.0),
+	active_set(false),
+	incremental_feedback(false),
+	feedback_refresh(100),
+	closed_form(true)
+{
 }
 
 
-CNN::CNN(
+template<typename T>
+BasicCNN<T>::BasicCNN(
 	std::ptrdiff_t w,
 	std::ptrdiff_t h,
-	std::vector<double> px,
-	std::vector<double> u,
+	std::vector<T> px,
+	std::vector<T> u,
 	Template ptem,
 	double pt_max,
 	double rel_tol,
 	double abs_tol
 ):
-	width(w),
-	height(h),
-	dimension(width * height),
+	BasicCNN(w, h, std::move(px), std::move(u), ptem, pt_max, CNNOptions(rel_tol, abs_tol))
+{
+}
+
+template<typename T>
+BasicCNN<T>::BasicCNN(
+	std::ptrdiff_t w,
+	std::ptrdiff_t h,
+	std::vector<T> px,
+	std::vector<T> u,
+	Template ptem,
+	double pt_max,
+	const CNNOptions &poptions
+):
+	width(0),
+	height(0),
+	dimension(0),
+	options(poptions),
+	halo(0),
 	x(std::move(px)),
-	FF(dimension),
+	feedforward_valid(false),
 	tem(ptem),
-	h(rel_tol * abs_tol),
-	t_max(pt_max),
-	ode { 0 },
-	stepper(nullptr),
-	control(nullptr),
-	evolver(nullptr)
+	rel_tol(options.rel_tol),
+	abs_tol(options.abs_tol),
+	dt(options.dt),
+	stop_when_steady(options.stop_when_steady),
+	steady_tol(options.steady_tol),
+	steady_time(options.steady_time),
+	feedback_refresh(options.feedback_refresh),
+	ode { 0 }
+{
+	setup(w, h, &u, ptem, pt_max);
+}
+
+template<typename T>
+void BasicCNN<T>::reset(
+	std::ptrdiff_t w,
+	std::ptrdiff_t h,
+	const std::vector<T> &px,
+	const std::vector<T> &u,
+	const Template &ptem,
+	double pt_max
+)
+{
+	if (&px != &x) {
+		x.assign(px.begin(), px.end());
+	}
+
+	setup(w, h, &u, ptem, pt_max);
+}
+
+template<typename T>
+void BasicCNN<T>::reset(const std::vector<T> &px, const std::vector<T> &u, const Template &ptem, double pt_max)
+{
+	reset(width, height, px, u, ptem, pt_max);
+}
+
+template<typename T>
+void BasicCNN<T>::reset(const std::vector<T> &px, double pt_max)
+{
+	if (&px != &x) {
+		x.assign(px.begin(), px.end());
+	}
+
+	setup(width, height, nullptr, tem, pt_max);
+}
+
+// Whether two templates have the same feed-forward image for the same input
+static bool same_feedforward(const Template &a, const Template &b)
+{
+	return a.B.radius == b.B.radius
+	    && a.B.coeffs == b.B.coeffs
+	    && a.Z == b.Z
+	    && a.boundary_condition == b.boundary_condition
+	    && (a.boundary_condition != Constant || a.virtual_cell == b.virtual_cell);
+}
+
+// Everything the simulation of a given size, input, template and simulation
+// time needs, with the state already in 'x'. Buffers are only resized, so
+// they are reused from the previous simulation, if there was one. The input
+// is unchanged if 'u' is null.
+template<typename T>
+void BasicCNN<T>::setup(std::ptrdiff_t w, std::ptrdiff_t h, const std::vector<T> *u, const Template &ptem, double pt_max)
 {
+	const std::ptrdiff_t new_halo = std::max(ptem.A.radius, ptem.B.radius);
+	const bool same_geometry = w == width && h == height && new_halo == halo;
+
+	feedforward_valid = feedforward_valid && same_geometry && same_feedforward(tem, ptem);
+
+	width = w;
+	height = h;
+	dimension = width * height;
+	halo = new_halo;
+	tem = ptem;
+	t_max = pt_max;
+	this->h = rel_tol * abs_tol;
+
 	// Rudimentary sanity checking
-	assert(x.size() == dimension && "you lied about the size of the initial state");
-	assert(u.size() == dimension && "you lied about the size of the input image");
+	assert(x.size() == std::size_t(dimension) && "you lied about the size of the initial state");
+	assert((!u || u->size() == std::size_t(dimension)) && "you lied about the size of the input image");
+	assert(width >= halo && height >= halo && "image is smaller than the neighborhood");
 
-	// Precompute Feed-Forward Image
-	for (std::ptrdiff_t r = 0; r < height; r++) {
-		for (std::ptrdiff_t c = 0; c < width; c++) {
+	// The thread pool only depends on the size of the image
+	const std::ptrdiff_t threads = dimension < options.parallel_threshold ? 1
+	                             : options.threads > 0 ? options.threads : ThreadPool::hardware_threads();
 
-			double cell = compute_neighborhood(
-				r, c, width, height, tem.B,
-				[=, &u](auto r_p, auto c_p) {
-					return get_matrix_element(&u[0], r_p, c_p, width, height, tem);
-				}
-			);
+	if (!pool || pool->size() != threads) {
+		pool.reset(new ThreadPool(threads, options.first_cpu));
+	}
+
+	tile_width = 0;
+	tile_height = 0;
+	tiles_across = 0;
+	tiles_down = 0;
+	tile_output_evaluations = 0;
+	time_block = 1;
+	block_buffer_size = 0;
+	statistics = CNNStats {};
+	closed_form = false;
+	self_feedback = 0.0;
+	first_stage_valid = false;
+	steady_since = -1.0;
+	steady_partials.resize(2 * pool->size());
+	active_set = options.active_set;
+	tile_reach_x = 0;
+	tile_reach_y = 0;
+	active_tiles = 0;
+	visited_tiles = 0;
+	active_output_evaluations = 0;
+	incremental_feedback = options.incremental_feedback && !options.active_set;
+	feedback_age = 0;
+	blocks_across = 0;
+	block_reach = 0;
+
+	// Select the kernels specialized for the structure of the template
+	const StencilKernels<T> &kernels = get_stencil_kernels<T>(options.kernel_isa);
+
+	feedback = make_stencil_plan(tem.A, kernels);
+	feedforward = make_stencil_plan(tem.B, kernels);
+
+	statistics.method = std::is_same<T, double>::value || options.method != MethodGSL ? options.method : MethodRKF45;
+	statistics.threads = pool->size();
+	statistics.kernel_isa = options.kernel_isa;
+	statistics.feedback_shape = feedback.shape;
+	statistics.feedforward_shape = feedforward.shape;
+	statistics.feedback_radius = feedback.radius;
+	statistics.feedforward_radius = feedforward.radius;
+	statistics.feedback_structure = feedback.structure;
+	statistics.feedforward_structure = feedforward.structure;
+
+	// Without coupling, the state of each cell only depends on itself, and on
+	// the feed-forward image; neither tiles nor any of the rest is needed then
+	if (options.closed_form && (feedback.shape == StencilZero || feedback.shape == StencilCentre)) {
+		closed_form = true;
+		self_feedback = tem.A[tem.A.radius][tem.A.radius];
+		active_set = false;
+		incremental_feedback = false;
+	}
+
+	statistics.closed_form = closed_form;
+
+	// Tiling only pays off if the output image would not fit in the cache
+	// together with the state, the feed-forward image and the derivative;
+	// and it is pointless if there is no feedback, hence no output image.
+	// The active set needs tiles anyway, and small ones are better for it,
+	// so that the frozen regions can follow the shapes in the image closely.
+	if (active_set) {
+		assert(options.tile_width >= 0 && options.tile_height >= 0 && "the active set needs tiles");
+
+		const bool explicit_size = options.tile_width > 0 && options.tile_height > 0;
+		tile_width = std::min(explicit_size ? options.tile_width : active_set_tile_size, width);
+		tile_height = std::min(explicit_size ? options.tile_height : active_set_tile_size, height);
+	} else if (feedback.shape != StencilZero && !closed_form && !incremental_feedback && options.tile_width >= 0 && options.tile_height >= 0) {
+		if (options.tile_width > 0 && options.tile_height > 0) {
+			tile_width = std::min(options.tile_width, width);
+			tile_height = std::min(options.tile_height, height);
+		} else {
+			const std::ptrdiff_t cache_cells = l2_cache_size() / std::ptrdiff_t(4 * sizeof(T));
+
+			if (dimension > cache_cells) {
+				// Wide tiles, for long contiguous rows, but tall enough that
+				// the redundant halo rows are only a small fraction of the work
+				tile_width = std::min(width, std::max<std::ptrdiff_t>(cache_cells / 32, 64));
+				tile_height = std::min(height, std::max(cache_cells / tile_width, 4 * halo));
+			}
+		}
+	}
+
+	if (tile_width > 0) {
+		tiles_across = (width + tile_width - 1) / tile_width;
+		tiles_down = (height + tile_height - 1) / tile_height;
+
+		for (std::ptrdiff_t i = 0; i < tiles_down; i++) {
+			for (std::ptrdiff_t j = 0; j < tiles_across; j++) {
+				const std::ptrdiff_t tw = std::min(tile_width, width - j * tile_width);
+				const std::ptrdiff_t th = std::min(tile_height, height - i * tile_height);
+				tile_output_evaluations += feedback.shape != StencilZero ? (tw + 2 * halo) * (th + 2 * halo) : 0;
+			}
+		}
+
+		// Temporal blocking needs tiles, and a fixed step size; and it
+		// would advance frozen tiles of the active set, too
+		if ((statistics.method == MethodEuler || statistics.method == MethodHeun) && !active_set) {
+			time_block = options.time_block;
+			assert(time_block >= 1 && time_block <= MaxTimeBlock && "invalid number of steps per tile");
+		}
+	}
+
+	if (time_block > 1) {
+		// The window of a tile, plus a ring buffer of 3 of its rows; Heun's
+		// method evaluates the RHS twice per step, and needs 2 more windows
+		const std::ptrdiff_t stages = statistics.method == MethodHeun ? 2 : 1;
+		const std::ptrdiff_t ww_max = tile_width + 2 * time_block * stages * feedback.radius;
+		const std::ptrdiff_t wh_max = tile_height + 2 * time_block * stages * feedback.radius;
+
+		block_buffer_size = (2 + 2 * stages) * ww_max * wh_max + 3 * ww_max;
+		block_buffers.resize(block_buffer_size * pool->size());
+		block_index.resize((ww_max + wh_max) * pool->size());
+	} else if (tile_width > 0) {
+		Y.resize((tile_width + 2 * halo) * (tile_height + 2 * halo) * pool->size());
+	} else {
+		Y.resize((width + 2 * halo) * (height + 2 * halo));
+	}
+
+	statistics.tile_width = tile_width;
+	statistics.tile_height = tile_height;
+	statistics.time_block = time_block;
+	statistics.active_set = active_set;
+
+	// Without feedback, there is nothing to update
+	incremental_feedback = incremental_feedback && feedback.shape != StencilZero;
+	statistics.incremental_feedback = incremental_feedback;
+
+	if (incremental_feedback) {
+		const std::ptrdiff_t last_width = width - (width - 1) / feedback_block_width * feedback_block_width;
+
+		assert(feedback_refresh > 0 && "the feedback image must be recomputed every once in a while");
+
+		blocks_across = (width + feedback_block_width - 1) / feedback_block_width;
+		block_reach = std::max<std::ptrdiff_t>(1, (feedback.radius + last_width - 1) / last_width);
+		feedback_age = feedback_refresh; // the first evaluation computes it from scratch
+
+		FF_AY.resize(dimension);
+		Y_delta.assign(Y.size(), T(0));
+		block_changed.assign(height * blocks_across, 0);
+		incremental_partials.resize(2 * pool->size());
+	}
+
+	// Every tile is active at first
+	if (active_set) {
+		const std::ptrdiff_t num_tiles = tiles_across * tiles_down;
+		const std::ptrdiff_t last_width = width - (tiles_across - 1) * tile_width;
+		const std::ptrdiff_t last_height = height - (tiles_down - 1) * tile_height;
+
+		// The narrowest tiles are the last ones
+		tile_reach_x = (feedback.radius + last_width - 1) / last_width;
+		tile_reach_y = (feedback.radius + last_height - 1) / last_height;
+
+		tile_frozen.assign(num_tiles, 0);
+		tile_order.resize(num_tiles);
+
+		// Atomics can't be copied, hence neither assigned nor resized
+		if (tile_settled.size() != std::size_t(num_tiles)) {
+			tile_settled = std::vector<std::atomic<unsigned char>>(num_tiles);
+		}
+
+		for (auto &settled : tile_settled) {
+			settled.store(0, std::memory_order_relaxed);
+		}
+
+		for (std::ptrdiff_t i = 0; i < num_tiles; i++) {
+			tile_order[i] = i;
+		}
+
+		active_tiles = num_tiles;
+		visited_tiles = num_tiles;
+		active_output_evaluations = tile_output_evaluations;
+	}
+
+	H.resize(3 * width * pool->size());
 
-			auto i = to_index(r, c, width);
-			FF[i] = cell + tem.Z;
+	// Precompute Feed-Forward Image, using the same halo-padded
+	// layout (and boundary handling) as the feedback stencil.
+	// The input is kept in that layout, so that it is only done
+	// again if the input, or the template of the input, changes.
+	if (!same_geometry) {
+		U.resize((width + 2 * halo) * (height + 2 * halo));
+		FF.resize(dimension);
+	}
+
+	for (std::ptrdiff_t r = 0; u && r < height; r++) {
+		const T *src = &(*u)[to_index(r, 0, width)];
+		T *dst = &U[to_padded_index(r, 0, width, halo)];
+
+		if (!feedforward_valid || !std::equal(src, src + width, dst)) {
+			std::copy_n(src, width, dst);
+			feedforward_valid = false;
 		}
 	}
 
+	if (!feedforward_valid) {
+		fill_halo(&U[0], width, height, halo, tem.boundary_condition, T(tem.virtual_cell));
+
+		pool->parallel_for(height, [&](std::ptrdiff_t r_begin, std::ptrdiff_t r_end, std::ptrdiff_t k) {
+			apply_stencil(
+				feedforward, U.data(), FF.data(), &H[3 * width * k], width, halo, width, r_begin, r_end,
+				[&](T *RESTRICT FF_row, std::ptrdiff_t) {
+					std::fill_n(FF_row, width, T(tem.Z));
+				},
+				[](T *, std::ptrdiff_t) {}
+			);
+		});
+
+		feedforward_valid = true;
+	}
+
+	// Uncoupled templates need no integrator at all
+	if (closed_form) {
+		return;
+	}
+
 	// Set up ODE solver
-	ode.function = dynamic_eq;
-	ode.jacobian = nullptr;
-	ode.dimension = dimension;
-	ode.params = this;
+	switch (statistics.method) {
+	case MethodGSL:
+		init_gsl();
 
-	// Runge-Kutta-Fehlberg method of order 4-5
-	stepper = gsl_odeiv2_step_alloc(gsl_odeiv2_step_rkf45, dimension);
-	control = gsl_odeiv2_control_standard_new(abs_tol, rel_tol, 1, 1);
-	evolver = gsl_odeiv2_evolve_alloc(dimension);
+		// Only for steady-state detection and the active set, which need the derivative
+		if (stop_when_steady || active_set) {
+			k[0].resize(dimension);
+		}
+		break;
+
+	case MethodRKF45:
+	case MethodDOPRI5:
+		std::for_each(k.begin(), k.begin() + embedded_rk_tableau(statistics.method).stages, [&](std::vector<T> &stage) {
+			stage.resize(dimension);
+		});
+
+		for (auto &trial : x_trial) {
+			trial.resize(dimension);
+		}
+
+		partial_errors.resize(pool->size());
+		break;
+
+	case MethodEuler:
+		assert(dt > 0 && "step size must be positive");
+		k[0].resize(dimension);
+		break;
+
+	case MethodROS2:
+		std::for_each(k.begin(), k.begin() + 4, [&](std::vector<T> &stage) {
+			stage.resize(dimension);
+		});
+
+		for (auto &trial : x_trial) {
+			trial.resize(dimension);
+		}
+
+		for (auto &vec : krylov) {
+			vec.resize(dimension);
+		}
+
+		partial_errors.resize(pool->size());
+		partial_sums.resize(2 * pool->size());
+		jacobian_image.resize((width + 2 * halo) * (height + 2 * halo));
+		break;
+
+	case MethodHeun:
+		assert(dt > 0 && "step size must be positive");
+		k[0].resize(dimension);
+		k[1].resize(dimension);
+		x_trial[0].resize(dimension);
+		break;
+
+	case MethodRK4:
+		assert(dt > 0 && "step size must be positive");
+		std::for_each(k.begin(), k.begin() + 4, [&](std::vector<T> &stage) {
+			stage.resize(dimension);
+		});
+
+		for (auto &trial : x_trial) {
+			trial.resize(dimension);
+		}
+		break;
+
+	default:
+		assert(0 && "invalid integration method");
+	}
 }
 
-CNN::~CNN()
+template<typename T>
+void BasicCNN<T>::GSLDeleter::operator()(gsl_odeiv2_step *stepper) const
 {
-	gsl_odeiv2_evolve_free(evolver);
-	gsl_odeiv2_control_free(control);
 	gsl_odeiv2_step_free(stepper);
 }
 
-const std::vector<double> &CNN::state() const
+template<typename T>
+void BasicCNN<T>::GSLDeleter::operator()(gsl_odeiv2_control *control) const
+{
+	gsl_odeiv2_control_free(control);
+}
+
+template<typename T>
+void BasicCNN<T>::GSLDeleter::operator()(gsl_odeiv2_evolve *evolver) const
+{
+	gsl_odeiv2_evolve_free(evolver);
+}
+
+template<typename T>
+const std::vector<T> &BasicCNN<T>::state() const
 {
 	return x;
 }
 
-void CNN::extract_output(GrayscaleImage *output)
+template<typename T>
+const CNNStats &BasicCNN<T>::stats() const
+{
+	return statistics;
+}
+
+template<typename T>
+void BasicCNN<T>::extract_output(BasicGrayscaleImage<T> *output)
 {
 	output->width = width;
 	output->height = height;
 	output->buf.resize(dimension);
-	std::transform(x.begin(), x.end(), output->buf.begin(), CNN::y);
+	std::transform(x.begin(), x.end(), output->buf.begin(), BasicCNN::y);
 }
 
-bool CNN::step(double *t)
+template<typename T>
+bool BasicCNN<T>::step(double *t)
 {
-	int status = gsl_odeiv2_evolve_apply(
-		evolver,
-		control,
-		stepper,
-		&ode,
-		t,
-		t_max,
-		&h,
-		&x[0]
-	);
+	const double t0 = *t;
+	bool running;
 
-	return status == GSL_SUCCESS && *t < t_max;
+	statistics.steps++;
+
+	if (closed_form) {
+		return step_closed_form(t);
+	}
+
+	switch (statistics.method) {
+	case MethodGSL:
+		// GSL computes the derivative internally, so it must be evaluated again
+		if (stop_when_steady || active_set) {
+			begin_steady_check();
+
+			dynamic_eq(x.data(), k[0].data(), [&](T *dxdt, std::ptrdiff_t offset, std::ptrdiff_t n, std::ptrdiff_t p) {
+				observe_derivative(&x[offset], dxdt, offset, n, p);
+			});
+		}
+
+		running = step_gsl(t);
+		break;
+
+	case MethodRKF45:
+	case MethodDOPRI5:
+		running = step_embedded_rk(embedded_rk_tableau(statistics.method), t);
+		break;
+
+	case MethodEuler:
+		running = step_euler(t);
+		break;
+
+	case MethodHeun:
+		running = step_heun(t);
+		break;
+
+	case MethodRK4:
+		running = step_rk4(t);
+		break;
+
+	case MethodROS2:
+		running = step_ros2(t);
+		break;
+
+	default:
+		assert(0 && "invalid integration method");
+		return false;
+	}
+
+	// Every method has observed the derivative at the state it started from
+	if (active_set) {
+		update_active_set();
+	}
+
+	if (running && stop_when_steady && end_steady_check(t0)) {
+		return false;
+	}
+
+	return running;
 }
 
-void CNN::run()
+template<typename T>
+void BasicCNN<T>::run()
 {
 	double t = 0.0;
 	while (step(&t)) {
@@ -253,7 +2398,8 @@ void CNN::run()
 	}
 }
 
-void CNN::run_with_handler(std::function<bool(double)> handler)
+template<typename T>
+void BasicCNN<T>::run_with_handler(std::function<bool(double)> handler)
 {
 	bool keep_running = true;
 	double t = 0.0;
@@ -262,3 +2408,10 @@ void CNN::run_with_handler(std::function<bool(double)> handler)
 		keep_running = handler(t);
 	}
 }
+
+
+template struct BasicCNN<float>;
+template struct BasicCNN<double>;
+
+template void uncoupled_cell_states(const float *x, const float *FF, float *x_t, std::ptrdiff_t n, double a, double t);
+template void uncoupled_cell_states(const double *x, const double *FF, double *x_t, std::ptrdiff_t n, double a, double t);
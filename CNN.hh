@@ -14,9 +14,11 @@
 
 #include <array>
 #include <vector>
+#include <memory>
 #include <algorithm>
 #include <utility>
 #include <functional>
+#include <atomic>
 
 #include <gsl/gsl_errno.h>
 #include <gsl/gsl_odeiv2.h>
@@ -24,61 +26,407 @@
 #include "util.hh"
 #include "template.hh"
 #include "imgproc.hh"
+#include "kernels.hh"
+#include "threadpool.hh"
 
 
-struct CNN {
+// Methods for numerically solving the state equation
+enum IntegrationMethod {
+	MethodGSL,    // GSL's Runge-Kutta-Fehlberg 4(5); double precision only
+	MethodRKF45,  // built-in Runge-Kutta-Fehlberg 4(5); any precision
+	MethodEuler,  // forward Euler with a fixed step size; any precision
+	MethodHeun,   // Heun's 2nd order method with a fixed step size; any precision
+	MethodRK4,    // classic 4th order Runge-Kutta with a fixed step size; any precision
+	MethodDOPRI5, // built-in Dormand-Prince 5(4); any precision
+	MethodROS2,   // linearly implicit Rosenbrock 2(1), for stiff templates; any precision
+	NumIntegrationMethods
+};
+
+// Returns NumIntegrationMethods if the name is not recognized
+IntegrationMethod integration_method_from_name(const char *name);
+const char *integration_method_name(IntegrationMethod method);
+
+
+// Largest number of stages of the built-in Runge-Kutta methods
+static const int MaxRKStages = 7;
+
+// Butcher tableau of an embedded Runge-Kutta method, with the 5th order
+// solution being propagated, and the error estimate being the difference
+// of the 5th and 4th order solutions. With FSAL ("first same as last"),
+// the last stage is evaluated at the new state, so it's the first stage
+// of the next step, and the new state is the input of the last stage.
+struct EmbeddedRKTableau {
+	int stages;
+	bool fsal;
+	double a[MaxRKStages][MaxRKStages - 1];
+	double b[MaxRKStages];
+	double e[MaxRKStages];
+};
+
+// Only for the built-in embedded methods: MethodRKF45 and MethodDOPRI5
+const EmbeddedRKTableau &embedded_rk_tableau(IntegrationMethod method);
+
+// The exact state of a cell which is not coupled to its neighbors, at time t:
+// the solution of dx/dt = -x + a * y(x) + f from x, where 'a' is the centre of
+// the A template, and 'f' is the feed-forward image at the cell. 'tol' and the
+// last two arguments are for steady-state detection; see CNN.cc.
+double uncoupled_cell_state(double x, double a, double f, double t, double tol, double *settled, bool *steady);
+
+// The same for the n cells of x and the feed-forward image FF at once, which
+// is faster, but without steady-state detection. x_t may be the same as x.
+template<typename T>
+void uncoupled_cell_states(const T *x, const T *FF, T *x_t, std::ptrdiff_t n, double a, double t);
+
+// Upper limit of CNNOptions::time_block
+static const std::ptrdiff_t MaxTimeBlock = 16;
+
+// Tunables of the simulator, which don't change the model itself
+struct CNNOptions {
+	double rel_tol;
+	double abs_tol;
+	KernelISA kernel_isa;
+
+	// GSL only supports double precision; with any other
+	// precision, MethodGSL falls back to MethodRKF45.
+	IntegrationMethod method;
+	double dt; // step size of fixed-step methods
+
+	// Number of threads, 0 means one per CPU. Images with fewer cells than
+	// 'parallel_threshold' are always simulated on the calling thread only,
+	// since for them, distributing the work would cost more than it saves.
+	std::ptrdiff_t threads;
+	std::ptrdiff_t parallel_threshold;
+
+	// The threads are pinned to consecutive CPUs of those the process may run
+	// on, starting with this one; negative means leaving them unpinned.
+	// Simulations running side by side should get disjoint ranges, or -1.
+	std::ptrdiff_t first_cpu;
+
+	// Size of the tiles in which the state equation is evaluated, so that the
+	// intermediate results of a tile stay in the cache. 0 means choosing it
+	// automatically from the size of the L2 cache (which means no tiling for
+	// images that fit in the cache anyway), negative means no tiling.
+	std::ptrdiff_t tile_width;
+	std::ptrdiff_t tile_height;
+
+	// Number of steps of euler or heun by which each tile is advanced at
+	// once (temporal blocking), reading and writing the whole state only
+	// once per that many steps. Only used if the image is tiled. 1 (the
+	// default) means no temporal blocking, which has not been measured to
+	// be slower than blocking so far.
+	std::ptrdiff_t time_block;
+
+	// Steady-state detection: stop before t_max as soon as the output can't
+	// change any more, because every cell is saturated, and so is its
+	// equilibrium x + dx/dt; or when the largest |dx/dt| has stayed below
+	// 'steady_tol' for a simulated time of 'steady_time'. With the adaptive
+	// integrators, 'steady_tol' must be above the error they leave in dx/dt,
+	// which is of the order of 'rel_tol' and 'abs_tol'.
+	// The check is fused into the first RHS evaluation of each step, except
+	// with GSL, which needs an extra RHS evaluation per step for it.
+	bool stop_when_steady;
+	double steady_tol;
+	double steady_time;
+
+	// Active set: skip the evaluation of tiles which can't change any more,
+	// since they, and every tile their neighborhoods reach into, are saturated,
+	// and so are the equilibria of their cells. Their state is kept constant.
+	// A tile is woken up as soon as any tile around it isn't settled like that.
+	// Tiles are evaluated even if the image fits in the cache, and they are
+	// 32x32 by default. Temporal blocking is not used with the active set.
+	bool active_set;
+
+	// Keep the feedback image A * y(x) between RHS evaluations, and only
+	// update it where the output changed since the previous one; this is
+	// cheap once most of the cells are saturated. It is recomputed fully
+	// every 'feedback_refresh' evaluations, so that rounding errors don't
+	// accumulate, and whenever too much of the output changed anyway.
+	// Only used without tiles and without the active set.
+	bool incremental_feedback;
+	std::ptrdiff_t feedback_refresh;
+
+	// Templates without coupling between cells (an A template with only its
+	// centre element set, or none at all) make every cell an independent
+	// piecewise linear ODE, which is solved exactly, instead of integrated.
+	// On by default; 'method' and the rest of the above don't matter then.
+	bool closed_form;
+
+	CNNOptions(double prel_tol = 1.0e-3, double pabs_tol = 1.0e-3); // the rest is defaulted
+};
+
+// Work counters and kernel selection, for benchmarking
+struct CNNStats {
+	std::size_t steps;              // integration steps, i.e. calls to CNN::step()
+	std::size_t rhs_evaluations;    // calls to the dynamic equation
+	std::size_t output_evaluations; // evaluations of the nonlinearity y(x)
+	std::size_t jacobian_products;  // products of the Jacobian with a vector
+	std::size_t linear_iterations;  // iterations of the linear solver of implicit methods
+
+	// Only with CNNOptions::stop_when_steady
+	bool steady;          // the simulation stopped early, in a steady state
+	double settling_time; // since when the state has been steady, if so
+
+	// Only with CNNOptions::active_set
+	bool active_set;
+	std::size_t tile_evaluations;        // tiles in all RHS evaluations
+	std::size_t frozen_tile_evaluations; // of which were skipped as frozen
+
+	// Only with CNNOptions::incremental_feedback
+	bool incremental_feedback;
+	std::size_t feedback_refreshes;     // RHS evaluations that recomputed A * y(x) fully
+	std::size_t feedback_cells_updated; // cells of A * y(x) updated incrementally
+
+	bool closed_form; // the template is uncoupled, and was solved in closed form
+
+	IntegrationMethod method;
+	std::ptrdiff_t threads;
+	std::ptrdiff_t tile_width;  // 0 if not tiled
+	std::ptrdiff_t tile_height; // ditto
+	std::ptrdiff_t time_block;  // steps per tile, 1 if not blocked
+	KernelISA kernel_isa;
+	StencilShape feedback_shape;            // of the A template
+	StencilShape feedforward_shape;         // of the B template
+	std::ptrdiff_t feedback_radius;         // of the A template, after cropping zeros
+	std::ptrdiff_t feedforward_radius;      // of the B template, ditto
+	CouplingStructure feedback_structure;    // factorization used for A
+	CouplingStructure feedforward_structure; // factorization used for B
+};
+
+// How a coupling matrix is applied to an image: which kernels, with which
+// coefficients. Separable 3x3 matrices are applied as a horizontal 1x3 pass
+// followed by a vertical 3x1 pass; everything else in one pass.
+template<typename T>
+struct StencilPlan {
+	StencilShape shape;
+	CouplingStructure structure;
+	std::ptrdiff_t radius;
+	StencilRowFn<T> stencil_row;          // radius 1: general or symmetric kernel
+	StencilRowFn<T> row_pass;             // radius 1, separable only
+	StencilRowFn<T> column_pass;          // radius 1, separable only
+	WideStencilRowFn<T> wide_stencil_row; // radius > 1 only
+	T coeffs[(2 * MaxTemplateRadius + 1) * (2 * MaxTemplateRadius + 1)]; // flattened matrix
+	T row_coeffs[9];                      // separable only: row factors as a 1x3 matrix
+	T column_coeffs[9];                   // separable only: column factors as a 3x1 matrix
+};
+
+
+// The simulator, templated on the scalar type of the state, input and
+// output images. It is instantiated for T = float and T = double; the
+// single precision one needs half the memory bandwidth, and is usually
+// accurate enough for templates with a binary output.
+template<typename T>
+struct BasicCNN {
 public:
-	const std::ptrdiff_t width;
-	const std::ptrdiff_t height;
-	const std::ptrdiff_t dimension;
+	typedef T Scalar;
+
+	// Read-only; only reset() changes them
+	std::ptrdiff_t width;
+	std::ptrdiff_t height;
+	std::ptrdiff_t dimension;
 
 private:
-	std::vector<double> x;
-	std::vector<double> FF; // feed-forward image, precomputed
+	// Frees GSL's workspaces
+	struct GSLDeleter {
+		void operator()(gsl_odeiv2_step *stepper) const;
+		void operator()(gsl_odeiv2_control *control) const;
+		void operator()(gsl_odeiv2_evolve *evolver) const;
+	};
+
+	CNNOptions options;
+	std::ptrdiff_t halo; // width of the ghost border around padded images
+
+	std::vector<T> x;
+	std::vector<T> FF; // feed-forward image, precomputed
+	std::vector<T> U;  // halo-padded input image, kept so that FF is only recomputed if it changes
+	bool feedforward_valid; // FF is that of U and of the B template and the bias of 'tem'
+	std::vector<T> Y;  // halo-padded output image y(x), recomputed in every RHS evaluation; or per thread tiles of it
+	std::vector<T> H;  // per thread ring buffers of 3 rows for the intermediate result of separable stencils
+
+	// Tiling of the RHS evaluation, if any
+	std::ptrdiff_t tile_width;
+	std::ptrdiff_t tile_height;
+	std::ptrdiff_t tiles_across;
+	std::ptrdiff_t tiles_down;
+	std::size_t tile_output_evaluations; // per RHS evaluation, including the halos
+
+	// Temporal blocking of fixed-step methods, if any
+	std::ptrdiff_t time_block;               // steps per tile, 1 if not blocked
+	std::ptrdiff_t block_buffer_size;        // per thread
+	std::vector<T> block_buffers;            // per thread: state, feed-forward, output and derivative of a tile, H, and for heun the trial state and k1
+	std::vector<std::ptrdiff_t> block_index; // per thread: where rows and columns of a tile read their output from
 
 	Template tem;
 
 	double h; // ODE solver step size
-	const double t_max; // simulation time
+	double t_max; // simulation time
+
+	StencilPlan<T> feedback;    // A template
+	StencilPlan<T> feedforward; // B template
+	CNNStats statistics;
+
+	std::unique_ptr<ThreadPool> pool;
+
+	// Uncoupled templates: solved in closed form, with the centre of A
+	bool closed_form;
+	double self_feedback;
+
+	// Built-in integrators: tolerances, step size, stages, and the trial state
+	double rel_tol;
+	double abs_tol;
+	double dt;
+	std::array<std::vector<T>, MaxRKStages> k;
+	std::array<std::vector<T>, 2> x_trial;
+	std::vector<double> partial_errors; // one per thread
+	bool first_stage_valid;             // k[0] is the derivative at x
+
+	// Implicit integrator: work vectors of the linear solver, partial sums of
+	// its dot products (two per thread), and the halo-padded image of y'(x) * v
+	std::array<std::vector<T>, 7> krylov;
+	std::vector<double> partial_sums;
+	std::vector<T> jacobian_image;
+
+	// Steady-state detection: per thread partial results of the check
+	// (the largest |dx/dt|, and 1 if every cell and its equilibrium are
+	// saturated, 0 otherwise), and since when |dx/dt| has been below tolerance
+	bool stop_when_steady;
+	double steady_tol;
+	double steady_time;
+	double steady_since; // negative if it hasn't
+	std::vector<double> steady_partials;
 
+	// Active set: the frozen tiles (1 if frozen in this step, 2 if before),
+	// the tiles found saturated, with saturated equilibria, in this step,
+	// how far (in tiles) the neighborhood of a cell reaches, and the order in
+	// which tiles are evaluated: the active ones first, which need all the
+	// work, then the frozen ones, of which only the first 'visited_tiles'
+	bool active_set;
+	std::vector<unsigned char> tile_frozen;
+	std::vector<std::atomic<unsigned char>> tile_settled;
+	std::ptrdiff_t tile_reach_x;
+	std::ptrdiff_t tile_reach_y;
+	std::vector<std::ptrdiff_t> tile_order;
+	std::ptrdiff_t active_tiles;
+	std::ptrdiff_t visited_tiles;
+	std::size_t active_output_evaluations; // per RHS evaluation
+
+	// Incremental feedback: FF + A * y(x) at the previously evaluated state,
+	// the halo-padded change of the output image since then (Y is the output
+	// itself), whether each block of a row changed, and per thread counts of
+	// changed blocks and updated cells. Y and FF_AY are only consistent after
+	// a full recomputation, which happens every 'feedback_refresh' evaluations;
+	// 'feedback_age' counts the evaluations since the last one.
+	bool incremental_feedback;
+	std::ptrdiff_t feedback_refresh;
+	std::ptrdiff_t feedback_age;
+	std::ptrdiff_t blocks_across;
+	std::ptrdiff_t block_reach; // how many blocks away the neighborhood of a cell reaches
+	std::vector<T> FF_AY;
+	std::vector<T> Y_delta;
+	std::vector<unsigned char> block_changed;
+	std::vector<std::ptrdiff_t> incremental_partials;
+
+	// GSL integrator, for T = double only. 'ode' points to the simulator,
+	// so it is updated before each step, in case the simulator was moved.
 	gsl_odeiv2_system ode;
-	gsl_odeiv2_step *stepper;
-	gsl_odeiv2_control *control;
-	gsl_odeiv2_evolve *evolver;
+	std::unique_ptr<gsl_odeiv2_step, GSLDeleter> stepper;
+	std::unique_ptr<gsl_odeiv2_control, GSLDeleter> control;
+	std::unique_ptr<gsl_odeiv2_evolve, GSLDeleter> evolver;
+
+	void dynamic_eq(const T *RESTRICT x, T *RESTRICT dxdt);
+	template<typename Fn> void dynamic_eq(const T *RESTRICT x, T *RESTRICT dxdt, const Fn &finish);
+	template<typename Fn> void dynamic_eq_tiled(const T *RESTRICT x, T *RESTRICT dxdt, const Fn &finish);
+	template<typename Fn> void dynamic_eq_incremental(const T *RESTRICT x, T *RESTRICT dxdt, const Fn &finish);
+	template<typename Fn> void evaluate_tile(const T *RESTRICT x, T *RESTRICT dxdt, std::ptrdiff_t i, std::ptrdiff_t k, const Fn &finish);
+	template<typename Fn> void skip_tile(const T *RESTRICT x, T *RESTRICT dxdt, std::ptrdiff_t i, std::ptrdiff_t k, const Fn &finish);
+	void fill_output_tile(const T *RESTRICT x, T *RESTRICT Y_tile, std::ptrdiff_t r0, std::ptrdiff_t c0, std::ptrdiff_t tw, std::ptrdiff_t th);
+	static int gsl_dynamic_eq(double t, const double *RESTRICT x, double *RESTRICT dxdt, void *param);
+
+	void setup(std::ptrdiff_t w, std::ptrdiff_t h, const std::vector<T> *u, const Template &ptem, double pt_max);
+	void init_gsl();
+	bool step_gsl(double *t);
+	bool step_embedded_rk(const EmbeddedRKTableau &tableau, double *t);
+	bool step_euler(double *t);
+	bool step_blocked(double *t);
+	bool step_heun(double *t);
+	bool step_rk4(double *t);
+	bool step_ros2(double *t);
+	bool step_closed_form(double *t);
 
-	static int dynamic_eq(double t, const double *RESTRICT x, double *RESTRICT dxdt, void *param);
+	void coupling_product(const T *RESTRICT x, const T *RESTRICT v, T *RESTRICT out, T alpha, T beta);
+	bool solve_newton_system(const T *RESTRICT x, const T *RESTRICT b, T *RESTRICT z, T gamma_h);
+
+	void begin_steady_check();
+	void observe_derivative(const T *RESTRICT x, const T *RESTRICT dxdt, std::ptrdiff_t offset, std::ptrdiff_t n, std::ptrdiff_t thread);
+	bool end_steady_check(double t);
+	void update_active_set();
+
+	// The built-in embedded Runge-Kutta methods, shared with BasicBatchCNN
+	template<typename Sim, typename Begin, typename Observe>
+	friend bool embedded_rk_step(Sim *sim, const EmbeddedRKTableau &tableau, double *t, const Begin &begin_first_stage, const Observe &observe_first_stage);
 
 public:
-	CNN(
+	BasicCNN(
 		std::ptrdiff_t w,
 		std::ptrdiff_t h,
-		std::vector<double> px,
-		std::vector<double> u,
+		std::vector<T> px,
+		std::vector<T> u,
 		Template ptem,
 		double pt_max,
 		double rel_tol = 1.0e-3,
 		double abs_tol = 1.0e-3
 	);
 
-	CNN(const CNN &) = delete;
-	CNN(CNN &&) = delete;
+	BasicCNN(
+		std::ptrdiff_t w,
+		std::ptrdiff_t h,
+		std::vector<T> px,
+		std::vector<T> u,
+		Template ptem,
+		double pt_max,
+		const CNNOptions &options
+	);
+
+	BasicCNN(const BasicCNN &) = delete;
+	BasicCNN(BasicCNN &&) = default;
 
-	~CNN();
+	BasicCNN &operator=(const BasicCNN &) = delete;
+	BasicCNN &operator=(BasicCNN &&) = default;
 
-	CNN &operator=(const CNN &) = delete;
-	CNN &operator=(CNN &&) = delete;
+	// Start over with another simulation, with the same options, as if the
+	// simulator was constructed again, but reusing its buffers, its thread
+	// pool and its integrator: after the first simulation of a size, it
+	// doesn't allocate any more. The feed-forward image is only computed
+	// again if the input, the B template, the bias or the boundary condition
+	// changed. The last two keep the size, and the last one keeps the input
+	// and the template, too.
+	void reset(std::ptrdiff_t w, std::ptrdiff_t h, const std::vector<T> &px, const std::vector<T> &u, const Template &ptem, double pt_max);
+	void reset(const std::vector<T> &px, const std::vector<T> &u, const Template &ptem, double pt_max);
+	void reset(const std::vector<T> &px, double pt_max);
 
+	// Returns false at t_max, or once the state is steady, if requested
 	bool step(double *t);
 	void run();
 	void run_with_handler(std::function<bool(double)> handler); // TODO: do something more lightweight
 
-	const std::vector<double> &state() const;
-	void extract_output(GrayscaleImage *output);
+	const std::vector<T> &state() const;
+	const CNNStats &stats() const;
+	void extract_output(BasicGrayscaleImage<T> *output);
+
+	// Product of the Jacobian of the state equation at 'x' with 'v':
+	// J(x) = -I + A * diag(y'(x)), where y'(x) is 1 in the linear region of
+	// the nonlinearity and 0 where it saturates, so J is as sparse as A, and
+	// piecewise constant in x. The boundary condition applies to it as well,
+	// except that constant virtual cells don't depend on the state at all.
+	// Allocates a buffer on the first call, unless the method is implicit.
+	void jacobian_product(const std::vector<T> &x, const std::vector<T> &v, std::vector<T> *Jv);
 
 	// Standard CNN nonlinearity function
-	static inline double y(double x) {
-		return std::max(-1.0, std::min(+1.0, x));
+	static inline T y(T x) {
+		return std::max(T(-1), std::min(T(+1), x));
 	}
 };
 
+typedef BasicCNN<double> CNN;
+typedef BasicCNN<float> FloatCNN;
+
 #endif // CNNSIM_CNN_HH
@@ -0,0 +1,354 @@
+//
+// batch.cc
+// CNNSim, a simple CNN simulator
+//
+// Licensed under the 2-clause BSD License
+//
+
+#include <cmath>
+#include <cassert>
+
+#include <fstream>
+#include <sstream>
+
+#include "batch.hh"
+#include "halo.hh"
+#include "embedded_rk.hh"
+
+
+template<typename T>
+BasicBatchCNN<T>::BasicBatchCNN(
+	std::ptrdiff_t w,
+	std::ptrdiff_t h,
+	const std::vector<std::vector<T>> &px,
+	const std::vector<std::vector<T>> &u,
+	Template ptem,
+	double pt_max,
+	const CNNOptions &options
+):
+	width(w),
+	height(h),
+	batch(px.size()),
+	dimension(width * height * batch),
+	halo(std::max(ptem.A.radius, ptem.B.radius)),
+	x(dimension),
+	FF(dimension),
+	tem(ptem),
+	A(crop_coupling_mat(ptem.A, effective_radius(ptem.A))),
+	B(crop_coupling_mat(ptem.B, effective_radius(ptem.B))),
+	h(options.rel_tol * options.abs_tol),
+	t_max(pt_max),
+	dt(options.dt),
+	statistics { 0 },
+	pool(new ThreadPool(dimension < options.parallel_threshold ? 1 : options.threads, options.first_cpu)),
+	rel_tol(options.rel_tol),
+	abs_tol(options.abs_tol),
+	first_stage_valid(false)
+{
+	// Rudimentary sanity checking
+	assert(batch > 0 && "the batch is empty");
+	assert(u.size() == px.size() && "there must be an input image for every initial state");
+	assert(width >= halo && height >= halo && "image is smaller than the neighborhood");
+
+	const StencilKernels<T> &kernels = get_stencil_kernels<T>(options.kernel_isa);
+	const std::ptrdiff_t cells = width * height;
+
+	stencil_row = kernels.batch_stencil_row;
+	std::copy_n(&A[0][0], A.size() * A.size(), feedback_coeffs);
+
+	statistics.method = options.method == MethodGSL ? MethodRKF45 : options.method;
+	statistics.threads = pool->size();
+	statistics.kernel_isa = options.kernel_isa;
+	statistics.feedback_shape = A.radius > 1 ? StencilFull : classify_stencil(&A[0][0]);
+	statistics.feedforward_shape = B.radius > 1 ? StencilFull : classify_stencil(&B[0][0]);
+	statistics.feedback_radius = A.radius;
+	statistics.feedforward_radius = B.radius;
+	statistics.feedback_structure = CouplingGeneral;
+	statistics.feedforward_structure = CouplingGeneral;
+
+	// Interleave the initial states, and the inputs, which are halo-padded
+	std::vector<T> U((width + 2 * halo) * (height + 2 * halo) * batch);
+
+	for (std::ptrdiff_t b = 0; b < batch; b++) {
+		assert(px[b].size() == std::size_t(cells) && "you lied about the size of an initial state");
+		assert(u[b].size() == std::size_t(cells) && "you lied about the size of an input image");
+
+		for (std::ptrdiff_t r = 0; r < height; r++) {
+			for (std::ptrdiff_t c = 0; c < width; c++) {
+				x[to_index(r, c, width) * batch + b] = px[b][to_index(r, c, width)];
+				U[to_padded_index(r, c, width, halo) * batch + b] = u[b][to_index(r, c, width)];
+			}
+		}
+	}
+
+	fill_batch_halo(U.data(), T(tem.virtual_cell));
+
+	// Precompute Feed-Forward Image
+	T feedforward_coeffs[(2 * MaxTemplateRadius + 1) * (2 * MaxTemplateRadius + 1)];
+	std::copy_n(&B[0][0], B.size() * B.size(), feedforward_coeffs);
+
+	pool->parallel_for(height, [&](std::ptrdiff_t r_begin, std::ptrdiff_t r_end, std::ptrdiff_t) {
+		const T *rows[2 * MaxTemplateRadius + 1];
+
+		for (std::ptrdiff_t r = r_begin; r < r_end; r++) {
+			T *RESTRICT FF_row = &FF[to_index(r, 0, width) * batch];
+
+			for (std::ptrdiff_t i = 0; i < 2 * B.radius + 1; i++) {
+				rows[i] = &U[to_padded_index(r - B.radius + i, 0, width, halo) * batch];
+			}
+
+			std::fill_n(FF_row, width * batch, T(tem.Z));
+			stencil_row(FF_row, rows, feedforward_coeffs, B.radius, batch, width);
+		}
+	});
+
+	// The output image is only needed with feedback
+	if (statistics.feedback_shape != StencilZero) {
+		Y.resize(U.size());
+	}
+
+	// Set up ODE solver
+	switch (statistics.method) {
+	case MethodRKF45:
+	case MethodDOPRI5:
+		std::for_each(k.begin(), k.begin() + embedded_rk_tableau(statistics.method).stages, [&](std::vector<T> &stage) {
+			stage.resize(dimension);
+		});
+
+		for (auto &trial : x_trial) {
+			trial.resize(dimension);
+		}
+
+		partial_errors.resize(pool->size());
+		break;
+
+	case MethodEuler:
+		assert(dt > 0 && "step size must be positive");
+		k[0].resize(dimension);
+		break;
+
+	default:
+		assert(0 && "the batch simulator only supports rkf45, dopri5 and euler");
+	}
+}
+
+// The same as fill_halo(), with every cell being a vector of 'batch' lanes.
+// The halo is thin, so this goes cell by cell, through boundary_index().
+template<typename T>
+void BasicBatchCNN<T>::fill_batch_halo(T *RESTRICT img, T virtual_cell)
+{
+	for (std::ptrdiff_t r = -halo; r < height + halo; r++) {
+		const std::ptrdiff_t r_src = boundary_index(r, height, tem.boundary_condition);
+
+		for (std::ptrdiff_t c = -halo; c < width + halo; c++) {
+			if (r >= 0 && r < height && c >= 0 && c < width) {
+				c = width - 1; // skip the interior of the row
+				continue;
+			}
+
+			const std::ptrdiff_t c_src = boundary_index(c, width, tem.boundary_condition);
+			T *RESTRICT dst = img + to_padded_index(r, c, width, halo) * batch;
+
+			if (r_src < 0 || c_src < 0) {
+				std::fill_n(dst, batch, virtual_cell);
+			} else {
+				std::copy_n(img + to_padded_index(r_src, c_src, width, halo) * batch, batch, dst);
+			}
+		}
+	}
+}
+
+// The state equation of the whole batch. finish(dxdt_part, offset, n, thread)
+// is called with each row of 'dxdt' as soon as it is complete, just like in
+// BasicCNN::dynamic_eq().
+template<typename T>
+template<typename Fn>
+void BasicBatchCNN<T>::dynamic_eq(const T *RESTRICT x, T *RESTRICT dxdt, const Fn &finish)
+{
+	const T *RESTRICT FF = this->FF.data();
+	T *RESTRICT Y = this->Y.data();
+	const std::ptrdiff_t row_size = width * batch;
+	const bool coupled = statistics.feedback_shape != StencilZero;
+
+	// Stage 1: the output image, and its boundary condition
+	if (coupled) {
+		pool->parallel_for(height, [&](std::ptrdiff_t r_begin, std::ptrdiff_t r_end, std::ptrdiff_t) {
+			for (std::ptrdiff_t r = r_begin; r < r_end; r++) {
+				const T *RESTRICT x_row = x + r * row_size;
+				T *RESTRICT Y_row = Y + to_padded_index(r, 0, width, halo) * batch;
+
+				for (std::ptrdiff_t m = 0; m < row_size; m++) {
+					Y_row[m] = BasicCNN<T>::y(x_row[m]);
+				}
+			}
+		});
+
+		fill_batch_halo(Y, BasicCNN<T>::y(T(tem.virtual_cell)));
+		statistics.output_evaluations += dimension;
+	}
+
+	// Stage 2: feedback stencil, a row of every image at a time
+	pool->parallel_for(height, [&](std::ptrdiff_t r_begin, std::ptrdiff_t r_end, std::ptrdiff_t k) {
+		const T *rows[2 * MaxTemplateRadius + 1];
+
+		for (std::ptrdiff_t r = r_begin; r < r_end; r++) {
+			const T *RESTRICT FF_row = FF + r * row_size;
+			const T *RESTRICT x_row = x + r * row_size;
+			T *RESTRICT dxdt_row = dxdt + r * row_size;
+
+			for (std::ptrdiff_t m = 0; m < row_size; m++) {
+				dxdt_row[m] = FF_row[m] - x_row[m];
+			}
+
+			if (coupled) {
+				for (std::ptrdiff_t i = 0; i < 2 * A.radius + 1; i++) {
+					rows[i] = Y + to_padded_index(r - A.radius + i, 0, width, halo) * batch;
+				}
+
+				stencil_row(dxdt_row, rows, feedback_coeffs, A.radius, batch, width);
+			}
+
+			finish(dxdt_row, r * row_size, row_size, k);
+		}
+	});
+
+	statistics.rhs_evaluations++;
+}
+
+// The same as BasicCNN::step_embedded_rk(), except that there is no
+// steady-state detection, and the largest error, hence the step size,
+// is that of the whole batch
+template<typename T>
+bool BasicBatchCNN<T>::step_embedded_rk(const EmbeddedRKTableau &tableau, double *t)
+{
+	return embedded_rk_step(this, tableau, t, [] {
+	}, [](const T *, const T *, std::ptrdiff_t, std::ptrdiff_t, std::ptrdiff_t) {
+	});
+}
+
+template<typename T>
+bool BasicBatchCNN<T>::step_euler(double *t)
+{
+	const T step = T(std::min(dt, t_max - *t));
+	T *RESTRICT x = this->x.data();
+
+	// Each row only depends on the output image, so it's updated in place
+	dynamic_eq(x, k[0].data(), [&](T *RESTRICT dxdt, std::ptrdiff_t offset, std::ptrdiff_t n, std::ptrdiff_t) {
+		T *RESTRICT x_part = x + offset;
+
+		for (std::ptrdiff_t m = 0; m < n; m++) {
+			x_part[m] += step * dxdt[m];
+		}
+	});
+
+	*t = std::min(*t + dt, t_max);
+
+	return *t < t_max;
+}
+
+template<typename T>
+bool BasicBatchCNN<T>::step(double *t)
+{
+	statistics.steps++;
+
+	switch (statistics.method) {
+	case MethodRKF45:
+	case MethodDOPRI5:
+		return step_embedded_rk(embedded_rk_tableau(statistics.method), t);
+
+	case MethodEuler:
+		return step_euler(t);
+
+	default:
+		assert(0 && "invalid integration method");
+		return false;
+	}
+}
+
+template<typename T>
+void BasicBatchCNN<T>::run()
+{
+	double t = 0.0;
+	while (step(&t)) {
+		// no-op
+	}
+}
+
+template<typename T>
+const CNNStats &BasicBatchCNN<T>::stats() const
+{
+	return statistics;
+}
+
+template<typename T>
+void BasicBatchCNN<T>::extract_state(std::ptrdiff_t b, std::vector<T> *state) const
+{
+	assert(0 <= b && b < batch && "no such image in the batch");
+
+	state->resize(width * height);
+
+	for (std::ptrdiff_t i = 0; i < width * height; i++) {
+		(*state)[i] = x[i * batch + b];
+	}
+}
+
+template<typename T>
+void BasicBatchCNN<T>::extract_output(std::ptrdiff_t b, BasicGrayscaleImage<T> *output) const
+{
+	extract_state(b, &output->buf);
+	output->width = width;
+	output->height = height;
+	std::transform(output->buf.begin(), output->buf.end(), output->buf.begin(), BasicCNN<T>::y);
+}
+
+bool load_batch_list(const char *list_file, std::vector<BatchItem> *items, std::string *error)
+{
+	std::ifstream file(list_file);
+	std::string line;
+	std::size_t line_number = 0;
+
+	if (!file) {
+		*error = "Can't open batch list file '" + std::string(list_file) + "'";
+		return false;
+	}
+
+	while (std::getline(file, line)) {
+		std::istringstream words(line);
+		std::string fields[3];
+		std::size_t n_fields = 0;
+		std::string word;
+
+		line_number++;
+
+		while (n_fields < 3 && words >> word) {
+			if (word[0] == '#' && n_fields == 0) {
+				break; // comment
+			}
+
+			if (word[0] == '@') {
+				std::string height, value;
+				words >> height >> value;
+				word += " " + height + " " + value;
+			}
+
+			fields[n_fields++] = word;
+		}
+
+		if (n_fields == 0) {
+			continue;
+		}
+
+		if (n_fields < 3 || words >> word) {
+			*error = std::string(list_file) + ":" + std::to_string(line_number) + ": expected a state, an input and an output file";
+			return false;
+		}
+
+		items->push_back({ fields[0], fields[1], fields[2] });
+	}
+
+	return true;
+}
+
+
+template struct BasicBatchCNN<float>;
+template struct BasicBatchCNN<double>;
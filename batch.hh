@@ -0,0 +1,135 @@
+//
+// batch.hh
+// CNNSim, a simple CNN simulator
+//
+// Licensed under the 2-clause BSD License
+//
+
+#ifndef CNNSIM_BATCH_HH
+#define CNNSIM_BATCH_HH
+
+#include <cstddef>
+
+#include <array>
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <functional>
+
+#include "util.hh"
+#include "template.hh"
+#include "imgproc.hh"
+#include "threadpool.hh"
+#include "kernels.hh"
+#include "CNN.hh"
+
+
+// A simulator of a batch of images of the same size, all with the same
+// template, in lockstep. The images are interleaved cell by cell: the
+// values of a cell in every image of the batch are consecutive in memory,
+// so each SIMD lane of the stencil kernels belongs to a different image,
+// and every template runs at full vector width, whatever its shape.
+// The feed-forward stencil, the thread pool and the step size control are
+// shared by the whole batch; the step size is the one the hardest image
+// needs. Only the built-in explicit methods rkf45, dopri5 and euler are
+// supported; GSL is replaced by rkf45, which takes the same steps. Options
+// of BasicCNN which don't apply to the batch (tiles, steady-state detection,
+// the active set and the rest) are ignored.
+template<typename T>
+struct BasicBatchCNN {
+public:
+	typedef T Scalar;
+
+	const std::ptrdiff_t width;     // of each image
+	const std::ptrdiff_t height;    // ditto
+	const std::ptrdiff_t batch;     // number of images
+	const std::ptrdiff_t dimension; // of the whole system: cells of all images
+
+private:
+	const std::ptrdiff_t halo;
+
+	// Interleaved images: the value of cell i of image b is at [i * batch + b]
+	std::vector<T> x;
+	std::vector<T> FF; // feed-forward image, precomputed
+	std::vector<T> Y;  // halo-padded output image
+
+	Template tem;
+	CouplingMat A; // cropped to its effective radius
+	CouplingMat B; // ditto
+	T feedback_coeffs[(2 * MaxTemplateRadius + 1) * (2 * MaxTemplateRadius + 1)];
+	BatchStencilRowFn<T> stencil_row;
+
+	double h; // step size of the adaptive methods
+	const double t_max;
+	const double dt; // step size of euler
+
+	CNNStats statistics;
+
+	std::unique_ptr<ThreadPool> pool;
+
+	// Integrators, the same as those of BasicCNN
+	double rel_tol;
+	double abs_tol;
+	std::array<std::vector<T>, MaxRKStages> k;
+	std::array<std::vector<T>, 2> x_trial;
+	std::vector<double> partial_errors; // one per thread
+	bool first_stage_valid;             // k[0] is the derivative at x
+
+	void fill_batch_halo(T *RESTRICT img, T virtual_cell);
+	template<typename Fn> void dynamic_eq(const T *RESTRICT x, T *RESTRICT dxdt, const Fn &finish);
+
+	bool step_embedded_rk(const EmbeddedRKTableau &tableau, double *t);
+	bool step_euler(double *t);
+
+	// The built-in embedded Runge-Kutta methods, shared with BasicCNN
+	template<typename Sim, typename Begin, typename Observe>
+	friend bool embedded_rk_step(Sim *sim, const EmbeddedRKTableau &tableau, double *t, const Begin &begin_first_stage, const Observe &observe_first_stage);
+
+public:
+	// 'px' and 'u' are the initial states and inputs of the images, each
+	// of which is 'w' by 'h' cells; there must be as many of both.
+	BasicBatchCNN(
+		std::ptrdiff_t w,
+		std::ptrdiff_t h,
+		const std::vector<std::vector<T>> &px,
+		const std::vector<std::vector<T>> &u,
+		Template ptem,
+		double pt_max,
+		const CNNOptions &options
+	);
+
+	BasicBatchCNN(const BasicBatchCNN &) = delete;
+	BasicBatchCNN(BasicBatchCNN &&) = delete;
+
+	BasicBatchCNN &operator=(const BasicBatchCNN &) = delete;
+	BasicBatchCNN &operator=(BasicBatchCNN &&) = delete;
+
+	// Returns false at t_max
+	bool step(double *t);
+	void run();
+
+	const CNNStats &stats() const;
+
+	// The state and the output of image 'b' of the batch
+	void extract_state(std::ptrdiff_t b, std::vector<T> *state) const;
+	void extract_output(std::ptrdiff_t b, BasicGrayscaleImage<T> *output) const;
+};
+
+typedef BasicBatchCNN<double> BatchCNN;
+typedef BasicBatchCNN<float> FloatBatchCNN;
+
+// One line of a batch list file: the initial state, the input and the output
+// file, separated by whitespace. Constant images ("@W H value") contain
+// whitespace themselves, so '@' makes a field 3 words long. Lines starting
+// with '#' are comments.
+struct BatchItem {
+	std::string state;
+	std::string input;
+	std::string output;
+};
+
+// Returns false and describes the first error in 'error' if the list is invalid
+bool load_batch_list(const char *list_file, std::vector<BatchItem> *items, std::string *error);
+
+#endif // CNNSIM_BATCH_HH
@@ -0,0 +1,273 @@
+//
+// client.cc
+// CNNSim, a simple CNN simulator
+//
+// Licensed under the 2-clause BSD License
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <chrono>
+#include <thread>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "server.hh"
+#include "batch.hh"
+#include "imgproc.hh"
+#include "3rdparty/optionparser.h"
+
+
+// A client of 'CNN --serve': sends a job, or every line of a list file as a
+// job, writes the outputs to image files, and prints how long it took.
+enum ClientOpt {
+	Invalid,
+	Socket,
+	State,
+	Input,
+	Templ,
+	Duration,
+	Output,
+	RelTol,
+	AbsTol,
+	Method,
+	Batch,
+	Raw,
+};
+
+
+static option::ArgStatus required_arg(const option::Option& option, bool msg)
+{
+	if (option.arg) {
+		return option::ARG_OK;
+	}
+
+	if (msg) {
+		std::fprintf(stderr, "Error: option '%.*s' requires an argument\n", option.namelen, option.name);
+	}
+
+	return option::ARG_ILLEGAL;
+}
+
+// Image files are sent by absolute path, since the working directory of
+// the server is not ours, or with '--raw', decoded and sent pixel by pixel.
+// Constant images are sent as they are, either way.
+static bool send_image(int fd, const char *key, const std::string &spec, bool raw)
+{
+	if (spec[0] == '@') {
+		const std::string line = std::string(key) + " " + spec + "\n";
+		return write_all(fd, line.data(), line.size());
+	}
+
+	if (raw) {
+		BasicGrayscaleImage<double> img = load_image_file<double>(spec.c_str());
+
+		if (img.width == 0) {
+			std::fprintf(stderr, "Can't read image '%s'\n", spec.c_str());
+			return false;
+		}
+
+		const std::string line = std::string(key) + " raw " + std::to_string(img.width) + " " + std::to_string(img.height) + "\n";
+
+		return write_all(fd, line.data(), line.size())
+		    && write_all(fd, img.buf.data(), img.buf.size() * sizeof img.buf[0]);
+	}
+
+	// If the file doesn't exist, the server says so, in the reply to the job
+	char path[PATH_MAX];
+	const char *abs_path = ::realpath(spec.c_str(), path) ? path : spec.c_str();
+
+	const std::string line = std::string(key) + " " + abs_path + "\n";
+	return write_all(fd, line.data(), line.size());
+}
+
+int main(int argc, char *argv[])
+{
+	const char *socket_path = nullptr;
+	const char *batch_file = nullptr;
+	std::string template_text;
+	std::string job_options; // the optional lines of every job
+	std::vector<BatchItem> items;
+	bool raw = false;
+
+	const option::Descriptor desc[] = {
+		{ ClientOpt::Invalid,  0, "",      "",         option::Arg::None, "Usage: CNNClient <options>\n\nOptions:\n"                               },
+		{ ClientOpt::Socket,   0, "",      "socket",   required_arg,      "       --socket   Unix domain socket of the server ('CNN --serve')" },
+		{ ClientOpt::State,    0, "s",     "state",    required_arg,      "   -s, --state    Initial state image"                              },
+		{ ClientOpt::Input,    0, "i",     "input",    required_arg,      "   -i, --input    Input image"                                      },
+		{ ClientOpt::Templ,    0, "t",     "template", required_arg,      "   -t, --template Template file"                                    },
+		{ ClientOpt::Duration, 0, "d",     "duration", required_arg,      "   -d, --duration Simulation time"                                  },
+		{ ClientOpt::Output,   0, "o",     "outfile",  required_arg,      "   -o, --outfile  Output image file"                                },
+		{ ClientOpt::RelTol,   0, "r",     "rel-tol",  required_arg,      "   -r, --rel-tol  Relative tolerance"                               },
+		{ ClientOpt::AbsTol,   0, "a",     "abs-tol",  required_arg,      "   -a, --abs-tol  Absolute tolerance"                               },
+		{ ClientOpt::Method,   0, "",      "method",   required_arg,      "       --method   Integrator (default: that of the server)"         },
+		{ ClientOpt::Batch,    0, "",      "batch",    required_arg,      "       --batch    Send every line of a list file as a job"          },
+		{ ClientOpt::Raw,      0, "",      "raw",      option::Arg::None, "       --raw      Send the pixels of images instead of their paths" },
+		{ 0,                   0, nullptr, nullptr,    nullptr,           nullptr                                                                  }
+	};
+
+	argc--;
+	argv++;
+
+	option::Stats stats(true, desc, argc, argv);
+	std::vector<option::Option> options(stats.options_max);
+	std::vector<option::Option> buffer(std::max(stats.buffer_max, 1u));
+
+	option::Parser parser(true, desc, argc, argv, &options[0], &buffer[0]);
+
+	if (parser.error() || argc <= 0) {
+		option::printUsage(std::cerr, desc);
+		return 1;
+	}
+
+	if (auto opt = options[ClientOpt::Invalid]) {
+		std::fprintf(stderr, "unrecognized option: '%.*s'\n", opt.namelen, opt.name);
+		return 1;
+	}
+
+	if (auto opt = options[ClientOpt::Socket]) {
+		socket_path = opt.last()->arg;
+	} else {
+		std::fprintf(stderr, "Must specify the socket of the server\n");
+		return 1;
+	}
+
+	if (auto opt = options[ClientOpt::Templ]) {
+		std::ifstream file(opt.last()->arg);
+		std::ostringstream text;
+
+		if (!(text << file.rdbuf())) {
+			std::fprintf(stderr, "Can't read template file '%s'\n", opt.last()->arg);
+			return 1;
+		}
+
+		template_text = text.str();
+	} else {
+		std::fprintf(stderr, "Must specify template\n");
+		return 1;
+	}
+
+	if (auto opt = options[ClientOpt::Duration]) {
+		job_options += "duration " + std::string(opt.last()->arg) + "\n";
+	} else {
+		std::fprintf(stderr, "Must specify duration of simulation\n");
+		return 1;
+	}
+
+	if (auto opt = options[ClientOpt::RelTol]) {
+		job_options += "rel-tol " + std::string(opt.last()->arg) + "\n";
+	}
+
+	if (auto opt = options[ClientOpt::AbsTol]) {
+		job_options += "abs-tol " + std::string(opt.last()->arg) + "\n";
+	}
+
+	if (auto opt = options[ClientOpt::Method]) {
+		job_options += "method " + std::string(opt.last()->arg) + "\n";
+	}
+
+	raw = options[ClientOpt::Raw];
+
+	if (auto opt = options[ClientOpt::Batch]) {
+		std::string error;
+		batch_file = opt.last()->arg;
+
+		if (!load_batch_list(batch_file, &items, &error)) {
+			std::fprintf(stderr, "%s\n", error.c_str());
+			return 1;
+		}
+	} else if (options[ClientOpt::State] && options[ClientOpt::Input] && options[ClientOpt::Output]) {
+		items.push_back({
+			options[ClientOpt::State].last()->arg,
+			options[ClientOpt::Input].last()->arg,
+			options[ClientOpt::Output].last()->arg
+		});
+	} else {
+		std::fprintf(stderr, "Must specify a state, an input and an output file, or a batch list\n");
+		return 1;
+	}
+
+	const int fd = connect_unix_socket(socket_path);
+
+	if (fd < 0) {
+		std::fprintf(stderr, "Can't connect to '%s': %s\n", socket_path, std::strerror(errno));
+		return 1;
+	}
+
+	const auto t0 = std::chrono::steady_clock::now();
+
+	// Jobs are sent by a thread of their own, while the replies are read
+	// here, so that neither end blocks the other when the queue is full.
+	// The job ID is the index into 'items'.
+	std::thread sender([&] {
+		const std::string template_line = "template " + std::to_string(template_text.size()) + "\n";
+
+		for (std::size_t i = 0; i < items.size(); i++) {
+			const std::string job_line = "job " + std::to_string(i) + "\n";
+
+			if (!write_all(fd, job_line.data(), job_line.size())
+			 || !write_all(fd, template_line.data(), template_line.size())
+			 || !write_all(fd, template_text.data(), template_text.size())
+			 || !send_image(fd, "state", items[i].state, raw)
+			 || !send_image(fd, "input", items[i].input, raw)
+			 || !write_all(fd, job_options.data(), job_options.size())
+			 || !write_all(fd, "run\n", 4)) {
+				break;
+			}
+		}
+
+		::shutdown(fd, SHUT_WR);
+	});
+
+	SocketReader reader(fd);
+	std::string line;
+	std::size_t done = 0, failed = 0;
+	BasicGrayscaleImage<double> out_image;
+
+	while (reader.read_line(&line)) {
+		unsigned long id = 0;
+		long width = 0, height = 0;
+		double seconds = 0;
+
+		if (std::sscanf(line.c_str(), "done %lu %ld %ld %lf", &id, &width, &height, &seconds) == 4 && id < items.size()) {
+			out_image.width = width;
+			out_image.height = height;
+			out_image.buf.resize(width * height);
+
+			if (!reader.read_bytes(out_image.buf.data(), out_image.buf.size() * sizeof out_image.buf[0])) {
+				break;
+			}
+
+			if (save_image_file(items[id].output.c_str(), out_image)) {
+				done++;
+			} else {
+				std::fprintf(stderr, "Can't write image '%s'\n", items[id].output.c_str());
+				failed++;
+			}
+		} else if (line.compare(0, 6, "error ") == 0) {
+			std::fprintf(stderr, "%s\n", line.c_str());
+			failed++;
+		} else {
+			std::fprintf(stderr, "Unexpected reply: '%s'\n", line.c_str());
+			break;
+		}
+	}
+
+	sender.join();
+	::close(fd);
+
+	const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - t0;
+
+	std::printf("%zu of %zu job(s) done in %.3f seconds\n", done, items.size(), elapsed.count());
+
+	return done == items.size() && failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,260 @@
+//
+// embedded_rk.hh
+// CNNSim, a simple CNN simulator
+//
+// Licensed under the 2-clause BSD License
+//
+
+#ifndef CNNSIM_EMBEDDED_RK_HH
+#define CNNSIM_EMBEDDED_RK_HH
+
+#include <cstddef>
+#include <cmath>
+#include <cassert>
+#include <algorithm>
+#include <type_traits>
+
+#include "util.hh"
+#include "CNN.hh"
+
+
+// Calls f(std::integral_constant<int, n>()) for 1 <= n <= N, so that the
+// number of stages summed over is a compile-time constant in f, and the
+// loop over the stages can be unrolled into the loop over the cells.
+template<int N>
+struct RKStageDispatch {
+	template<typename F>
+	static void call(int n, const F &f)
+	{
+		if (n == N) {
+			f(std::integral_constant<int, N>());
+		} else {
+			RKStageDispatch<N - 1>::call(n, f);
+		}
+	}
+};
+
+template<>
+struct RKStageDispatch<0> {
+	template<typename F>
+	static void call(int, const F &)
+	{
+		assert(false && "invalid number of Runge-Kutta stages");
+	}
+};
+
+// Trial state of a stage: x + sum(a_j * k_j) over the first I stages
+template<int I, typename T>
+void embedded_rk_combine(const T *RESTRICT x, const T *const *k, const T *a, T *RESTRICT xt, std::ptrdiff_t n)
+{
+	for (std::ptrdiff_t m = 0; m < n; m++) {
+		T sum = x[m];
+
+		for (int j = 0; j < I; j++) {
+			sum += a[j] * k[j][m];
+		}
+
+		xt[m] = sum;
+	}
+}
+
+// New state (unless the last stage was evaluated at it) and the maximal
+// scaled error of a step with S stages, given the largest one so far. The
+// cells are processed in blocks: the increments and the scaled errors of a
+// block are computed by loops that vectorize, and only the maximum of the
+// errors is taken one by one, since it isn't associative with NaNs.
+template<int S, typename T>
+double embedded_rk_finish(
+	const T *RESTRICT x,
+	const T *const *k,
+	const T *b,
+	const T *e,
+	T *RESTRICT x_new,
+	bool fsal,
+	double abs_tol,
+	double rel_tol,
+	std::ptrdiff_t n,
+	double err_max
+)
+{
+	const std::ptrdiff_t block_size = 256;
+	T dx[block_size], err[block_size];
+	double ratio[block_size];
+
+	for (std::ptrdiff_t begin = 0; begin < n; begin += block_size) {
+		const std::ptrdiff_t size = std::min(block_size, n - begin);
+
+		for (std::ptrdiff_t m = 0; m < size; m++) {
+			T d = 0, r = 0;
+
+			for (int j = 0; j < S; j++) {
+				d += b[j] * k[j][begin + m];
+				r += e[j] * k[j][begin + m];
+			}
+
+			dx[m] = d;
+			err[m] = r;
+		}
+
+		if (!fsal) {
+			for (std::ptrdiff_t m = 0; m < size; m++) {
+				x_new[begin + m] = x[begin + m] + dx[m];
+			}
+		}
+
+		for (std::ptrdiff_t m = 0; m < size; m++) {
+			double D = abs_tol + rel_tol * (std::fabs(double(x_new[begin + m])) + std::fabs(double(dx[m])));
+			ratio[m] = std::fabs(double(err[m])) / D;
+		}
+
+		for (std::ptrdiff_t m = 0; m < size; m++) {
+			err_max = std::max(err_max, ratio[m]);
+		}
+	}
+
+	return err_max;
+}
+
+
+// One adaptive step of a built-in embedded Runge-Kutta method of 'sim', which
+// is a BasicCNN or a BasicBatchCNN; their step_embedded_rk() call this, with
+// access to their RHS, state and integrator buffers. Error control is the
+// same as that of GSL's standard control object with a_y = a_dydt = 1,
+// except that the derivative term uses the increment of the step, so that no
+// extra RHS evaluation is needed at the end of the step. The error of the
+// step is the largest one of all cells of 'sim', i.e. of the whole batch.
+//
+// Like the fixed-step methods, this makes a single pass over the state per
+// stage: the trial state of the next stage is computed from each part of a
+// stage as soon as it's complete, and the last stage is fused with computing
+// the new state and the maximal error (one partial maximum per thread).
+// The trial states alternate between two buffers, since a stage may not
+// overwrite the state it is evaluated at.
+//
+// The first stage is the derivative at the current state, which the
+// simulator may want to look at, e.g. for steady-state detection:
+// begin_first_stage() is called before each attempt at the step, then
+// observe_first_stage(x, k1, offset, n, thread) with each part of it.
+template<typename Sim, typename Begin, typename Observe>
+bool embedded_rk_step(
+	Sim *sim,
+	const EmbeddedRKTableau &tableau,
+	double *t,
+	const Begin &begin_first_stage,
+	const Observe &observe_first_stage
+)
+{
+	typedef typename Sim::Scalar T;
+
+	const double order = 5;
+	const int S = tableau.stages;
+	const T *RESTRICT x0 = sim->x.data();
+	const T *ks[MaxRKStages];
+	T *trial[2] = { sim->x_trial[0].data(), sim->x_trial[1].data() };
+
+	for (int j = 0; j < S; j++) {
+		ks[j] = sim->k[j].data();
+	}
+
+	// The state at which the last stage is evaluated, and the new state
+	T *RESTRICT x_last = trial[(S - 1) % 2];
+	T *RESTRICT x_new = tableau.fsal ? x_last : trial[S % 2];
+
+	for (;;) {
+		double dt = std::min(sim->h, sim->t_max - *t);
+		T a[MaxRKStages][MaxRKStages - 1], b[MaxRKStages], e[MaxRKStages];
+
+		for (int i = 0; i < S; i++) {
+			for (int j = 0; j < i; j++) {
+				a[i][j] = T(dt * tableau.a[i][j]);
+			}
+
+			b[i] = T(dt * tableau.b[i]);
+			e[i] = T(dt * tableau.e[i]);
+		}
+
+		// Trial state of stage i: x + dt * sum(a_ij * k_j)
+		auto combine = [&](int i, std::ptrdiff_t offset, std::ptrdiff_t n) {
+			const T *k[MaxRKStages];
+
+			for (int j = 0; j < i; j++) {
+				k[j] = ks[j] + offset;
+			}
+
+			RKStageDispatch<MaxRKStages - 1>::call(i, [&](auto stages) {
+				embedded_rk_combine<decltype(stages)::value>(x0 + offset, k, a[i], trial[i % 2] + offset, n);
+			});
+		};
+
+		// 5th order solution and the maximal scaled error estimate
+		auto finish_step = [&](std::ptrdiff_t offset, std::ptrdiff_t n, std::ptrdiff_t p) {
+			const T *k[MaxRKStages];
+
+			for (int j = 0; j < S; j++) {
+				k[j] = ks[j] + offset;
+			}
+
+			RKStageDispatch<MaxRKStages>::call(S, [&](auto stages) {
+				sim->partial_errors[p] = embedded_rk_finish<decltype(stages)::value>(
+					x0 + offset, k, b, e, x_new + offset, tableau.fsal,
+					sim->abs_tol, sim->rel_tol, n, sim->partial_errors[p]
+				);
+			});
+		};
+
+		// Stage 1 doesn't depend on the step size, so it survives rejections
+		begin_first_stage();
+
+		if (sim->first_stage_valid) {
+			sim->pool->parallel_for(sim->dimension, [&](std::ptrdiff_t begin, std::ptrdiff_t end, std::ptrdiff_t p) {
+				combine(1, begin, end - begin);
+				observe_first_stage(x0 + begin, ks[0] + begin, begin, end - begin, p);
+			});
+		} else {
+			sim->dynamic_eq(x0, sim->k[0].data(), [&](T *k1, std::ptrdiff_t offset, std::ptrdiff_t n, std::ptrdiff_t p) {
+				combine(1, offset, n);
+				observe_first_stage(x0 + offset, k1, offset, n, p);
+			});
+			sim->first_stage_valid = true;
+		}
+
+		// Stages 2...S - 1, each fused with the trial state of the next one
+		for (int i = 1; i < S - 1; i++) {
+			sim->dynamic_eq(trial[i % 2], sim->k[i].data(), [&](T *, std::ptrdiff_t offset, std::ptrdiff_t n, std::ptrdiff_t) {
+				combine(i + 1, offset, n);
+			});
+		}
+
+		std::fill(sim->partial_errors.begin(), sim->partial_errors.end(), 0.0);
+
+		sim->dynamic_eq(x_last, sim->k[S - 1].data(), [&](T *, std::ptrdiff_t offset, std::ptrdiff_t n, std::ptrdiff_t p) {
+			finish_step(offset, n, p);
+		});
+
+		double rmax = *std::max_element(sim->partial_errors.begin(), sim->partial_errors.end());
+
+		if (rmax > 1.1) {
+			// reject, and retry with a smaller step
+			sim->h = dt * std::max(0.2, 0.9 * std::pow(rmax, -1.0 / order));
+			continue;
+		}
+
+		std::swap(sim->x, sim->x_trial[x_new == trial[0] ? 0 : 1]);
+		*t += dt;
+
+		// The last stage is the derivative at the new state
+		if (tableau.fsal) {
+			std::swap(sim->k[0], sim->k[S - 1]);
+		} else {
+			sim->first_stage_valid = false;
+		}
+
+		if (rmax < 0.5) {
+			sim->h = dt * std::min(5.0, std::max(1.0, 0.9 * std::pow(rmax, -1.0 / (order + 1))));
+		}
+
+		return *t < sim->t_max;
+	}
+}
+
+#endif // CNNSIM_EMBEDDED_RK_HH
@@ -0,0 +1,33 @@
+#!/bin/sh
+
+# Compares the dense simulation with the active set, on propagating
+# templates, where only a thin front of cells changes at any time.
+# Prints the wall-clock time, and the fraction of tiles skipped by the
+# active set. The outputs are written to activeset_out/, so that they
+# can be compared. Extra arguments are passed on to the simulator, e.g.:
+#
+#     ./activeset.sh --method euler --tile 16x16
+
+mkdir -p activeset_out
+
+run() {
+	name=$1
+	shift
+
+	for mode in dense active; do
+		echo "=== $name, $mode"
+
+		if [ $mode = active ]; then
+			set -- "$@" --active-set
+		fi
+
+		../CNN "$@" -o activeset_out/${name}_$mode.png --stats --method rkf45 $EXTRA_ARGS | grep -E 'Simulation|Integration steps|Frozen'
+	done
+}
+
+EXTRA_ARGS="$*"
+
+run hole_fill_test_256 -s "@256 256 1" -i ../inputs/test_256.png -t ../templates/hole_fill -d 50
+run left_shadow_test_256 -s ../inputs/test_256.png -i ../inputs/test_256.png -t ../templates/left_shadow -d 50
+run diag_shadow_test_256 -s ../inputs/test_256.png -i ../inputs/test_256.png -t ../templates/diag_shadow -d 50
+run delete_dead_end_maze_64 -s ../inputs/black_64.png -i ../inputs/maze_64.png -t ../templates/delete_dead_end -d 50
@@ -0,0 +1,26 @@
+#!/bin/sh
+
+# Simulates 256 small images, first one process per image, then all of
+# them with '--batch', 16 at a time. The outputs are written to
+# batch_out/, and the wall-clock times are printed. Extra arguments
+# (e.g. '--precision float' or '--batch-size 64') are passed on to the
+# batch simulator.
+
+mkdir -p batch_out
+rm -f batch_out/list
+
+for i in $(seq 256); do
+	echo "../inputs/pattern_32.png ../inputs/pattern_32.png batch_out/batch_$i.png" >> batch_out/list
+done
+
+echo "=== one process per image"
+start=$(date +%s)
+
+for i in $(seq 256); do
+	../CNN -s ../inputs/pattern_32.png -i ../inputs/pattern_32.png -t ../templates/hole_fill -d 20 --method rkf45 -o batch_out/single_$i.png > /dev/null
+done
+
+echo "$(( $(date +%s) - start )) seconds"
+
+echo "=== batch"
+../CNN --batch batch_out/list -t ../templates/hole_fill -d 20 --method rkf45 "$@"
@@ -0,0 +1,48 @@
+#!/bin/sh
+
+# Runs every template on the shipped input images and prints the
+# wall-clock time as well as the work counters of each simulation.
+# If BASELINE names another build of the simulator, e.g. one from
+# before a change, every simulation is run with that one as well,
+# and the times of both are compared at the end. Extra arguments are
+# passed on to the simulator (and to the baseline), e.g.:
+#
+#     ./benchmark.sh -r 1e-2 -a 1e-1
+#     BASELINE=/path/to/old/CNN ./benchmark.sh
+
+log=$(mktemp)
+times=$(mktemp)
+trap 'rm -f $log $times' EXIT
+
+seconds() {
+	sed -n 's/^Simulation completed in \([0-9.]*\) seconds$/\1/p' $log
+}
+
+for img in test_64 test_128 test_256 black_600_375; do
+	for tem in ../templates/*; do
+		echo "=== $(basename $tem) on $img"
+		../CNN -s ../inputs/$img.png -i ../inputs/$img.png -t $tem -d 10 -o /dev/null --stats "$@" > $log
+		cat $log
+
+		if [ -n "$BASELINE" ]; then
+			after=$(seconds)
+			"$BASELINE" -s ../inputs/$img.png -i ../inputs/$img.png -t $tem -d 10 -o /dev/null "$@" > $log
+			echo "$(basename $tem) $img $(seconds) $after" >> $times
+		fi
+	done
+done
+
+if [ -n "$BASELINE" ]; then
+	echo "=== Seconds with the baseline and with this build"
+
+	# Times are printed in milliseconds, so the ratio of very short runs is rough
+	awk 'function row(name, a, b) {
+		printf "%-36s %8.3f %8.3f %6.2fx\n", name, a, b, (b > 0 ? a / b : 1)
+	} {
+		row($1 " on " $2, $3, $4)
+		before += $3
+		after += $4
+	} END {
+		row("total", before, after)
+	}' $times
+fi
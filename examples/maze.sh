@@ -1,16 +1,12 @@
 #!/bin/sh
 
-# An example of batch-processing images
+# An example of processing images with a sequence of templates.
 # This computation tries to find the path in a maze
 # by progressively erasing dead ends.
+#
+# The whole computation is a single program (maze.prog), which keeps
+# the images in memory, and repeats the templates until the image stops
+# changing. The result is written to out.png. Extra arguments are passed
+# on to the simulator, e.g. '--stats'.
 
-# inputs/maze_64.png is the initial image
-cp ../inputs/maze_64.png out.png
-
-for i in {1..100}; do
-		# Erase dead ends
-		../CNN -s ../inputs/black_64.png -i out.png -t ../templates/delete_dead_end -d 10 -o out.png
-		# Preserve the starting point and end point of the maze
-		../CNN -s out.png -i ../inputs/maze_start_end.png -t ../templates/log_and -d 10 -o out.png
-done
-
+../CNN --program maze.prog "$@"
@@ -0,0 +1,49 @@
+#!/bin/sh
+
+# Compares the built-in fixed-step integrators with the adaptive ones,
+# on a 2048x2048 image and on the shipped input images. Prints the
+# wall-clock time and the number of RHS evaluations of each run. The
+# outputs are written to methods_out/, so that they can be compared.
+# At the end, each built-in method is compared with gsl, the RKF45
+# stepper of GSL: its speedup on the 2048x2048 image, and how many of
+# its outputs on the shipped images are the same as those of gsl.
+# Extra arguments are passed on to the simulator, e.g.:
+#
+#     ./methods.sh --dt 0.1 --precision float
+
+mkdir -p methods_out
+
+methods="gsl rkf45 dopri5 euler heun rk4"
+
+for method in $methods; do
+	echo "=== $method, 2048x2048"
+	../CNN -s "@2048 2048 0.1" -i "@2048 2048 -0.3" -t ../templates/hollow -d 5 -o /dev/null --stats --method $method "$@" | tee methods_out/$method.log
+
+	for img in test_128 maze_64; do
+		for tem in hollow erosion_symm; do
+			echo "=== $method, $tem on $img"
+			../CNN -s ../inputs/$img.png -i ../inputs/$img.png -t ../templates/$tem -d 10 -o methods_out/${method}_${tem}_$img.png --stats --method $method "$@"
+		done
+	done
+done
+
+seconds() {
+	sed -n 's/^Simulation completed in \([0-9.]*\) seconds$/\1/p' methods_out/$1.log
+}
+
+echo "=== Compared with gsl"
+
+for method in $methods; do
+	[ $method = gsl ] && continue
+
+	same=0
+	total=0
+
+	for out in methods_out/${method}_*.png; do
+		total=$((total + 1))
+		cmp -s $out methods_out/gsl_${out#methods_out/${method}_} && same=$((same + 1))
+	done
+
+	awk -v m=$method -v a=$(seconds gsl) -v b=$(seconds $method) -v same=$same -v total=$total \
+		'BEGIN { printf "%-7s %6.2fx as fast on 2048x2048, %d of %d outputs the same\n", m, a / b, same, total }'
+done
@@ -0,0 +1,15 @@
+#!/bin/sh
+
+# Measures how the simulation scales with the number of threads,
+# on images of 256x256 and larger. Extra arguments are passed on
+# to the simulator. Only the CPUs the shell may run on count, so
+# e.g. 'taskset -c 0-3 ./scaling.sh' measures scaling on 4 of them.
+
+echo "$(nproc) CPU(s) available"
+
+for size in 256 512 1024 2048; do
+	for threads in 1 2 4 8 16; do
+		echo "=== ${size}x${size}, $threads thread(s)"
+		../CNN -s "@$size $size 0.1" -i "@$size $size -0.3" -t ../templates/hollow -d 5 -o /dev/null --threads $threads "$@"
+	done
+done
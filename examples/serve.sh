@@ -0,0 +1,36 @@
+#!/bin/sh
+
+# Simulates 256 small images, first one process per image, then all of
+# them as jobs of a server ('--serve'), sent by CNNClient. The outputs are
+# written to serve_out/, and the wall-clock times are printed. Extra
+# arguments (e.g. '--workers 4') are passed on to the server.
+
+socket=/tmp/cnnsim_example.sock
+
+mkdir -p serve_out
+rm -f serve_out/list
+
+for i in $(seq 256); do
+	echo "../inputs/pattern_32.png ../inputs/pattern_32.png serve_out/served_$i.png" >> serve_out/list
+done
+
+echo "=== one process per image"
+start=$(date +%s)
+
+for i in $(seq 256); do
+	../CNN -s ../inputs/pattern_32.png -i ../inputs/pattern_32.png -t ../templates/hole_fill -d 20 --method rkf45 -o serve_out/single_$i.png > /dev/null
+done
+
+echo "$(( $(date +%s) - start )) seconds"
+
+echo "=== server"
+../CNN --serve $socket --method rkf45 "$@" &
+server=$!
+
+while [ ! -S $socket ]; do
+	sleep 0.1
+done
+
+../CNNClient --socket $socket -t ../templates/hole_fill -d 20 --batch serve_out/list
+
+kill $server
@@ -0,0 +1,42 @@
+#!/bin/sh
+
+# Checks that '--until-steady' stops hole filling early, with the
+# adaptive methods in particular (ros2 only on a smaller image, as it's
+# slow), and that the output is the same as that of the full simulation.
+# Prints the time each run stopped at, and exits with a non-zero status
+# if any of them didn't stop, or had a different output. Extra arguments
+# are passed on to the simulator, e.g.:
+#
+#     ./steady.sh --precision float
+
+mkdir -p steady_out
+
+status=0
+
+check() {
+	name=$1
+	methods=$2
+	shift 2
+
+	for method in $methods; do
+		echo "=== $name, $method"
+
+		../CNN "$@" -o steady_out/${name}_$method.png --method $method $EXTRA_ARGS > steady_out/full.log
+		../CNN "$@" -o steady_out/${name}_${method}_steady.png --method $method --until-steady $EXTRA_ARGS > steady_out/steady.log
+
+		if ! grep 'Steady state reached' steady_out/steady.log; then
+			echo "FAILED: no steady state reached"
+			status=1
+		elif ! cmp -s steady_out/${name}_$method.png steady_out/${name}_${method}_steady.png; then
+			echo "FAILED: the output is not the same as that of the full simulation"
+			status=1
+		fi
+	done
+}
+
+EXTRA_ARGS="$*"
+
+check hole_fill_test_256 "gsl rkf45 dopri5 euler heun rk4" -s "@256 256 1" -i ../inputs/test_256.png -t ../templates/hole_fill -d 300
+check hole_fill_test_128 "ros2" -s "@128 128 1" -i ../inputs/test_128.png -t ../templates/hole_fill -d 300
+
+exit $status
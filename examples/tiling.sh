@@ -0,0 +1,19 @@
+#!/bin/sh
+
+# Compares the untiled and the cache-blocked (tiled) evaluation of the
+# state equation, on images of 64x64 to 4096x4096. Small images fit in
+# the cache anyway, so with '--tile auto', they are not tiled at all.
+# Tiled images are also advanced by 4 Euler steps at once (temporal
+# blocking), separately, so that the effects of the two can be told
+# apart. Extra arguments (e.g. '--tile 512x32' instead of auto, or
+# '--threads') are passed on to the simulator.
+
+for size in 64 128 256 512 1024 2048 4096; do
+	for tile in off auto; do
+		echo "=== ${size}x${size}, tiles: $tile"
+		../CNN -s "@$size $size 0.1" -i "@$size $size -0.3" -t ../templates/hollow -d 5 -o /dev/null --method euler --tile $tile --time-block 1 "$@"
+	done
+
+	echo "=== ${size}x${size}, tiles: auto, 4 steps per tile"
+	../CNN -s "@$size $size 0.1" -i "@$size $size -0.3" -t ../templates/hollow -d 5 -o /dev/null --method euler --tile auto --time-block 4 "$@"
+done
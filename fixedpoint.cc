@@ -0,0 +1,258 @@
+//
+// fixedpoint.cc
+// CNNSim, a simple CNN simulator
+//
+// Licensed under the 2-clause BSD License
+//
+
+#include <cmath>
+#include <cassert>
+#include <limits>
+
+#include "fixedpoint.hh"
+#include "kernels.hh"
+#include "halo.hh"
+
+
+template<typename I>
+static inline I saturate(double value)
+{
+	value = std::max<double>(std::numeric_limits<I>::min(), std::min<double>(std::numeric_limits<I>::max(), value));
+	return I(std::lround(value));
+}
+
+std::int16_t quantize_state(double value)
+{
+	return saturate<std::int16_t>(std::ldexp(value, FixedStateFracBits));
+}
+
+std::int8_t quantize_coeff(double value)
+{
+	return saturate<std::int8_t>(std::ldexp(value, FixedCoeffFracBits));
+}
+
+double dequantize_state(std::int16_t value)
+{
+	return std::ldexp(value, -FixedStateFracBits);
+}
+
+double dequantize_coeff(std::int8_t value)
+{
+	return std::ldexp(value, -FixedCoeffFracBits);
+}
+
+QuantizedTemplate quantize_template(const Template &tem)
+{
+	QuantizedTemplate qtem;
+
+	assert(effective_radius(tem.A) == 1 && effective_radius(tem.B) == 1 && "only 3x3 templates can be quantized");
+
+	const CouplingMat A = crop_coupling_mat(tem.A, 1);
+	const CouplingMat B = crop_coupling_mat(tem.B, 1);
+
+	for (int i = 0; i < 3; i++) {
+		for (int j = 0; j < 3; j++) {
+			qtem.A[3 * i + j] = quantize_coeff(A[i][j]);
+			qtem.B[3 * i + j] = quantize_coeff(B[i][j]);
+		}
+	}
+
+	qtem.Z = quantize_coeff(tem.Z);
+	qtem.boundary_condition = tem.boundary_condition;
+	qtem.virtual_cell = quantize_state(tem.virtual_cell);
+
+	return qtem;
+}
+
+// The zero pattern of a quantized matrix: coefficients may have been rounded to 0
+static StencilShape classify_quantized_stencil(const std::array<std::int8_t, 9> &M)
+{
+	double coeffs[9];
+	std::transform(M.begin(), M.end(), coeffs, dequantize_coeff);
+	return classify_stencil(coeffs);
+}
+
+
+FixedPointCNN::FixedPointCNN(
+	std::ptrdiff_t w,
+	std::ptrdiff_t h,
+	std::vector<std::int16_t> px,
+	std::vector<std::int16_t> u,
+	Template ptem,
+	double pt_max,
+	const CNNOptions &options
+):
+	width(w),
+	height(h),
+	dimension(width * height),
+	halo(1),
+	x(std::move(px)),
+	FF(dimension),
+	Y((width + 2 * halo) * (height + 2 * halo)),
+	tem(quantize_template(ptem)),
+	dt_shift(0),
+	ticks(0),
+	ticks_max(0),
+	t_max(pt_max),
+	statistics { 0 },
+	pool(new ThreadPool(dimension < options.parallel_threshold ? 1 : options.threads, options.first_cpu))
+{
+	// Rudimentary sanity checking
+	assert(x.size() == std::size_t(dimension) && "you lied about the size of the initial state");
+	assert(u.size() == std::size_t(dimension) && "you lied about the size of the input image");
+	assert(options.dt > 0 && "step size must be positive");
+
+	// Round the step size down to a power of two. The accumulator is Q.15,
+	// and the increment of the state is computed by shifting it right by
+	// (FixedCoeffFracBits + dt_shift) bits, which must fit in 32 bits.
+	dt_shift = std::max(0, int(std::ceil(-std::log2(options.dt))));
+	assert(dt_shift <= MaxStepShift && "step size is too small for the fixed-point simulator");
+	assert(t_max >= 0 && "duration must not be negative");
+
+	ticks_max = std::uint64_t(std::floor(std::ldexp(t_max, MaxStepShift)));
+
+	statistics.method = MethodEuler;
+	statistics.threads = pool->size();
+	statistics.kernel_isa = options.kernel_isa;
+	statistics.feedback_shape = classify_quantized_stencil(tem.A);
+	statistics.feedforward_shape = classify_quantized_stencil(tem.B);
+	statistics.feedback_radius = 1;
+	statistics.feedforward_radius = 1;
+	statistics.feedback_structure = CouplingGeneral;
+	statistics.feedforward_structure = CouplingGeneral;
+
+	std::copy(tem.A.begin(), tem.A.end(), feedback_coeffs);
+	kernels = get_fixed_point_kernels(options.kernel_isa);
+
+	// Precompute Feed-Forward Image plus bias, in the same format as the
+	// state. This is where an analog chip would store a constant current.
+	std::vector<std::int16_t> U(Y.size());
+
+	for (std::ptrdiff_t r = 0; r < height; r++) {
+		std::copy_n(&u[to_index(r, 0, width)], width, &U[to_padded_index(r, 0, width, halo)]);
+	}
+
+	fill_halo(&U[0], width, height, halo, tem.boundary_condition, tem.virtual_cell);
+
+	std::int16_t feedforward_coeffs[9];
+	std::copy(tem.B.begin(), tem.B.end(), feedforward_coeffs);
+
+	pool->parallel_for(height, [&](std::ptrdiff_t r_begin, std::ptrdiff_t r_end, std::ptrdiff_t) {
+		for (std::ptrdiff_t r = r_begin; r < r_end; r++) {
+			kernels.feedforward_row(
+				&FF[to_index(r, 0, width)],
+				&U[to_padded_index(r - 1, 0, width, halo)],
+				&U[to_padded_index(r, 0, width, halo)],
+				&U[to_padded_index(r + 1, 0, width, halo)],
+				feedforward_coeffs,
+				std::int32_t(tem.Z) * (1 << FixedStateFracBits),
+				FixedCoeffFracBits,
+				width
+			);
+		}
+	});
+}
+
+const std::vector<std::int16_t> &FixedPointCNN::state() const
+{
+	return x;
+}
+
+const CNNStats &FixedPointCNN::stats() const
+{
+	return statistics;
+}
+
+template<typename T>
+void FixedPointCNN::extract_output(BasicGrayscaleImage<T> *output)
+{
+	output->width = width;
+	output->height = height;
+	output->buf.resize(dimension);
+	std::transform(x.begin(), x.end(), output->buf.begin(), [](std::int16_t x_i) {
+		return T(dequantize_state(y(x_i)));
+	});
+}
+
+template void FixedPointCNN::extract_output(BasicGrayscaleImage<float> *output);
+template void FixedPointCNN::extract_output(BasicGrayscaleImage<double> *output);
+
+// One forward Euler step: x += 2^-step_shift * (-x + A * y(x) + FF), where
+// the step size is 2^-dt_shift, or less, if that would step beyond t_max
+bool FixedPointCNN::step(double *t)
+{
+	if (ticks >= ticks_max) {
+		*t = std::ldexp(double(ticks), -MaxStepShift);
+		return false;
+	}
+
+	int step_shift = dt_shift;
+
+	while (std::uint64_t(1) << (MaxStepShift - step_shift) > ticks_max - ticks) {
+		step_shift++;
+	}
+
+	const int shift = FixedCoeffFracBits + step_shift;
+	std::int16_t *RESTRICT Y = this->Y.data();
+
+	// Without feedback, the output image is not needed at all
+	if (statistics.feedback_shape != StencilZero) {
+		pool->parallel_for(height, [&](std::ptrdiff_t r_begin, std::ptrdiff_t r_end, std::ptrdiff_t) {
+			for (std::ptrdiff_t r = r_begin; r < r_end; r++) {
+				const std::int16_t *RESTRICT x_row = &x[to_index(r, 0, width)];
+				std::int16_t *RESTRICT Y_row = Y + to_padded_index(r, 0, width, halo);
+
+				for (std::ptrdiff_t c = 0; c < width; c++) {
+					Y_row[c] = y(x_row[c]);
+				}
+			}
+		});
+
+		fill_halo(Y, width, height, halo, tem.boundary_condition, y(tem.virtual_cell));
+
+		statistics.output_evaluations += dimension;
+	}
+
+	// The state can be updated in place, since the stencil only reads Y
+	pool->parallel_for(height, [&](std::ptrdiff_t r_begin, std::ptrdiff_t r_end, std::ptrdiff_t) {
+		for (std::ptrdiff_t r = r_begin; r < r_end; r++) {
+			kernels.euler_row(
+				&x[to_index(r, 0, width)],
+				&FF[to_index(r, 0, width)],
+				Y + to_padded_index(r - 1, 0, width, halo),
+				Y + to_padded_index(r, 0, width, halo),
+				Y + to_padded_index(r + 1, 0, width, halo),
+				feedback_coeffs,
+				1 << FixedCoeffFracBits,
+				shift,
+				width
+			);
+		}
+	});
+
+	statistics.rhs_evaluations++;
+	statistics.steps++;
+
+	ticks += std::uint64_t(1) << (MaxStepShift - step_shift);
+	*t = std::ldexp(double(ticks), -MaxStepShift);
+
+	return ticks < ticks_max;
+}
+
+void FixedPointCNN::run()
+{
+	double t = 0.0;
+	while (step(&t)) {
+		// no-op
+	}
+}
+
+void FixedPointCNN::run_with_handler(std::function<bool(double)> handler)
+{
+	bool keep_running = true;
+	double t = 0.0;
+
+	while (keep_running && step(&t)) {
+		keep_running = handler(t);
+	}
+}
@@ -0,0 +1,134 @@
+//
+// fixedpoint.hh
+// CNNSim, a simple CNN simulator
+//
+// Licensed under the 2-clause BSD License
+//
+
+#ifndef CNNSIM_FIXEDPOINT_HH
+#define CNNSIM_FIXEDPOINT_HH
+
+#include <cstddef>
+#include <cstdint>
+
+#include <array>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <functional>
+
+#include "template.hh"
+#include "imgproc.hh"
+#include "threadpool.hh"
+#include "kernels.hh"
+#include "CNN.hh"
+
+
+// Number formats of the fixed-point simulator, which models the precision
+// of analog/mixed-signal CNN chips rather than that of the ideal model:
+//
+// * The state, the input and the output are Q4.11 numbers in 16 bits,
+//   i.e. the range is [-16, +16) with a resolution of 1/2048.
+//   Arithmetic on the state saturates instead of wrapping around.
+// * Template coefficients (A, B and Z) are Q3.4 numbers in 8 bits,
+//   i.e. the range is [-8, +8) with a resolution of 1/16.
+//
+// Sums of products are accumulated in 32 bits, in Q.15 format.
+static const int FixedStateFracBits = 11;
+static const int FixedCoeffFracBits = 4;
+
+// Round to the nearest representable number, saturating
+std::int16_t quantize_state(double value);
+std::int8_t quantize_coeff(double value);
+
+double dequantize_state(std::int16_t value);
+double dequantize_coeff(std::int8_t value);
+
+struct QuantizedTemplate {
+	std::array<std::int8_t, 9> A; // row major
+	std::array<std::int8_t, 9> B; // row major
+	std::int8_t Z;
+	BoundaryCondition boundary_condition;
+	std::int16_t virtual_cell;
+};
+
+// Only 3x3 templates (or larger ones with zeros around the edges) can be quantized
+QuantizedTemplate quantize_template(const Template &tem);
+
+
+// A simulator with the same interface as BasicCNN, but using integer
+// arithmetic only. The state equation is integrated using the forward Euler
+// method, with a step size that is a power of two, so that multiplying
+// by it is just a shift, as it would be in hardware. If t_max is not a
+// multiple of it, the last few steps are shorter powers of two, down to
+// 2^-MaxStepShift, so that the simulation ends at t_max (rounded down to
+// a multiple of that). All images take
+// a quarter of the memory of those of the double precision simulator.
+struct FixedPointCNN {
+public:
+	typedef std::int16_t Scalar;
+
+	const std::ptrdiff_t width;
+	const std::ptrdiff_t height;
+	const std::ptrdiff_t dimension;
+
+private:
+	const std::ptrdiff_t halo;
+
+	std::vector<std::int16_t> x;
+	std::vector<std::int16_t> FF; // feed-forward image plus bias, precomputed
+	std::vector<std::int16_t> Y;  // halo-padded output image
+
+	QuantizedTemplate tem;
+
+	// Time is counted in units of the shortest step, 2^-MaxStepShift
+	static const int MaxStepShift = 16;
+
+	int dt_shift;            // the step size is 2^-dt_shift
+	std::uint64_t ticks;     // the current time
+	std::uint64_t ticks_max; // t_max, rounded down
+	double t_max;
+
+	std::int16_t feedback_coeffs[9]; // A template, in the format of the kernels
+	FixedPointKernels kernels;
+
+	CNNStats statistics;
+
+	std::unique_ptr<ThreadPool> pool;
+
+public:
+	FixedPointCNN(
+		std::ptrdiff_t w,
+		std::ptrdiff_t h,
+		std::vector<std::int16_t> px,
+		std::vector<std::int16_t> u,
+		Template ptem,
+		double pt_max,
+		const CNNOptions &options
+	);
+
+	FixedPointCNN(const FixedPointCNN &) = delete;
+	FixedPointCNN(FixedPointCNN &&) = delete;
+
+	FixedPointCNN &operator=(const FixedPointCNN &) = delete;
+	FixedPointCNN &operator=(FixedPointCNN &&) = delete;
+
+	bool step(double *t);
+	void run();
+	void run_with_handler(std::function<bool(double)> handler);
+
+	const std::vector<std::int16_t> &state() const;
+	const CNNStats &stats() const;
+
+	// Instantiated for T = float and T = double
+	template<typename T>
+	void extract_output(BasicGrayscaleImage<T> *output);
+
+	// Standard CNN nonlinearity function, in Q4.11
+	static inline std::int16_t y(std::int16_t x) {
+		const std::int16_t one = 1 << FixedStateFracBits;
+		return std::max<std::int16_t>(-one, std::min(one, x));
+	}
+};
+
+#endif // CNNSIM_FIXEDPOINT_HH
@@ -0,0 +1,137 @@
+//
+// halo.hh
+// CNNSim, a simple CNN simulator
+//
+// Licensed under the 2-clause BSD License
+//
+
+#ifndef CNNSIM_HALO_HH
+#define CNNSIM_HALO_HH
+
+#include <cstddef>
+#include <cassert>
+#include <algorithm>
+
+#include "util.hh"
+#include "template.hh"
+#include "imgproc.hh"
+
+
+// Images that are read through a stencil are stored with a ghost border
+// ("halo") of width 'halo' around them, so that neighborhoods of boundary
+// cells can be read without any bounds checking or special-casing.
+// This computes the flat index of the cell at (r, c) in such an image.
+static inline std::ptrdiff_t to_padded_index(
+	std::ptrdiff_t r,
+	std::ptrdiff_t c,
+	std::ptrdiff_t width,
+	std::ptrdiff_t halo
+)
+{
+	return to_index(r + halo, c + halo, width + 2 * halo);
+}
+
+// (Re-)fill the ghost border of a halo-padded image according to
+// the boundary condition. The interior must already be filled in.
+// 'virtual_cell' is the value of out-of-bounds cells in the case of a
+// constant boundary condition (this is not always Template::virtual_cell,
+// e.g. the output image needs y(virtual_cell) instead.)
+template<typename T>
+static inline void fill_halo(
+	T *RESTRICT img,
+	std::ptrdiff_t width,
+	std::ptrdiff_t height,
+	std::ptrdiff_t halo,
+	BoundaryCondition boundary_condition,
+	T virtual_cell
+)
+{
+	const std::ptrdiff_t stride = width + 2 * halo;
+
+	switch (boundary_condition) {
+	case Constant:
+		// Only the border itself: whole top and bottom rows, then the left
+		// and right columns of inner rows, without visiting the interior
+		for (std::ptrdiff_t k = 1; k <= halo; k++) {
+			std::fill_n(img + to_index(halo - k, 0, stride), stride, virtual_cell);
+			std::fill_n(img + to_index(halo + height - 1 + k, 0, stride), stride, virtual_cell);
+		}
+
+		for (std::ptrdiff_t r = 0; r < height; r++) {
+			T *row = img + to_padded_index(r, 0, width, halo);
+
+			for (std::ptrdiff_t k = 1; k <= halo; k++) {
+				row[-k] = virtual_cell;
+				row[width - 1 + k] = virtual_cell;
+			}
+		}
+		break;
+
+	case ZeroFlux:
+		// Left and right columns of inner rows first, then whole top and
+		// bottom rows, so that the corners are clamped in both directions.
+		for (std::ptrdiff_t r = 0; r < height; r++) {
+			T *row = img + to_padded_index(r, 0, width, halo);
+
+			for (std::ptrdiff_t k = 1; k <= halo; k++) {
+				row[-k] = row[0];
+				row[width - 1 + k] = row[width - 1];
+			}
+		}
+
+		for (std::ptrdiff_t k = 1; k <= halo; k++) {
+			std::copy_n(img + to_index(halo, 0, stride), stride, img + to_index(halo - k, 0, stride));
+			std::copy_n(img + to_index(halo + height - 1, 0, stride), stride, img + to_index(halo + height - 1 + k, 0, stride));
+		}
+		break;
+
+	case Periodic:
+		// Same order as above, so that the corners wrap around in both directions
+		for (std::ptrdiff_t r = 0; r < height; r++) {
+			T *row = img + to_padded_index(r, 0, width, halo);
+
+			for (std::ptrdiff_t k = 1; k <= halo; k++) {
+				row[-k] = row[width - k];
+				row[width - 1 + k] = row[k - 1];
+			}
+		}
+
+		for (std::ptrdiff_t k = 1; k <= halo; k++) {
+			std::copy_n(img + to_index(halo + height - k, 0, stride), stride, img + to_index(halo - k, 0, stride));
+			std::copy_n(img + to_index(halo + k - 1, 0, stride), stride, img + to_index(halo + height - 1 + k, 0, stride));
+		}
+		break;
+
+	default:
+		assert(0 && "unreachable: invalid boundary condition");
+	}
+}
+
+// Where an index 'i' along a dimension of size 'n' reads from, according to
+// the boundary condition: the same as fill_halo() does, but for a single
+// index, so that parts of an image can be padded without padding all of it.
+// Returns -1 for out-of-bounds indices with a constant boundary condition.
+static inline std::ptrdiff_t boundary_index(
+	std::ptrdiff_t i,
+	std::ptrdiff_t n,
+	BoundaryCondition boundary_condition
+)
+{
+	if (0 <= i && i < n) {
+		return i;
+	}
+
+	switch (boundary_condition) {
+	case Constant:
+		return -1;
+	case ZeroFlux:
+		return i < 0 ? 0 : n - 1;
+	case Periodic:
+		return (i % n + n) % n;
+	default:
+		assert(0 && "unreachable: invalid boundary condition");
+		return -1;
+	}
+}
+
+#endif // CNNSIM_HALO_HH
@@ -10,13 +10,21 @@
 
 #include <cmath>
 #include <cstdio>
+#include <cstdlib>
 #include <cstdint>
 #include <cstring>
+#include <cctype>
 #include <cassert>
 #include <algorithm>
 
 #include <png.h>
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include "imgproc.hh"
 
 
@@ -31,7 +39,8 @@ static png_image make_png_image()
 
 // Reading images into raw memory buffers
 
-static void complete_read(GrayscaleImage *buf, png_image *img)
+template<typename T>
+static void complete_read(BasicGrayscaleImage<T> *buf, png_image *img)
 {
 	if (PNG_IMAGE_FAILED(*img)) {
 		buf->clear();
@@ -62,40 +71,44 @@ static void complete_read(GrayscaleImage *buf, png_image *img)
 	std::transform(
 		u16_buf.begin(), u16_buf.end(),
 		buf->buf.begin(),
-		[](auto pixel) { return 1.0 - 2.0 * pixel / UINT16_MAX; }
+		[](auto pixel) { return T(1.0 - 2.0 * pixel / UINT16_MAX); }
 	);
 
 	png_image_free(img);
 }
 
-void GrayscaleImage::clear()
+template<typename T>
+void BasicGrayscaleImage<T>::clear()
 {
 	buf.clear();
 	width = 0;
 	height = 0;
 }
 
-GrayscaleImage load_png_file(const char *fname)
+template<typename T>
+BasicGrayscaleImage<T> load_png_file(const char *fname)
 {
-	GrayscaleImage buf;
+	BasicGrayscaleImage<T> buf;
 	png_image img = make_png_image();
 	png_image_begin_read_from_file(&img, fname);
 	complete_read(&buf, &img);
 	return buf;
 }
 
-GrayscaleImage load_png_handle(std::FILE *file)
+template<typename T>
+BasicGrayscaleImage<T> load_png_handle(std::FILE *file)
 {
-	GrayscaleImage buf;
+	BasicGrayscaleImage<T> buf;
 	png_image img = make_png_image();
 	png_image_begin_read_from_stdio(&img, file);
 	complete_read(&buf, &img);
 	return buf;
 }
 
-GrayscaleImage load_png_memory(const void *data, std::ptrdiff_t size)
+template<typename T>
+BasicGrayscaleImage<T> load_png_memory(const void *data, std::ptrdiff_t size)
 {
-	GrayscaleImage buf;
+	BasicGrayscaleImage<T> buf;
 	png_image img = make_png_image();
 	png_image_begin_read_from_memory(&img, data, size);
 	complete_read(&buf, &img);
@@ -105,8 +118,9 @@ GrayscaleImage load_png_memory(const void *data, std::ptrdiff_t size)
 
 // Writing files from raw memory buffers
 
+template<typename T>
 static void init_png_write_state(
-	const GrayscaleImage &buf,
+	const BasicGrayscaleImage<T> &buf,
 	png_image *img,
 	std::vector<std::uint16_t> *u16_buf
 )
@@ -125,7 +139,8 @@ static void init_png_write_state(
 	);
 }
 
-bool save_png_file(const char *fname, const GrayscaleImage &buf)
+template<typename T>
+bool save_png_file(const char *fname, const BasicGrayscaleImage<T> &buf)
 {
 	png_image img;
 	std::vector<std::uint16_t> u16_buf;
@@ -135,7 +150,8 @@ bool save_png_file(const char *fname, const GrayscaleImage &buf)
 	return status != 0;
 }
 
-bool save_png_handle(std::FILE *file, const GrayscaleImage &buf)
+template<typename T>
+bool save_png_handle(std::FILE *file, const BasicGrayscaleImage<T> &buf)
 {
 	png_image img;
 	std::vector<std::uint16_t> u16_buf;
@@ -144,3 +160,384 @@ bool save_png_handle(std::FILE *file, const GrayscaleImage &buf)
 	png_image_free(&img);
 	return status != 0;
 }
+
+
+// Largest images read from raw and Netpbm files, whose headers could
+// otherwise make the loaders allocate without bounds
+static const std::size_t MaxImageSide = 1 << 16;
+static const std::size_t MaxImageCells = std::size_t(1) << 28;
+
+static bool valid_image_size(std::size_t width, std::size_t height)
+{
+	return width > 0 && height > 0
+	    && width <= MaxImageSide && height <= MaxImageSide
+	    && width * height <= MaxImageCells;
+}
+
+// Whether the rest of the file, from the current position, is at least 'size' bytes
+static bool file_has_bytes(std::FILE *file, std::size_t size)
+{
+	struct stat st;
+	const long pos = std::ftell(file);
+
+	return pos >= 0 && ::fstat(fileno(file), &st) == 0 && st.st_size >= pos && std::size_t(st.st_size - pos) >= size;
+}
+
+
+// Raw images
+
+template<typename T>
+BasicGrayscaleImage<T> load_raw_file(const char *fname)
+{
+	BasicGrayscaleImage<T> buf { {}, 0, 0 };
+	struct stat st;
+	int fd = ::open(fname, O_RDONLY);
+
+	if (fd < 0) {
+		return buf;
+	}
+
+	if (::fstat(fd, &st) != 0 || std::size_t(st.st_size) < sizeof(RawImageHeader)) {
+		::close(fd);
+		return buf;
+	}
+
+	// The mapping outlives the descriptor
+	void *data = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+
+	if (data == MAP_FAILED) {
+		return buf;
+	}
+
+	::madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+	RawImageHeader header;
+	std::memcpy(&header, data, sizeof header);
+
+	const std::size_t cells = std::size_t(header.width) * header.height;
+	const char *pixels = static_cast<const char *>(data) + sizeof header;
+
+	// The size is checked before it's multiplied by that of the pixels
+	if (
+		std::memcmp(header.magic, "CNNr", 4) == 0
+		&& (header.scalar_size == sizeof(float) || header.scalar_size == sizeof(double))
+		&& valid_image_size(header.width, header.height)
+		&& std::size_t(st.st_size) - sizeof header == cells * header.scalar_size
+	) {
+		buf.width = header.width;
+		buf.height = header.height;
+
+		// A plain copy if the precision is the same
+		if (header.scalar_size == sizeof(float)) {
+			const float *src = reinterpret_cast<const float *>(pixels);
+			buf.buf.assign(src, src + cells);
+		} else {
+			const double *src = reinterpret_cast<const double *>(pixels);
+			buf.buf.assign(src, src + cells);
+		}
+	}
+
+	::munmap(data, st.st_size);
+	return buf;
+}
+
+template<typename T>
+bool save_raw_file(const char *fname, const BasicGrayscaleImage<T> &buf)
+{
+	RawImageHeader header;
+	std::FILE *file = std::fopen(fname, "wb");
+
+	if (file == nullptr) {
+		return false;
+	}
+
+	std::memcpy(header.magic, "CNNr", 4);
+	header.scalar_size = sizeof(T);
+	header.width = buf.width;
+	header.height = buf.height;
+
+	bool ok = std::fwrite(&header, sizeof header, 1, file) == 1
+	       && std::fwrite(buf.buf.data(), sizeof(T), buf.buf.size(), file) == buf.buf.size();
+
+	return std::fclose(file) == 0 && ok;
+}
+
+
+// Netpbm images
+
+// The next token of a Netpbm header, skipping whitespace and comments before
+// it. The whitespace character right after the token is consumed, too, so
+// after the last token of the header, the file is at the first pixel.
+static bool read_netpbm_token(std::FILE *file, char *token, std::size_t size)
+{
+	std::size_t n = 0;
+	int c = std::getc(file);
+
+	while (c == '#' || std::isspace(c)) {
+		if (c == '#') {
+			while (c != EOF && c != '\n') {
+				c = std::getc(file);
+			}
+		}
+
+		c = std::getc(file);
+	}
+
+	while (c != EOF && !std::isspace(c) && n + 1 < size) {
+		token[n++] = c;
+		c = std::getc(file);
+	}
+
+	token[n] = '\0';
+	return n > 0 && std::isspace(c);
+}
+
+// The magic number, the size and the last field ("maxval" or "scale")
+static bool read_netpbm_header(std::FILE *file, const char *magic, std::ptrdiff_t *width, std::ptrdiff_t *height, double *last)
+{
+	char tokens[4][32];
+
+	for (auto &token : tokens) {
+		if (!read_netpbm_token(file, token, sizeof token)) {
+			return false;
+		}
+	}
+
+	*width = std::strtol(tokens[1], nullptr, 10);
+	*height = std::strtol(tokens[2], nullptr, 10);
+	*last = std::strtod(tokens[3], nullptr);
+
+	return std::strcmp(tokens[0], magic) == 0 && *width > 0 && *height > 0 && valid_image_size(*width, *height);
+}
+
+static bool little_endian_host()
+{
+	const std::uint16_t probe = 1;
+	return *reinterpret_cast<const unsigned char *>(&probe) == 1;
+}
+
+template<typename T>
+BasicGrayscaleImage<T> load_pgm_file(const char *fname)
+{
+	BasicGrayscaleImage<T> buf { {}, 0, 0 };
+	std::FILE *file = std::fopen(fname, "rb");
+	std::ptrdiff_t width, height;
+	double maxval;
+
+	if (file == nullptr) {
+		return buf;
+	}
+
+	// 16-bit pixels are big-endian
+	if (
+		read_netpbm_header(file, "P5", &width, &height, &maxval)
+		&& maxval >= 1 && maxval <= UINT16_MAX
+		&& file_has_bytes(file, width * height * (maxval < 256 ? 1 : 2))
+	) {
+		const std::size_t bytes = maxval < 256 ? 1 : 2;
+		std::vector<unsigned char> raster(width * height * bytes);
+
+		if (std::fread(raster.data(), 1, raster.size(), file) == raster.size()) {
+			buf.width = width;
+			buf.height = height;
+			buf.buf.resize(width * height);
+
+			for (std::size_t i = 0; i < buf.buf.size(); i++) {
+				const unsigned pixel = bytes == 1 ? raster[i] : raster[2 * i] << 8 | raster[2 * i + 1];
+				buf.buf[i] = T(1.0 - 2.0 * pixel / maxval);
+			}
+		}
+	}
+
+	std::fclose(file);
+	return buf;
+}
+
+template<typename T>
+bool save_pgm_file(const char *fname, const BasicGrayscaleImage<T> &buf)
+{
+	std::FILE *file = std::fopen(fname, "wb");
+	std::vector<unsigned char> raster(2 * buf.buf.size());
+
+	if (file == nullptr) {
+		return false;
+	}
+
+	// The same 16 bits as those of PNG files
+	for (std::size_t i = 0; i < buf.buf.size(); i++) {
+		const double level = std::max(0.0, std::min(1.0, (1.0 - buf.buf[i]) / 2.0));
+		const std::uint16_t pixel = level * UINT16_MAX;
+		raster[2 * i] = pixel >> 8;
+		raster[2 * i + 1] = pixel & 0xff;
+	}
+
+	bool ok = std::fprintf(file, "P5\n%td %td\n%d\n", buf.width, buf.height, UINT16_MAX) > 0
+	       && std::fwrite(raster.data(), 1, raster.size(), file) == raster.size();
+
+	return std::fclose(file) == 0 && ok;
+}
+
+template<typename T>
+BasicGrayscaleImage<T> load_pfm_file(const char *fname)
+{
+	BasicGrayscaleImage<T> buf { {}, 0, 0 };
+	std::FILE *file = std::fopen(fname, "rb");
+	std::ptrdiff_t width, height;
+	double scale;
+
+	if (file == nullptr) {
+		return buf;
+	}
+
+	// A negative scale means little-endian pixels
+	if (read_netpbm_header(file, "Pf", &width, &height, &scale) && scale != 0 && file_has_bytes(file, width * height * sizeof(float))) {
+		std::vector<float> raster(width * height);
+
+		if (std::fread(raster.data(), sizeof raster[0], raster.size(), file) == raster.size()) {
+			const bool swap = (scale < 0) != little_endian_host();
+
+			buf.width = width;
+			buf.height = height;
+			buf.buf.resize(width * height);
+
+			// Rows are stored from the bottom up
+			for (std::ptrdiff_t r = 0; r < height; r++) {
+				const float *src = &raster[to_index(height - 1 - r, 0, width)];
+				T *dst = &buf.buf[to_index(r, 0, width)];
+
+				for (std::ptrdiff_t c = 0; c < width; c++) {
+					float level = src[c];
+
+					if (swap) {
+						unsigned char *bytes = reinterpret_cast<unsigned char *>(&level);
+						std::reverse(bytes, bytes + sizeof level);
+					}
+
+					dst[c] = T(1.0 - 2.0 * level);
+				}
+			}
+		}
+	}
+
+	std::fclose(file);
+	return buf;
+}
+
+template<typename T>
+bool save_pfm_file(const char *fname, const BasicGrayscaleImage<T> &buf)
+{
+	std::FILE *file = std::fopen(fname, "wb");
+	std::vector<float> raster(buf.buf.size());
+
+	if (file == nullptr) {
+		return false;
+	}
+
+	for (std::ptrdiff_t r = 0; r < buf.height; r++) {
+		const T *src = &buf.buf[to_index(r, 0, buf.width)];
+		float *dst = &raster[to_index(buf.height - 1 - r, 0, buf.width)];
+
+		for (std::ptrdiff_t c = 0; c < buf.width; c++) {
+			dst[c] = float((1.0 - src[c]) / 2.0);
+		}
+	}
+
+	bool ok = std::fprintf(file, "Pf\n%td %td\n%s\n", buf.width, buf.height, little_endian_host() ? "-1.0" : "1.0") > 0
+	       && std::fwrite(raster.data(), sizeof raster[0], raster.size(), file) == raster.size();
+
+	return std::fclose(file) == 0 && ok;
+}
+
+
+// Any of them, by the extension of the file name
+
+enum ImageFormat {
+	FormatPNG,
+	FormatRaw,
+	FormatPGM,
+	FormatPFM,
+};
+
+static ImageFormat image_format(const char *fname)
+{
+	const char *slash = std::strrchr(fname, '/');
+	const char *dot = std::strrchr(slash ? slash : fname, '.');
+
+	if (dot == nullptr) {
+		return FormatPNG;
+	} else if (strcasecmp(dot, ".raw") == 0) {
+		return FormatRaw;
+	} else if (strcasecmp(dot, ".pgm") == 0) {
+		return FormatPGM;
+	} else if (strcasecmp(dot, ".pfm") == 0) {
+		return FormatPFM;
+	} else {
+		return FormatPNG;
+	}
+}
+
+template<typename T>
+BasicGrayscaleImage<T> load_image_file(const char *fname)
+{
+	switch (image_format(fname)) {
+	case FormatRaw:
+		return load_raw_file<T>(fname);
+	case FormatPGM:
+		return load_pgm_file<T>(fname);
+	case FormatPFM:
+		return load_pfm_file<T>(fname);
+	default:
+		return load_png_file<T>(fname);
+	}
+}
+
+template<typename T>
+bool save_image_file(const char *fname, const BasicGrayscaleImage<T> &buf)
+{
+	switch (image_format(fname)) {
+	case FormatRaw:
+		return save_raw_file(fname, buf);
+	case FormatPGM:
+		return save_pgm_file(fname, buf);
+	case FormatPFM:
+		return save_pfm_file(fname, buf);
+	default:
+		return save_png_file(fname, buf);
+	}
+}
+
+
+// Explicit instantiations for single and double precision
+template struct BasicGrayscaleImage<float>;
+template struct BasicGrayscaleImage<double>;
+
+template BasicGrayscaleImage<float> load_png_file<float>(const char *fname);
+template BasicGrayscaleImage<double> load_png_file<double>(const char *fname);
+template BasicGrayscaleImage<float> load_png_handle<float>(std::FILE *file);
+template BasicGrayscaleImage<double> load_png_handle<double>(std::FILE *file);
+template BasicGrayscaleImage<float> load_png_memory<float>(const void *data, std::ptrdiff_t size);
+template BasicGrayscaleImage<double> load_png_memory<double>(const void *data, std::ptrdiff_t size);
+
+template bool save_png_file<float>(const char *fname, const BasicGrayscaleImage<float> &buf);
+template bool save_png_file<double>(const char *fname, const BasicGrayscaleImage<double> &buf);
+template bool save_png_handle<float>(std::FILE *file, const BasicGrayscaleImage<float> &buf);
+template bool save_png_handle<double>(std::FILE *file, const BasicGrayscaleImage<double> &buf);
+
+template BasicGrayscaleImage<float> load_raw_file<float>(const char *fname);
+template BasicGrayscaleImage<double> load_raw_file<double>(const char *fname);
+template BasicGrayscaleImage<float> load_pgm_file<float>(const char *fname);
+template BasicGrayscaleImage<double> load_pgm_file<double>(const char *fname);
+template BasicGrayscaleImage<float> load_pfm_file<float>(const char *fname);
+template BasicGrayscaleImage<double> load_pfm_file<double>(const char *fname);
+template BasicGrayscaleImage<float> load_image_file<float>(const char *fname);
+template BasicGrayscaleImage<double> load_image_file<double>(const char *fname);
+
+template bool save_raw_file<float>(const char *fname, const BasicGrayscaleImage<float> &buf);
+template bool save_raw_file<double>(const char *fname, const BasicGrayscaleImage<double> &buf);
+template bool save_pgm_file<float>(const char *fname, const BasicGrayscaleImage<float> &buf);
+template bool save_pgm_file<double>(const char *fname, const BasicGrayscaleImage<double> &buf);
+template bool save_pfm_file<float>(const char *fname, const BasicGrayscaleImage<float> &buf);
+template bool save_pfm_file<double>(const char *fname, const BasicGrayscaleImage<double> &buf);
+template bool save_image_file<float>(const char *fname, const BasicGrayscaleImage<float> &buf);
+template bool save_image_file<double>(const char *fname, const BasicGrayscaleImage<double> &buf);
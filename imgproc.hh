@@ -10,27 +10,89 @@
 #ifndef CNNSIM_IMGPROC_HH
 #define CNNSIM_IMGPROC_HH
 
+#include <cstdio>
 #include <cstddef>
+#include <cstdint>
 #include <vector>
 
 
-struct GrayscaleImage {
-	std::vector<double> buf;
+// Pixel values are in [-1, +1] (white...black), in single or double precision.
+// The functions below are instantiated for T = float and T = double.
+template<typename T>
+struct BasicGrayscaleImage {
+	std::vector<T> buf;
 	std::ptrdiff_t width;
 	std::ptrdiff_t height;
 
 	void clear();
 };
 
+typedef BasicGrayscaleImage<double> GrayscaleImage;
+
 
 // Reading
-GrayscaleImage load_png_file(const char *fname);
-GrayscaleImage load_png_handle(std::FILE *file);
-GrayscaleImage load_png_memory(const void *data, std::ptrdiff_t size);
+template<typename T = double>
+BasicGrayscaleImage<T> load_png_file(const char *fname);
+
+template<typename T = double>
+BasicGrayscaleImage<T> load_png_handle(std::FILE *file);
+
+template<typename T = double>
+BasicGrayscaleImage<T> load_png_memory(const void *data, std::ptrdiff_t size);
 
 // Writing
-bool save_png_file(const char *fname, const GrayscaleImage &buf);
-bool save_png_handle(std::FILE *file, const GrayscaleImage &buf);
+template<typename T>
+bool save_png_file(const char *fname, const BasicGrayscaleImage<T> &buf);
+
+template<typename T>
+bool save_png_handle(std::FILE *file, const BasicGrayscaleImage<T> &buf);
+
+// Raw images: a 16-byte header, then the pixels as they are in memory, row by
+// row, either as 'float's or as 'double's, in the byte order of the machine.
+// They are read by mapping the file into memory and copying the pixels into
+// the buffer of the image in one go, converted only if the precision of the
+// file is not that of the image. They are written in the precision of the
+// image, so writing and reading them again gives the same image, bit for bit.
+struct RawImageHeader {
+	char magic[4];             // "CNNr"
+	std::uint32_t scalar_size; // 4 for 'float', 8 for 'double'
+	std::uint32_t width;
+	std::uint32_t height;
+};
+
+template<typename T = double>
+BasicGrayscaleImage<T> load_raw_file(const char *fname);
+
+template<typename T>
+bool save_raw_file(const char *fname, const BasicGrayscaleImage<T> &buf);
+
+// Netpbm images: binary PGM files ("P5") with 8 or 16 bits per pixel, and
+// grayscale PFM files ("Pf") of 'float's, which are written in the byte
+// order of the machine, and read in either. Like with PNG files, 0 is black
+// and the maximal value (1.0 for PFM) is white. PGM files are written with
+// 16 bits per pixel.
+template<typename T = double>
+BasicGrayscaleImage<T> load_pgm_file(const char *fname);
+
+template<typename T>
+bool save_pgm_file(const char *fname, const BasicGrayscaleImage<T> &buf);
+
+template<typename T = double>
+BasicGrayscaleImage<T> load_pfm_file(const char *fname);
+
+template<typename T>
+bool save_pfm_file(const char *fname, const BasicGrayscaleImage<T> &buf);
+
+// Any of the above, by the extension of the file name: ".raw" for raw
+// images, ".pgm", ".pfm", and PNG for everything else. Reading fails with
+// an empty image, like load_png_file() does; so does reading a raw or Netpbm
+// file with a side over 65536 pixels, over 2^28 pixels in all, or with fewer
+// pixels than its header says.
+template<typename T = double>
+BasicGrayscaleImage<T> load_image_file(const char *fname);
+
+template<typename T>
+bool save_image_file(const char *fname, const BasicGrayscaleImage<T> &buf);
 
 // Compute a flat index from row major format
 static inline std::ptrdiff_t to_index(std::ptrdiff_t i, std::ptrdiff_t j, std::ptrdiff_t width)
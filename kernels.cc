@@ -0,0 +1,174 @@
+//
+// kernels.cc
+// CNNSim, a simple CNN simulator
+//
+// Licensed under the 2-clause BSD License
+//
+
+#include <cstring>
+#include <cassert>
+
+#include "kernels.hh"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CNNSIM_X86 1
+#else
+#define CNNSIM_X86 0
+#endif
+
+
+// Defined in kernels_<isa>.cc
+extern const StencilKernelSet scalar_stencil_kernels;
+
+#if CNNSIM_X86
+extern const StencilKernelSet sse2_stencil_kernels;
+extern const StencilKernelSet avx2_stencil_kernels;
+extern const StencilKernelSet avx512_stencil_kernels;
+#endif
+
+static const char *const stencil_shape_names[NumStencilShapes] = {
+	"zero",
+	"centre",
+	"row",
+	"column",
+	"cross",
+	"full",
+};
+
+static const char *const kernel_isa_names[NumKernelISAs] = {
+	"scalar",
+	"sse2",
+	"avx2",
+	"avx512",
+};
+
+
+bool kernel_isa_supported(KernelISA isa)
+{
+#if CNNSIM_X86
+	__builtin_cpu_init();
+#endif
+
+	switch (isa) {
+	case KernelScalar:
+		return true;
+
+#if CNNSIM_X86
+	case KernelSSE2:
+		return __builtin_cpu_supports("sse2");
+
+	case KernelAVX2:
+		return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+
+	case KernelAVX512:
+		return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+#endif
+
+	default:
+		return false;
+	}
+}
+
+KernelISA detect_kernel_isa()
+{
+	for (int isa = NumKernelISAs - 1; isa > KernelScalar; isa--) {
+		if (kernel_isa_supported(KernelISA(isa))) {
+			return KernelISA(isa);
+		}
+	}
+
+	return KernelScalar;
+}
+
+KernelISA kernel_isa_from_name(const char *name)
+{
+	for (int isa = 0; isa < NumKernelISAs; isa++) {
+		if (std::strcmp(name, kernel_isa_names[isa]) == 0) {
+			return KernelISA(isa);
+		}
+	}
+
+	return NumKernelISAs;
+}
+
+const char *kernel_isa_name(KernelISA isa)
+{
+	assert(0 <= isa && isa < NumKernelISAs && "invalid kernel ISA");
+	return kernel_isa_names[isa];
+}
+
+static const StencilKernelSet &get_stencil_kernel_set(KernelISA isa)
+{
+	switch (isa) {
+#if CNNSIM_X86
+	case KernelSSE2:
+		return sse2_stencil_kernels;
+
+	case KernelAVX2:
+		return avx2_stencil_kernels;
+
+	case KernelAVX512:
+		return avx512_stencil_kernels;
+#endif
+
+	default:
+		return scalar_stencil_kernels;
+	}
+}
+
+template<typename T>
+static const StencilKernels<T> &select_precision(const StencilKernelSet &set);
+
+template<>
+const StencilKernels<float> &select_precision<float>(const StencilKernelSet &set)
+{
+	return set.single_precision;
+}
+
+template<>
+const StencilKernels<double> &select_precision<double>(const StencilKernelSet &set)
+{
+	return set.double_precision;
+}
+
+template<typename T>
+const StencilKernels<T> &get_stencil_kernels(KernelISA isa)
+{
+	assert(kernel_isa_supported(isa) && "kernel not supported by this CPU");
+	return select_precision<T>(get_stencil_kernel_set(isa));
+}
+
+template const StencilKernels<float> &get_stencil_kernels<float>(KernelISA isa);
+template const StencilKernels<double> &get_stencil_kernels<double>(KernelISA isa);
+
+const FixedPointKernels &get_fixed_point_kernels(KernelISA isa)
+{
+	assert(kernel_isa_supported(isa) && "kernel not supported by this CPU");
+	return get_stencil_kernel_set(isa).fixed_point;
+}
+
+StencilShape classify_stencil(const double *M)
+{
+	unsigned nonzero = 0;
+
+	for (int k = 0; k < 9; k++) {
+		if (M[k] != 0) {
+			nonzero |= 1u << k;
+		}
+	}
+
+	// Shapes are listed from the most to the least specific one
+	for (int shape = 0; shape < NumStencilShapes; shape++) {
+		if ((nonzero & ~stencil_shape_mask(StencilShape(shape))) == 0) {
+			return StencilShape(shape);
+		}
+	}
+
+	return StencilFull;
+}
+
+const char *stencil_shape_name(StencilShape shape)
+{
+	assert(0 <= shape && shape < NumStencilShapes && "invalid stencil shape");
+	return stencil_shape_names[shape];
+}
@@ -0,0 +1,193 @@
+//
+// kernels.hh
+// CNNSim, a simple CNN simulator
+//
+// Licensed under the 2-clause BSD License
+//
+
+#ifndef CNNSIM_KERNELS_HH
+#define CNNSIM_KERNELS_HH
+
+#include <cstddef>
+#include <cstdint>
+
+#include "util.hh"
+#include "template.hh"
+
+
+// Instruction sets for which explicitly vectorized kernels exist.
+// Each of them lives in its own translation unit (kernels_<isa>.cc),
+// compiled with the corresponding code generation flags, and the
+// best one supported by the CPU is selected at runtime.
+enum KernelISA {
+	KernelScalar,
+	KernelSSE2,
+	KernelAVX2,   // AVX2 + FMA
+	KernelAVX512, // AVX-512F + BW
+	NumKernelISAs
+};
+
+// Zero patterns of a 3x3 coupling matrix. There is a separate kernel for
+// each of them, with the zero coefficients eliminated at compile time.
+// They are listed from the most to the least specific one.
+enum StencilShape {
+	StencilZero,   // all coefficients are zero
+	StencilCentre, // only the centre coefficient is nonzero
+	StencilRow,    // only the middle row (1x3) is nonzero
+	StencilColumn, // only the middle column (3x1) is nonzero
+	StencilCross,  // only the centre and its 4 direct neighbors are nonzero
+	StencilFull,   // anything else
+	NumStencilShapes
+};
+
+// Bit k of the mask is set if coefficient k (row-major) may be nonzero
+static inline constexpr unsigned stencil_shape_mask(StencilShape shape)
+{
+	return shape == StencilZero   ? 0x000 :
+	       shape == StencilCentre ? 0x010 :
+	       shape == StencilRow    ? 0x038 :
+	       shape == StencilColumn ? 0x092 :
+	       shape == StencilCross  ? 0x0BA :
+	                                0x1FF;
+}
+
+// Accumulate a 3x3 stencil over a row of 'n' cells:
+//
+//     out[c] += sum(M[i][j] * rows[i][c + j - 1]) for i, j in 0...2
+//
+// 'rows' point to the first (non-halo) cell of three consecutive rows
+// of a halo-padded image, so rows[i][-1] and rows[i][n] must be valid.
+// 'M' is the row-major, flattened 3x3 coupling matrix.
+// There are kernels for single and double precision ('T').
+template<typename T>
+using StencilRowFn = void (*)(
+	T *RESTRICT out,
+	const T *RESTRICT above,
+	const T *RESTRICT centre,
+	const T *RESTRICT below,
+	const T *RESTRICT M,
+	std::ptrdiff_t n
+);
+
+// Accumulate a (2R + 1) x (2R + 1) stencil over a row of 'n' cells:
+//
+//     out[c] += sum(M[i][j] * rows[i][c + j - R]) for i, j in 0...2R
+//
+// 'rows' points to 2R + 1 consecutive rows of an image with a halo
+// of at least R, and 'M' is the row-major, flattened matrix.
+template<typename T>
+using WideStencilRowFn = void (*)(
+	T *RESTRICT out,
+	const T *const *rows,
+	const T *RESTRICT M,
+	std::ptrdiff_t n
+);
+
+// Accumulate a (2R + 1) x (2R + 1) stencil over a row of 'n' cells of a
+// batch of images, interleaved so that the values of the same cell of all
+// images are 'lanes' consecutive elements, one image per SIMD lane:
+//
+//     out[c * lanes + b] += sum(M[i][j] * rows[i][(c + j - R) * lanes + b])
+//
+// 'rows' points to 2R + 1 consecutive rows, just like above. Zero
+// coefficients are skipped, but only at runtime, for any radius R.
+template<typename T>
+using BatchStencilRowFn = void (*)(
+	T *RESTRICT out,
+	const T *const *rows,
+	const T *RESTRICT M,
+	std::ptrdiff_t radius,
+	std::ptrdiff_t lanes,
+	std::ptrdiff_t n
+);
+
+template<typename T>
+struct StencilKernels {
+	KernelISA isa;
+
+	// General kernels, one per shape
+	StencilRowFn<T> stencil_row[NumStencilShapes];
+
+	// Kernels for point-symmetric matrices (M[k] == M[8 - k]), which add up
+	// each pair of mirrored neighbors before multiplying by their coefficient.
+	StencilRowFn<T> symmetric_stencil_row[NumStencilShapes];
+
+	// Kernels for larger neighborhoods, indexed by the radius R.
+	// Radius 1 is handled by the kernels above, so only R > 1 is valid.
+	WideStencilRowFn<T> wide_stencil_row[MaxTemplateRadius + 1];
+
+	// Any radius, interleaved batches of images
+	BatchStencilRowFn<T> batch_stencil_row;
+};
+
+// One forward Euler step of the fixed-point simulator, for one row:
+//
+//     acc = (FF[c] - x[c]) * one + sum(A[i][j] * rows[i][c + j - 1])
+//     x[c] = saturate(x[c] + round(acc / 2^shift))
+//
+// State, feed-forward and output rows are 16-bit fixed-point numbers,
+// and so are the coefficients 'A', in which 'one' is 1.0; they must fit
+// in 8 bits. The rows are halo-padded, just like above.
+typedef void (*FixedEulerRowFn)(
+	std::int16_t *RESTRICT x,
+	const std::int16_t *RESTRICT FF,
+	const std::int16_t *RESTRICT above,
+	const std::int16_t *RESTRICT centre,
+	const std::int16_t *RESTRICT below,
+	const std::int16_t *RESTRICT A,
+	std::int16_t one,
+	int shift,
+	std::ptrdiff_t n
+);
+
+// The feed-forward image plus bias of the fixed-point simulator, for one row:
+//
+//     FF[c] = saturate(round((bias + sum(B[i][j] * rows[i][c + j - 1])) / 2^shift))
+//
+// with the same formats and halo-padded input rows as above.
+typedef void (*FixedFeedforwardRowFn)(
+	std::int16_t *RESTRICT FF,
+	const std::int16_t *RESTRICT above,
+	const std::int16_t *RESTRICT centre,
+	const std::int16_t *RESTRICT below,
+	const std::int16_t *RESTRICT B,
+	std::int32_t bias,
+	int shift,
+	std::ptrdiff_t n
+);
+
+struct FixedPointKernels {
+	FixedEulerRowFn euler_row;
+	FixedFeedforwardRowFn feedforward_row;
+};
+
+// All kernels of one instruction set
+struct StencilKernelSet {
+	StencilKernels<float> single_precision;
+	StencilKernels<double> double_precision;
+	FixedPointKernels fixed_point;
+};
+
+// Does the CPU we are running on support the given kernel?
+bool kernel_isa_supported(KernelISA isa);
+
+// The fastest kernel supported by the CPU
+KernelISA detect_kernel_isa();
+
+// Returns NumKernelISAs if the name is not recognized
+KernelISA kernel_isa_from_name(const char *name);
+const char *kernel_isa_name(KernelISA isa);
+
+// Must only be called with a supported instruction set.
+// Instantiated for T = float and T = double.
+template<typename T>
+const StencilKernels<T> &get_stencil_kernels(KernelISA isa);
+
+// Ditto
+const FixedPointKernels &get_fixed_point_kernels(KernelISA isa);
+
+// The most specific shape that fits the flattened 3x3 matrix 'M'
+StencilShape classify_stencil(const double *M);
+const char *stencil_shape_name(StencilShape shape);
+
+#endif // CNNSIM_KERNELS_HH
@@ -0,0 +1,74 @@
+//
+// kernels_avx2.cc
+// CNNSim, a simple CNN simulator
+//
+// Licensed under the 2-clause BSD License
+//
+
+// Compiled with -mavx2 -mfma: only ever call into this
+// file after checking kernel_isa_supported(KernelAVX2).
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+
+#include "kernels_impl.hh"
+
+
+namespace {
+
+template<typename T>
+struct AVX2Vec;
+
+template<>
+struct AVX2Vec<double> {
+	typedef double scalar;
+	typedef __m256d type;
+	typedef FusedScalarVec<double> remainder;
+	static const std::ptrdiff_t width = 4;
+
+	static type load(const double *p) { return _mm256_loadu_pd(p); }
+	static void store(double *p, type v) { _mm256_storeu_pd(p, v); }
+	static type broadcast(double x) { return _mm256_set1_pd(x); }
+	static type add(type a, type b) { return _mm256_add_pd(a, b); }
+	static type fmadd(type a, type b, type c) { return _mm256_fmadd_pd(a, b, c); }
+};
+
+template<>
+struct AVX2Vec<float> {
+	typedef float scalar;
+	typedef __m256 type;
+	typedef FusedScalarVec<float> remainder;
+	static const std::ptrdiff_t width = 8;
+
+	static type load(const float *p) { return _mm256_loadu_ps(p); }
+	static void store(float *p, type v) { _mm256_storeu_ps(p, v); }
+	static type broadcast(float x) { return _mm256_set1_ps(x); }
+	static type add(type a, type b) { return _mm256_add_ps(a, b); }
+	static type fmadd(type a, type b, type c) { return _mm256_fmadd_ps(a, b, c); }
+};
+
+// Unpacking and packing both work within 128-bit lanes, in the same order
+struct AVX2FixedVec {
+	typedef __m256i type;
+	static const std::ptrdiff_t width = 16;
+
+	static type load(const std::int16_t *p) { return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p)); }
+	static void store(std::int16_t *p, type v) { _mm256_storeu_si256(reinterpret_cast<__m256i *>(p), v); }
+	static type broadcast32(std::int32_t x) { return _mm256_set1_epi32(x); }
+	static type broadcast_pair(std::int16_t a, std::int16_t b) { return _mm256_set1_epi32(pack_pair(a, b)); }
+	static type interleave_low(type a, type b) { return _mm256_unpacklo_epi16(a, b); }
+	static type interleave_high(type a, type b) { return _mm256_unpackhi_epi16(a, b); }
+	static type madd(type a, type b) { return _mm256_madd_epi16(a, b); }
+	static type add32(type a, type b) { return _mm256_add_epi32(a, b); }
+	static type shift_right32(type a, int n) { return _mm256_sra_epi32(a, _mm_cvtsi32_si128(n)); }
+	static type widen_low(type a) { return _mm256_srai_epi32(_mm256_unpacklo_epi16(a, a), 16); }
+	static type widen_high(type a) { return _mm256_srai_epi32(_mm256_unpackhi_epi16(a, a), 16); }
+	static type pack_saturate(type lo, type hi) { return _mm256_packs_epi32(lo, hi); }
+};
+
+} // anonymous namespace
+
+extern const StencilKernelSet avx2_stencil_kernels = make_stencil_kernel_set<AVX2Vec, AVX2FixedVec>(KernelAVX2);
+
+#endif // x86
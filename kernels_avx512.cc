@@ -0,0 +1,78 @@
+//
+// kernels_avx512.cc
+// CNNSim, a simple CNN simulator
+//
+// Licensed under the 2-clause BSD License
+//
+
+// Compiled with -mavx512f -mavx512bw: only ever call into this
+// file after checking kernel_isa_supported(KernelAVX512).
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+
+#include "kernels_impl.hh"
+
+
+namespace {
+
+template<typename T>
+struct AVX512Vec;
+
+template<>
+struct AVX512Vec<double> {
+	typedef double scalar;
+	typedef __m512d type;
+	typedef FusedScalarVec<double> remainder;
+	static const std::ptrdiff_t width = 8;
+
+	static type load(const double *p) { return _mm512_loadu_pd(p); }
+	static void store(double *p, type v) { _mm512_storeu_pd(p, v); }
+	static type broadcast(double x) { return _mm512_set1_pd(x); }
+	static type add(type a, type b) { return _mm512_add_pd(a, b); }
+	static type fmadd(type a, type b, type c) { return _mm512_fmadd_pd(a, b, c); }
+};
+
+template<>
+struct AVX512Vec<float> {
+	typedef float scalar;
+	typedef __m512 type;
+	typedef FusedScalarVec<float> remainder;
+	static const std::ptrdiff_t width = 16;
+
+	static type load(const float *p) { return _mm512_loadu_ps(p); }
+	static void store(float *p, type v) { _mm512_storeu_ps(p, v); }
+	static type broadcast(float x) { return _mm512_set1_ps(x); }
+	static type add(type a, type b) { return _mm512_add_ps(a, b); }
+	static type fmadd(type a, type b, type c) { return _mm512_fmadd_ps(a, b, c); }
+};
+
+// Unpacking and packing both work within 128-bit lanes, in the same order.
+// 16-bit lanes need AVX512BW. Shifts are merge-masked with all lanes set,
+// since the unmasked ones trip -Wmaybe-uninitialized in some GCC versions.
+struct AVX512FixedVec {
+	typedef __m512i type;
+	static const std::ptrdiff_t width = 32;
+
+	static type load(const std::int16_t *p) { return _mm512_loadu_si512(p); }
+	static void store(std::int16_t *p, type v) { _mm512_storeu_si512(p, v); }
+	static type broadcast32(std::int32_t x) { return _mm512_set1_epi32(x); }
+	static type broadcast_pair(std::int16_t a, std::int16_t b) { return _mm512_set1_epi32(pack_pair(a, b)); }
+	static type interleave_low(type a, type b) { return _mm512_unpacklo_epi16(a, b); }
+	static type interleave_high(type a, type b) { return _mm512_unpackhi_epi16(a, b); }
+	static type madd(type a, type b) { return _mm512_madd_epi16(a, b); }
+	static type add32(type a, type b) { return _mm512_add_epi32(a, b); }
+	static type shift_right32(type a, int n) { return _mm512_mask_sra_epi32(a, ~__mmask16(0), a, _mm_cvtsi32_si128(n)); }
+	static type widen_low(type a) { return shift_right16(_mm512_unpacklo_epi16(a, a)); }
+	static type widen_high(type a) { return shift_right16(_mm512_unpackhi_epi16(a, a)); }
+	static type pack_saturate(type lo, type hi) { return _mm512_packs_epi32(lo, hi); }
+
+	static type shift_right16(type a) { return _mm512_mask_srai_epi32(a, ~__mmask16(0), a, 16); }
+};
+
+} // anonymous namespace
+
+extern const StencilKernelSet avx512_stencil_kernels = make_stencil_kernel_set<AVX512Vec, AVX512FixedVec>(KernelAVX512);
+
+#endif // x86
@@ -0,0 +1,495 @@
+//
+// kernels_impl.hh
+// CNNSim, a simple CNN simulator
+//
+// Licensed under the 2-clause BSD License
+//
+
+// Generic implementation of the stencil kernels. This file is included
+// by every kernels_<isa>.cc, after that file defines the vector type
+// of its instruction set, and it must not be included from anywhere else.
+// Everything is in an anonymous namespace, so that none of the code
+// compiled with ISA-specific flags can leak into other translation units.
+
+#ifndef CNNSIM_KERNELS_IMPL_HH
+#define CNNSIM_KERNELS_IMPL_HH
+
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+
+#include "kernels.hh"
+
+
+namespace {
+
+static_assert(MaxTemplateRadius == 3, "the kernel tables below need updating");
+
+// Vector types wrap the intrinsics of a single instruction set
+// behind the same small interface. This one is the scalar fallback.
+// Each vector type names the scalar type that handles the remainder
+// of each row ('remainder'), which must round the same way as the
+// vector lanes do, so that the result of a cell doesn't depend on
+// where it is in the row (which changes e.g. when tiling the image).
+template<typename T>
+struct ScalarVec {
+	typedef T scalar;
+	typedef T type;
+	typedef ScalarVec remainder;
+	static const std::ptrdiff_t width = 1;
+
+	static type load(const T *p) { return *p; }
+	static void store(T *p, type v) { *p = v; }
+	static type broadcast(T x) { return x; }
+	static type add(type a, type b) { return a + b; }
+	static type fmadd(type a, type b, type c) { return a * b + c; }
+};
+
+// The remainder of instruction sets with fused multiply-add
+template<typename T>
+struct FusedScalarVec : ScalarVec<T> {
+	typedef FusedScalarVec remainder;
+
+	static T fmadd(T a, T b, T c) { return std::fma(a, b, c); }
+};
+
+// Coefficients outside the zero pattern of 'Shape' are never even loaded;
+// since the pattern is a compile-time constant, e.g. a centre-only stencil
+// is just a scaled copy, and a cross-shaped one costs 5 FMAs instead of 9.
+template<typename V, StencilShape Shape, typename T = typename V::scalar>
+void stencil_row(
+	T *RESTRICT out,
+	const T *RESTRICT above,
+	const T *RESTRICT centre,
+	const T *RESTRICT below,
+	const T *RESTRICT M,
+	std::ptrdiff_t n
+)
+{
+	typedef typename V::type vec;
+
+	constexpr unsigned mask = stencil_shape_mask(Shape);
+
+	if (mask == 0) {
+		return;
+	}
+
+	const T *RESTRICT rows[3] = { above, centre, below };
+	vec coeffs[9];
+
+	for (int k = 0; k < 9; k++) {
+		if (mask >> k & 1) {
+			coeffs[k] = V::broadcast(M[k]);
+		}
+	}
+
+	std::ptrdiff_t c = 0;
+
+	for (; c + V::width <= n; c += V::width) {
+		vec acc = V::load(out + c);
+
+		for (int i = 0; i < 3; i++) {
+			for (int j = 0; j < 3; j++) {
+				if (mask >> (3 * i + j) & 1) {
+					acc = V::fmadd(V::load(rows[i] + c + j - 1), coeffs[3 * i + j], acc);
+				}
+			}
+		}
+
+		V::store(out + c, acc);
+	}
+
+	if (V::width > 1 && c < n) {
+		stencil_row<typename V::remainder, Shape>(out + c, above + c, centre + c, below + c, M, n - c);
+	}
+}
+
+// Same as above, but for point-symmetric matrices: coefficient k and its
+// mirror image 8 - k are equal, so their inputs are summed first, and
+// e.g. a full symmetric 3x3 stencil costs 5 multiplications instead of 9.
+template<typename V, StencilShape Shape, typename T = typename V::scalar>
+void symmetric_stencil_row(
+	T *RESTRICT out,
+	const T *RESTRICT above,
+	const T *RESTRICT centre,
+	const T *RESTRICT below,
+	const T *RESTRICT M,
+	std::ptrdiff_t n
+)
+{
+	typedef typename V::type vec;
+
+	constexpr unsigned mask = stencil_shape_mask(Shape);
+
+	if (mask == 0) {
+		return;
+	}
+
+	const T *RESTRICT rows[3] = { above, centre, below };
+	vec coeffs[5];
+
+	for (int k = 0; k < 5; k++) {
+		if (mask >> k & 1) {
+			coeffs[k] = V::broadcast(M[k]);
+		}
+	}
+
+	std::ptrdiff_t c = 0;
+
+	for (; c + V::width <= n; c += V::width) {
+		vec acc = V::load(out + c);
+
+		for (int k = 0; k < 4; k++) {
+			if (mask >> k & 1) {
+				int i = k / 3, j = k % 3;
+				vec pair = V::add(
+					V::load(rows[i] + c + j - 1),
+					V::load(rows[2 - i] + c + (2 - j) - 1)
+				);
+				acc = V::fmadd(pair, coeffs[k], acc);
+			}
+		}
+
+		if (mask >> 4 & 1) {
+			acc = V::fmadd(V::load(centre + c), coeffs[4], acc);
+		}
+
+		V::store(out + c, acc);
+	}
+
+	if (V::width > 1 && c < n) {
+		symmetric_stencil_row<typename V::remainder, Shape>(out + c, above + c, centre + c, below + c, M, n - c);
+	}
+}
+
+// Larger neighborhoods have no specialized zero patterns, but the radius
+// is a compile-time constant, so the loops over the neighborhood are
+// fully unrolled, just like those of the 3x3 kernels.
+template<typename V, int R, typename T = typename V::scalar>
+void wide_stencil_row(
+	T *RESTRICT out,
+	const T *const *rows,
+	const T *RESTRICT M,
+	std::ptrdiff_t n
+)
+{
+	typedef typename V::type vec;
+
+	constexpr int N = 2 * R + 1;
+	vec coeffs[N * N];
+
+	for (int k = 0; k < N * N; k++) {
+		coeffs[k] = V::broadcast(M[k]);
+	}
+
+	std::ptrdiff_t c = 0;
+
+	for (; c + V::width <= n; c += V::width) {
+		vec acc = V::load(out + c);
+
+		for (int i = 0; i < N; i++) {
+			for (int j = 0; j < N; j++) {
+				acc = V::fmadd(V::load(rows[i] + c + j - R), coeffs[N * i + j], acc);
+			}
+		}
+
+		V::store(out + c, acc);
+	}
+
+	if (V::width > 1 && c < n) {
+		const T *tail_rows[N];
+
+		for (int i = 0; i < N; i++) {
+			tail_rows[i] = rows[i] + c;
+		}
+
+		wide_stencil_row<typename V::remainder, R>(out + c, tail_rows, M, n - c);
+	}
+}
+
+// Across a batch, neighboring cells are 'lanes' elements apart, and whole
+// vectors of lanes are contiguous, so this is one long run of vectors per
+// nonzero coefficient, whatever the shape of the stencil.
+template<typename V, typename T = typename V::scalar>
+void batch_stencil_row(
+	T *RESTRICT out,
+	const T *const *rows,
+	const T *RESTRICT M,
+	std::ptrdiff_t radius,
+	std::ptrdiff_t lanes,
+	std::ptrdiff_t n
+)
+{
+	typedef typename V::type vec;
+
+	constexpr int MaxTaps = (2 * MaxTemplateRadius + 1) * (2 * MaxTemplateRadius + 1);
+	const std::ptrdiff_t size = 2 * radius + 1;
+	const T *taps[MaxTaps];
+	vec coeffs[MaxTaps];
+	std::ptrdiff_t tap_index[MaxTaps];
+	int n_taps = 0;
+
+	for (std::ptrdiff_t i = 0; i < size; i++) {
+		for (std::ptrdiff_t j = 0; j < size; j++) {
+			if (M[size * i + j] != 0) {
+				taps[n_taps] = rows[i] + (j - radius) * lanes;
+				coeffs[n_taps] = V::broadcast(M[size * i + j]);
+				tap_index[n_taps] = size * i + j;
+				n_taps++;
+			}
+		}
+	}
+
+	const std::ptrdiff_t total = n * lanes;
+	std::ptrdiff_t k = 0;
+
+	for (; k + V::width <= total; k += V::width) {
+		vec acc = V::load(out + k);
+
+		for (int t = 0; t < n_taps; t++) {
+			acc = V::fmadd(V::load(taps[t] + k), coeffs[t], acc);
+		}
+
+		V::store(out + k, acc);
+	}
+
+	// The remainder is handled in scalars, rounding the same way
+	typedef typename V::remainder S;
+
+	for (; k < total; k++) {
+		T acc = out[k];
+
+		for (int t = 0; t < n_taps; t++) {
+			acc = S::fmadd(taps[t][k], M[tap_index[t]], acc);
+		}
+
+		out[k] = acc;
+	}
+}
+
+template<typename V>
+constexpr StencilKernels<typename V::scalar> make_stencil_kernels(KernelISA isa)
+{
+	return StencilKernels<typename V::scalar> {
+		isa,
+		{
+			stencil_row<V, StencilZero>,
+			stencil_row<V, StencilCentre>,
+			stencil_row<V, StencilRow>,
+			stencil_row<V, StencilColumn>,
+			stencil_row<V, StencilCross>,
+			stencil_row<V, StencilFull>,
+		},
+		{
+			symmetric_stencil_row<V, StencilZero>,
+			symmetric_stencil_row<V, StencilCentre>,
+			symmetric_stencil_row<V, StencilRow>,
+			symmetric_stencil_row<V, StencilColumn>,
+			symmetric_stencil_row<V, StencilCross>,
+			symmetric_stencil_row<V, StencilFull>,
+		},
+		{
+			nullptr,
+			nullptr,
+			wide_stencil_row<V, 2>,
+			wide_stencil_row<V, 3>,
+		},
+		batch_stencil_row<V>,
+	};
+}
+
+// Fixed-point vector types hold 16-bit integer lanes, and the same number of
+// bits as 32-bit lanes, with the sums of products of pairs of 16-bit lanes.
+// A 16-bit vector is split in two halves of 32-bit lanes: 'low' and 'high'.
+// Which lanes belong to which half only matters for widening and packing,
+// which are the inverses of each other. The scalar instruction set has no
+// such vector type, only the plain loops below, which also handle the
+// remainder of each row for the others.
+struct NoFixedVec {};
+
+// Two 16-bit lanes in a 32-bit one: 'a' in the lower, 'b' in the upper half
+static inline std::int32_t pack_pair(std::int16_t a, std::int16_t b)
+{
+	return std::int32_t(std::uint16_t(a) | std::uint32_t(std::uint16_t(b)) << 16);
+}
+
+// out[c] = saturate(base[c] + round((bias + sum(coeffs[k] * taps[k][c])) / 2^shift))
+//
+// without 'base[c]' unless 'Increment'. There are 2 * Pairs taps: their
+// coefficients are multiplied by pairs of adjacent cells at once. Integer
+// arithmetic is exact, and products of 16-bit numbers and coefficients that
+// fit in 8 bits can't overflow the 32-bit sums of up to 2 * 6 of them, so
+// the vector code always gives the same result as this plain loop.
+template<int Pairs, bool Increment>
+std::ptrdiff_t fixed_stencil_vectors(
+	NoFixedVec,
+	std::int16_t *,
+	const std::int16_t *,
+	const std::int16_t *const *,
+	const std::int16_t *,
+	std::int32_t,
+	int,
+	std::ptrdiff_t
+)
+{
+	return 0;
+}
+
+template<int Pairs, bool Increment, typename FV>
+std::ptrdiff_t fixed_stencil_vectors(
+	FV,
+	std::int16_t *out,
+	const std::int16_t *base,
+	const std::int16_t *const *taps,
+	const std::int16_t *coeffs,
+	std::int32_t bias,
+	int shift,
+	std::ptrdiff_t n
+)
+{
+	typedef typename FV::type vec;
+
+	const vec bias_v = FV::broadcast32(bias + (std::int32_t(1) << shift >> 1));
+	vec pairs[Pairs];
+
+	for (int k = 0; k < Pairs; k++) {
+		pairs[k] = FV::broadcast_pair(coeffs[2 * k], coeffs[2 * k + 1]);
+	}
+
+	std::ptrdiff_t c = 0;
+
+	for (; c + FV::width <= n; c += FV::width) {
+		vec lo = bias_v, hi = bias_v;
+
+		for (int k = 0; k < Pairs; k++) {
+			const vec p = FV::load(taps[2 * k] + c);
+			const vec q = FV::load(taps[2 * k + 1] + c);
+			lo = FV::add32(lo, FV::madd(FV::interleave_low(p, q), pairs[k]));
+			hi = FV::add32(hi, FV::madd(FV::interleave_high(p, q), pairs[k]));
+		}
+
+		lo = FV::shift_right32(lo, shift);
+		hi = FV::shift_right32(hi, shift);
+
+		if (Increment) {
+			const vec b = FV::load(base + c);
+			lo = FV::add32(lo, FV::widen_low(b));
+			hi = FV::add32(hi, FV::widen_high(b));
+		}
+
+		FV::store(out + c, FV::pack_saturate(lo, hi));
+	}
+
+	return c;
+}
+
+template<int Pairs, bool Increment, typename FV>
+void fixed_stencil_row(
+	std::int16_t *out,
+	const std::int16_t *base,
+	const std::int16_t *const *taps,
+	const std::int16_t *coeffs,
+	std::int32_t bias,
+	int shift,
+	std::ptrdiff_t n
+)
+{
+	const std::int32_t half = std::int32_t(1) << shift >> 1;
+	std::ptrdiff_t c = fixed_stencil_vectors<Pairs, Increment>(FV(), out, base, taps, coeffs, bias, shift, n);
+
+	for (; c < n; c++) {
+		std::int32_t acc = bias;
+
+		for (int k = 0; k < 2 * Pairs; k++) {
+			acc += std::int32_t(coeffs[k]) * taps[k][c];
+		}
+
+		std::int32_t next = (Increment ? base[c] : 0) + ((acc + half) >> shift);
+		out[c] = std::int16_t(std::max<std::int32_t>(INT16_MIN, std::min<std::int32_t>(INT16_MAX, next)));
+	}
+}
+
+// The Euler step is a stencil of 11 taps: the 9 of A, the feed-forward
+// image and the state (the last, 12th one, has a zero coefficient).
+template<typename FV>
+void fixed_euler_row(
+	std::int16_t *RESTRICT x,
+	const std::int16_t *RESTRICT FF,
+	const std::int16_t *RESTRICT above,
+	const std::int16_t *RESTRICT centre,
+	const std::int16_t *RESTRICT below,
+	const std::int16_t *RESTRICT A,
+	std::int16_t one,
+	int shift,
+	std::ptrdiff_t n
+)
+{
+	const std::int16_t *const taps[12] = {
+		above - 1,  above,  above + 1,
+		centre - 1, centre, centre + 1,
+		below - 1,  below,  below + 1,
+		FF, x, x,
+	};
+	const std::int16_t coeffs[12] = {
+		A[0], A[1], A[2],
+		A[3], A[4], A[5],
+		A[6], A[7], A[8],
+		one, std::int16_t(-one), 0,
+	};
+
+	fixed_stencil_row<6, true, FV>(x, x, taps, coeffs, 0, shift, n);
+}
+
+// The feed-forward image is a stencil of the 9 taps of B (and a 10th
+// one with a zero coefficient), plus the bias
+template<typename FV>
+void fixed_feedforward_row(
+	std::int16_t *RESTRICT FF,
+	const std::int16_t *RESTRICT above,
+	const std::int16_t *RESTRICT centre,
+	const std::int16_t *RESTRICT below,
+	const std::int16_t *RESTRICT B,
+	std::int32_t bias,
+	int shift,
+	std::ptrdiff_t n
+)
+{
+	const std::int16_t *const taps[10] = {
+		above - 1,  above,  above + 1,
+		centre - 1, centre, centre + 1,
+		below - 1,  below,  below + 1,
+		centre,
+	};
+	const std::int16_t coeffs[10] = {
+		B[0], B[1], B[2],
+		B[3], B[4], B[5],
+		B[6], B[7], B[8],
+		0,
+	};
+
+	fixed_stencil_row<5, false, FV>(FF, nullptr, taps, coeffs, bias, shift, n);
+}
+
+template<typename FV>
+constexpr FixedPointKernels make_fixed_point_kernels()
+{
+	return FixedPointKernels {
+		fixed_euler_row<FV>,
+		fixed_feedforward_row<FV>,
+	};
+}
+
+// All kernels for an instruction set
+template<template<typename> class V, typename FV>
+constexpr StencilKernelSet make_stencil_kernel_set(KernelISA isa)
+{
+	return StencilKernelSet {
+		make_stencil_kernels<V<float>>(isa),
+		make_stencil_kernels<V<double>>(isa),
+		make_fixed_point_kernels<FV>(),
+	};
+}
+
+} // anonymous namespace
+
+#endif // CNNSIM_KERNELS_IMPL_HH
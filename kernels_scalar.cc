@@ -0,0 +1,11 @@
+//
+// kernels_scalar.cc
+// CNNSim, a simple CNN simulator
+//
+// Licensed under the 2-clause BSD License
+//
+
+#include "kernels_impl.hh"
+
+
+extern const StencilKernelSet scalar_stencil_kernels = make_stencil_kernel_set<ScalarVec, NoFixedVec>(KernelScalar);
@@ -0,0 +1,71 @@
+//
+// kernels_sse2.cc
+// CNNSim, a simple CNN simulator
+//
+// Licensed under the 2-clause BSD License
+//
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <emmintrin.h>
+
+#include "kernels_impl.hh"
+
+
+namespace {
+
+template<typename T>
+struct SSE2Vec;
+
+template<>
+struct SSE2Vec<double> {
+	typedef double scalar;
+	typedef __m128d type;
+	typedef ScalarVec<double> remainder;
+	static const std::ptrdiff_t width = 2;
+
+	static type load(const double *p) { return _mm_loadu_pd(p); }
+	static void store(double *p, type v) { _mm_storeu_pd(p, v); }
+	static type broadcast(double x) { return _mm_set1_pd(x); }
+	static type add(type a, type b) { return _mm_add_pd(a, b); }
+	static type fmadd(type a, type b, type c) { return _mm_add_pd(_mm_mul_pd(a, b), c); }
+};
+
+template<>
+struct SSE2Vec<float> {
+	typedef float scalar;
+	typedef __m128 type;
+	typedef ScalarVec<float> remainder;
+	static const std::ptrdiff_t width = 4;
+
+	static type load(const float *p) { return _mm_loadu_ps(p); }
+	static void store(float *p, type v) { _mm_storeu_ps(p, v); }
+	static type broadcast(float x) { return _mm_set1_ps(x); }
+	static type add(type a, type b) { return _mm_add_ps(a, b); }
+	static type fmadd(type a, type b, type c) { return _mm_add_ps(_mm_mul_ps(a, b), c); }
+};
+
+// The low half holds lanes 0...3, the high half lanes 4...7
+struct SSE2FixedVec {
+	typedef __m128i type;
+	static const std::ptrdiff_t width = 8;
+
+	static type load(const std::int16_t *p) { return _mm_loadu_si128(reinterpret_cast<const __m128i *>(p)); }
+	static void store(std::int16_t *p, type v) { _mm_storeu_si128(reinterpret_cast<__m128i *>(p), v); }
+	static type broadcast32(std::int32_t x) { return _mm_set1_epi32(x); }
+	static type broadcast_pair(std::int16_t a, std::int16_t b) { return _mm_set1_epi32(pack_pair(a, b)); }
+	static type interleave_low(type a, type b) { return _mm_unpacklo_epi16(a, b); }
+	static type interleave_high(type a, type b) { return _mm_unpackhi_epi16(a, b); }
+	static type madd(type a, type b) { return _mm_madd_epi16(a, b); }
+	static type add32(type a, type b) { return _mm_add_epi32(a, b); }
+	static type shift_right32(type a, int n) { return _mm_sra_epi32(a, _mm_cvtsi32_si128(n)); }
+	static type widen_low(type a) { return _mm_srai_epi32(_mm_unpacklo_epi16(a, a), 16); }
+	static type widen_high(type a) { return _mm_srai_epi32(_mm_unpackhi_epi16(a, a), 16); }
+	static type pack_saturate(type lo, type hi) { return _mm_packs_epi32(lo, hi); }
+};
+
+} // anonymous namespace
+
+extern const StencilKernelSet sse2_stencil_kernels = make_stencil_kernel_set<SSE2Vec, SSE2FixedVec>(KernelSSE2);
+
+#endif // x86
@@ -9,11 +9,21 @@
 
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <cerrno>
 #include <chrono>
+#include <atomic>
+#include <new>
+#include <string>
+#include <vector>
 
 #include <SDL2/SDL.h>
 
 #include "CNN.hh"
+#include "batch.hh"
+#include "program.hh"
+#include "server.hh"
+#include "fixedpoint.hh"
 #include "template.hh"
 #include "imgproc.hh"
 #include "3rdparty/optionparser.h"
@@ -28,9 +38,74 @@ enum CNNOpt {
 	Output,
 	RelTol,
 	AbsTol,
+	CheckAllocs,
+	Stats,
+	Kernel,
+	Threads,
+	Precision,
+	Method,
+	TimeStep,
+	Tile,
+	TimeBlock,
+	UntilSteady,
+	SteadyTol,
+	SteadyTime,
+	ActiveSet,
+	Incremental,
+	FbRefresh,
+	ClosedForm,
+	Batch,
+	BatchSize,
+	ProgramFile,
+	Fusion,
+	Serve,
+	Workers,
+	Queue,
 };
 
 
+// Global heap allocation counter, maintained by the replacement
+// operator new below. Used by '--check-allocs' in order to verify
+// that the simulation hot path never touches the allocator.
+static std::atomic<std::size_t> heap_allocations { 0 };
+
+void *operator new(std::size_t size)
+{
+	heap_allocations.fetch_add(1, std::memory_order_relaxed);
+
+	if (void *ptr = std::malloc(size ? size : 1)) {
+		return ptr;
+	}
+
+	throw std::bad_alloc();
+}
+
+void *operator new[](std::size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void *ptr) noexcept
+{
+	std::free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+	std::free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t) noexcept
+{
+	std::free(ptr);
+}
+
+void operator delete[](void *ptr, std::size_t) noexcept
+{
+	std::free(ptr);
+}
+
+
 static option::ArgStatus required_arg(const option::Option& option, bool msg)
 {
 	if (option.arg) {
@@ -44,11 +119,12 @@ static option::ArgStatus required_arg(const option::Option& option, bool msg)
 	return option::ARG_ILLEGAL;
 }
 
-static GrayscaleImage parse_image_or_constant(const char *arg)
+template<typename T>
+static BasicGrayscaleImage<T> parse_image_or_constant(const char *arg)
 {
 	if (arg[0] == '@') {
 		// format: "@640 480 -0.5"
-		GrayscaleImage img;
+		BasicGrayscaleImage<T> img;
 		char *end;
 
 		img.width  = std::strtol(arg + 1, &end, 10);
@@ -56,110 +132,144 @@ static GrayscaleImage parse_image_or_constant(const char *arg)
 
 		double val = std::strtod(end, nullptr);
 
-		img.buf = std::vector<double>(img.width * img.height, val);
+		img.buf = std::vector<T>(img.width * img.height, val);
 		return img;
 	} else {
-		return load_png_file(arg);
+		return load_image_file<T>(arg);
 	}
 }
 
-int main(int argc, char *argv[])
+// The simulators read the neighborhoods of boundary cells from a halo as
+// wide as the radius of the template, which must fit in the image.
+// Prints an error and returns false if it doesn't.
+static bool check_image_size(const char *name, std::ptrdiff_t width, std::ptrdiff_t height, const Template &tem)
 {
-	// CNN parameters
-	GrayscaleImage x; // initial state
-	GrayscaleImage u; // input
-	Template tem;
-	double t_max = 0.0; // duration
-	double rel_tol = 1e-3;
-	double abs_tol = 1e-3;
+	const std::ptrdiff_t halo = std::max(effective_radius(tem.A), effective_radius(tem.B));
 
-	// output configuration
-	const char *out_file = nullptr;
-	GrayscaleImage out_image;
+	if (width < halo || height < halo) {
+		std::fprintf(stderr, "The image '%s' is smaller than the neighborhood of the template\n", name);
+		return false;
+	}
 
-	// Command-line options
-	const option::Descriptor desc[] = {
-		{ CNNOpt::Invalid,  0, "",  "",         option::Arg::None, "Usage: CNN <options>\n\nOptions:\n"    },
-		{ CNNOpt::State,    0, "s", "state",    required_arg,      "   -s, --state    Initial state image" },
-		{ CNNOpt::Input,    0, "i", "input",    required_arg,      "   -i, --input    Input image"         },
-		{ CNNOpt::Templ,    0, "t", "template", required_arg,      "   -t, --template Template file"       },
-		{ CNNOpt::Duration, 0, "d", "duration", required_arg,      "   -d, --duration Simulation time"     },
-		{ CNNOpt::Output,   0, "o", "outfile",  required_arg,      "   -o, --outfile  Output image file"   },
-		{ CNNOpt::RelTol,   0, "r", "rel-tol",  required_arg,      "   -r, --rel-tol  Relative tolerance"  },
-		{ CNNOpt::AbsTol,   0, "a", "abs-tol",  required_arg,      "   -a, --abs-tol  Absolute tolerance"  },
-		{ 0,                0, nullptr, nullptr,     nullptr,      nullptr }
-	};
+	return true;
+}
 
-	std::vector<option::Option> options(argc);
-	std::vector<option::Option> buffer(argc);
+// Step through the whole simulation (exactly what CNN::run() does),
+// counting heap allocations per step. Returns true if there were none.
+template<typename Engine>
+static bool check_allocations(Engine *cnn)
+{
+	double t = 0.0;
+	std::size_t steps = 0;
+	std::size_t total = 0;
+	std::size_t worst = 0;
+	bool keep_running = true;
+
+	while (keep_running) {
+		std::size_t before = heap_allocations.load(std::memory_order_relaxed);
+		keep_running = cnn->step(&t);
+		std::size_t count = heap_allocations.load(std::memory_order_relaxed) - before;
+
+		steps++;
+		total += count;
+		worst = std::max(worst, count);
+	}
 
-	argc--;
-	argv++;
+	std::printf(
+		"%zu steps, %zu heap allocations (at most %zu per step)\n",
+		steps,
+		total,
+		worst
+	);
 
-	option::Parser parser(true, desc, argc, argv, &options[0], &buffer[0]);
+	return total == 0;
+}
 
-	if (parser.error() || argc <= 0) {
-		option::printUsage(std::cerr, desc);
-		return 1;
-	}
+static const char *scalar_type_name(float)        { return "float";  }
+static const char *scalar_type_name(double)       { return "double"; }
+static const char *scalar_type_name(std::int16_t) { return "int16";  }
 
-	if (auto opt = options[CNNOpt::Invalid]) {
-		std::fprintf(stderr, "unrecognized option: '%.*s'\n", opt.namelen, opt.name);
-		return 1;
-	}
+template<typename Engine>
+static void print_stats(const Engine &cnn)
+{
+	const CNNStats &stats = cnn.stats();
 
-	if (auto opt = options[CNNOpt::State]) {
-		x = parse_image_or_constant(opt.last()->arg);
-	} else {
-		std::fprintf(stderr, "Must specify initial state\n");
-		return 1;
-	}
+	std::printf("Precision:           %s\n", scalar_type_name(typename Engine::Scalar()));
+	std::printf("Integration method:  %s\n", stats.closed_form ? "closed form" : integration_method_name(stats.method));
+	std::printf("Threads:             %td\n", stats.threads);
+	std::printf("Stencil kernel:      %s\n", kernel_isa_name(stats.kernel_isa));
 
-	if (auto opt = options[CNNOpt::Input]) {
-		u = parse_image_or_constant(opt.last()->arg);
+	if (stats.tile_width > 0) {
+		std::printf("Tiles:               %tdx%td, %td step(s) at once\n", stats.tile_width, stats.tile_height, stats.time_block);
 	} else {
-		std::fprintf(stderr, "Must specify input image\n");
-		return 1;
+		std::printf("Tiles:               none\n");
 	}
 
-	if (auto opt = options[CNNOpt::Templ]) {
-		tem = load_template_file(opt.last()->arg);
-	} else {
-		std::fprintf(stderr, "Must specify template\n");
-		return 1;
-	}
+	std::printf("Stencil shapes:      A: %s (%s, %tdx%td), B: %s (%s, %tdx%td)\n",
+		stencil_shape_name(stats.feedback_shape),
+		coupling_structure_name(stats.feedback_structure),
+		2 * stats.feedback_radius + 1,
+		2 * stats.feedback_radius + 1,
+		stencil_shape_name(stats.feedforward_shape),
+		coupling_structure_name(stats.feedforward_structure),
+		2 * stats.feedforward_radius + 1,
+		2 * stats.feedforward_radius + 1
+	);
+	std::printf("Integration steps:   %zu\n", stats.steps);
+	std::printf("RHS evaluations:     %zu\n", stats.rhs_evaluations);
+	std::printf("Output evaluations:  %zu (%.2f per cell per RHS)\n",
+		stats.output_evaluations,
+		stats.rhs_evaluations ? double(stats.output_evaluations) / stats.rhs_evaluations / cnn.dimension : 0.0
+	);
 
-	if (auto opt = options[CNNOpt::Duration]) {
-		t_max = std::strtod(opt.last()->arg, nullptr);
-	} else {
-		std::fprintf(stderr, "Must specify duration of simulation\n");
-		return 1;
+	if (stats.active_set) {
+		std::printf("Frozen tiles:        %zu of %zu tile evaluations skipped (%.1f%%)\n",
+			stats.frozen_tile_evaluations,
+			stats.tile_evaluations,
+			stats.tile_evaluations ? 100.0 * stats.frozen_tile_evaluations / stats.tile_evaluations : 0.0
+		);
 	}
 
-	if (auto opt = options[CNNOpt::Output]) {
-		out_file = opt.last()->arg;
+	if (stats.incremental_feedback) {
+		std::printf("Feedback image:      %zu full recomputations, %.1f%% of cells updated otherwise\n",
+			stats.feedback_refreshes,
+			stats.rhs_evaluations > stats.feedback_refreshes
+				? 100.0 * stats.feedback_cells_updated / (stats.rhs_evaluations - stats.feedback_refreshes) / cnn.dimension
+				: 0.0
+		);
 	}
 
-	if (auto opt = options[CNNOpt::RelTol]) {
-		rel_tol = std::strtod(opt.last()->arg, nullptr);
+	if (stats.jacobian_products > 0) {
+		std::printf("Jacobian products:   %zu\n", stats.jacobian_products);
+		std::printf("Linear iterations:   %zu\n", stats.linear_iterations);
 	}
+}
 
-	if (auto opt = options[CNNOpt::AbsTol]) {
-		abs_tol = std::strtod(opt.last()->arg, nullptr);
-	}
+// With '--until-steady': when the simulation could stop
+template<typename Engine>
+static void print_settling_time(const Engine &cnn)
+{
+	const CNNStats &stats = cnn.stats();
 
-	// Construct simulator
-	CNN cnn(
-		x.width,
-		x.height,
-		x.buf,
-		u.buf,
-		tem,
-		t_max,
-		rel_tol,
-		abs_tol
-	);
+	if (stats.steady) {
+		std::printf("Steady state reached at t = %g\n", stats.settling_time);
+	} else {
+		std::printf("No steady state reached until the end of the simulation\n");
+	}
+}
 
+// Everything after constructing the simulator: run it, and write the
+// output into a file, or animate it on-screen if there's no output file.
+template<typename Engine, typename T>
+static int run_simulation(
+	Engine &cnn,
+	BasicGrayscaleImage<T> &out_image,
+	const char *out_file,
+	bool check_allocs,
+	bool stats,
+	bool until_steady
+)
+{
 	auto stopwatch = [](auto fn) {
 		auto t0 = std::chrono::steady_clock::now();
 		fn();
@@ -169,11 +279,41 @@ int main(int argc, char *argv[])
 		std::printf("Simulation completed in %.3f seconds\n", dt);
 	};
 
+	// In allocation checking mode, count heap allocations during every
+	// step and fail if there were any. Writes the output if requested.
+	if (check_allocs) {
+		bool ok = check_allocations(&cnn);
+
+		if (until_steady) {
+			print_settling_time(cnn);
+		}
+
+		if (stats) {
+			print_stats(cnn);
+		}
+
+		if (out_file) {
+			cnn.extract_output(&out_image);
+			ok = save_image_file(out_file, out_image) && ok;
+		}
+
+		return ok ? 0 : 1;
+	}
+
 	// If an output file is specified, write final output into it and exit.
 	if (out_file) {
 		stopwatch([&]{ cnn.run(); });
+
+		if (until_steady) {
+			print_settling_time(cnn);
+		}
+
+		if (stats) {
+			print_stats(cnn);
+		}
+
 		cnn.extract_output(&out_image);
-		return save_png_file(out_file, out_image) ? 0 : 1;
+		return save_image_file(out_file, out_image) ? 0 : 1;
 	}
 
 	// Otherwise, render CNN state step by step.
@@ -231,6 +371,10 @@ int main(int argc, char *argv[])
 		});
 	});
 
+	if (until_steady) {
+		print_settling_time(cnn);
+	}
+
 	bool run = true;
 	while (run) {
 		SDL_Event event;
@@ -247,3 +391,630 @@ int main(int argc, char *argv[])
 
 	return 0;
 }
+
+// Loading the images and constructing the simulator, with
+// the scalar type selected by '--precision'.
+template<typename T>
+static int simulate(
+	const char *state_arg,
+	const char *input_arg,
+	const Template &tem,
+	double t_max,
+	const CNNOptions &cnn_options,
+	const char *out_file,
+	bool check_allocs,
+	bool stats
+)
+{
+	BasicGrayscaleImage<T> x = parse_image_or_constant<T>(state_arg); // initial state
+	BasicGrayscaleImage<T> u = parse_image_or_constant<T>(input_arg); // input
+	BasicGrayscaleImage<T> out_image;
+
+	if (!check_image_size(state_arg, x.width, x.height, tem)) {
+		return 1;
+	}
+
+	BasicCNN<T> cnn(
+		x.width,
+		x.height,
+		x.buf,
+		u.buf,
+		tem,
+		t_max,
+		cnn_options
+	);
+
+	return run_simulation(cnn, out_image, out_file, check_allocs, stats, cnn_options.stop_when_steady);
+}
+
+// The batch simulator ('--batch'): the images of the list are simulated
+// 'batch_size' at a time, which must all be of the same size.
+template<typename T>
+static int simulate_batch(
+	const char *list_file,
+	std::ptrdiff_t batch_size,
+	const Template &tem,
+	double t_max,
+	const CNNOptions &cnn_options,
+	bool check_allocs,
+	bool stats
+)
+{
+	std::vector<BatchItem> items;
+	std::string error;
+
+	if (!load_batch_list(list_file, &items, &error)) {
+		std::fprintf(stderr, "%s\n", error.c_str());
+		return 1;
+	}
+
+	std::ptrdiff_t width = 0, height = 0;
+	std::vector<std::vector<T>> states, inputs;
+	BasicGrayscaleImage<T> out_image;
+	double seconds = 0.0;
+	bool ok = true;
+
+	for (std::size_t first = 0; first < items.size(); first += batch_size) {
+		const std::size_t last = std::min(items.size(), first + batch_size);
+
+		states.clear();
+		inputs.clear();
+
+		for (std::size_t i = first; i < last; i++) {
+			BasicGrayscaleImage<T> x = parse_image_or_constant<T>(items[i].state.c_str());
+			BasicGrayscaleImage<T> u = parse_image_or_constant<T>(items[i].input.c_str());
+
+			if (i == 0) {
+				width = x.width;
+				height = x.height;
+			}
+
+			if (x.width != width || x.height != height || u.width != width || u.height != height) {
+				std::fprintf(stderr, "The images of '%s' and '%s' are not %tdx%td\n", items[i].state.c_str(), items[i].input.c_str(), width, height);
+				return 1;
+			}
+
+			if (!check_image_size(items[i].state.c_str(), width, height, tem)) {
+				return 1;
+			}
+
+			states.push_back(std::move(x.buf));
+			inputs.push_back(std::move(u.buf));
+		}
+
+		BasicBatchCNN<T> cnn(width, height, states, inputs, tem, t_max, cnn_options);
+
+		if (check_allocs) {
+			ok = check_allocations(&cnn) && ok;
+		} else {
+			auto t0 = std::chrono::steady_clock::now();
+			cnn.run();
+			auto t1 = std::chrono::steady_clock::now();
+			seconds += std::chrono::duration<double>(t1 - t0).count();
+		}
+
+		if (stats) {
+			std::printf("Images %zu...%zu:\n", first + 1, last);
+			print_stats(cnn);
+		}
+
+		for (std::size_t i = first; i < last; i++) {
+			cnn.extract_output(i - first, &out_image);
+			ok = save_image_file(items[i].output.c_str(), out_image) && ok;
+		}
+	}
+
+	if (!check_allocs) {
+		std::printf("Simulated %zu images in %.3f seconds\n", items.size(), seconds);
+	}
+
+	return ok ? 0 : 1;
+}
+
+// A program of the CNN Universal Machine ('--program'), run in-process
+template<typename T>
+static int run_program(const char *program_file, const CNNOptions &cnn_options, bool fusion, bool stats)
+{
+	Program program;
+	std::string error;
+
+	if (!load_program_file(program_file, &program, &error)) {
+		std::fprintf(stderr, "%s: %s\n", program_file, error.c_str());
+		return 1;
+	}
+
+	BasicProgramRunner<T> runner(program, cnn_options, fusion);
+
+	auto t0 = std::chrono::steady_clock::now();
+	bool ok = runner.run(&error);
+	auto t1 = std::chrono::steady_clock::now();
+
+	if (!ok) {
+		std::fprintf(stderr, "%s: %s\n", program_file, error.c_str());
+		return 1;
+	}
+
+	std::printf("Program completed in %.3f seconds\n", std::chrono::duration<double>(t1 - t0).count());
+
+	if (stats) {
+		const ProgramStats &program_stats = runner.stats();
+
+		std::printf("Precision:           %s\n", scalar_type_name(T()));
+		std::printf("Instructions:        %zu, in %zu loop iterations\n", program_stats.instructions, program_stats.loop_iterations);
+		std::printf("Template runs:       %zu, of which %zu in closed form, %zu fused into the previous run\n",
+			program_stats.template_runs,
+			program_stats.closed_form_runs,
+			program_stats.fused_runs
+		);
+		std::printf("Integration steps:   %zu\n", program_stats.steps);
+		std::printf("RHS evaluations:     %zu\n", program_stats.rhs_evaluations);
+	}
+
+	return 0;
+}
+
+// Same as above, for the fixed-point simulator ('--precision int16')
+static int simulate_fixed_point(
+	const char *state_arg,
+	const char *input_arg,
+	const Template &tem,
+	double t_max,
+	const CNNOptions &cnn_options,
+	const char *out_file,
+	bool check_allocs,
+	bool stats
+)
+{
+	// Images are quantized right after loading, so that
+	// their floating-point versions don't stay around.
+	auto load_quantized = [](const char *arg, std::ptrdiff_t *width, std::ptrdiff_t *height) {
+		BasicGrayscaleImage<float> img = parse_image_or_constant<float>(arg);
+		std::vector<std::int16_t> buf(img.buf.size());
+
+		std::transform(img.buf.begin(), img.buf.end(), buf.begin(), quantize_state);
+		*width = img.width;
+		*height = img.height;
+
+		return buf;
+	};
+
+	std::ptrdiff_t width, height, u_width, u_height;
+	std::vector<std::int16_t> qx = load_quantized(state_arg, &width, &height);
+	std::vector<std::int16_t> qu = load_quantized(input_arg, &u_width, &u_height);
+	BasicGrayscaleImage<float> out_image;
+
+	if (!check_image_size(state_arg, width, height, tem)) {
+		return 1;
+	}
+
+	FixedPointCNN cnn(
+		width,
+		height,
+		std::move(qx),
+		std::move(qu),
+		tem,
+		t_max,
+		cnn_options
+	);
+
+	return run_simulation(cnn, out_image, out_file, check_allocs, stats, cnn_options.stop_when_steady);
+}
+
+int main(int argc, char *argv[])
+{
+	// CNN parameters
+	const char *state_arg = nullptr;
+	const char *input_arg = nullptr;
+	Template tem;
+	double t_max = 0.0; // duration
+	CNNOptions cnn_options;
+
+	// output configuration
+	const char *out_file = nullptr;
+	auto simulate_fn = simulate<double>;
+	auto simulate_batch_fn = simulate_batch<double>;
+	auto run_program_fn = run_program<double>;
+	const char *program_file = nullptr;
+	bool fusion = true;
+	const char *socket_path = nullptr;
+	auto serve_fn = serve<double>;
+	ServerOptions server_options;
+	const char *batch_file = nullptr;
+	std::ptrdiff_t batch_size = 16;
+
+	// Command-line options
+	const option::Descriptor desc[] = {
+		{ CNNOpt::Invalid,     0, "",      "",             option::Arg::None, "Usage: CNN <options>\n\nOptions:\n"                                                                    },
+		{ CNNOpt::State,       0, "s",     "state",        required_arg,      "   -s, --state        Initial state image"                                                             },
+		{ CNNOpt::Input,       0, "i",     "input",        required_arg,      "   -i, --input        Input image"                                                                     },
+		{ CNNOpt::Templ,       0, "t",     "template",     required_arg,      "   -t, --template     Template file"                                                                   },
+		{ CNNOpt::Duration,    0, "d",     "duration",     required_arg,      "   -d, --duration     Simulation time"                                                                 },
+		{ CNNOpt::Output,      0, "o",     "outfile",      required_arg,      "   -o, --outfile      Output image file"                                                               },
+		{ CNNOpt::RelTol,      0, "r",     "rel-tol",      required_arg,      "   -r, --rel-tol      Relative tolerance"                                                              },
+		{ CNNOpt::AbsTol,      0, "a",     "abs-tol",      required_arg,      "   -a, --abs-tol      Absolute tolerance"                                                              },
+		{ CNNOpt::CheckAllocs, 0, "",      "check-allocs", option::Arg::None, "       --check-allocs Fail if the simulation allocates"                                                },
+		{ CNNOpt::Threads,     0, "",      "threads",      required_arg,      "       --threads      Number of threads (default: 0, one per CPU)"                                     },
+		{ CNNOpt::Stats,       0, "",      "stats",        option::Arg::None, "       --stats        Print work counters after the simulation"                                        },
+		{ CNNOpt::Kernel,      0, "",      "kernel",       required_arg,      "       --kernel       Stencil kernel: scalar, sse2, avx2 or avx512"                                    },
+		{ CNNOpt::Precision,   0, "",      "precision",    required_arg,      "       --precision    Scalar type: float, double (default) or int16"                                   },
+		{ CNNOpt::Method,      0, "",      "method",       required_arg,      "       --method       Integrator: gsl (default, double only), rkf45, dopri5, ros2, euler, heun or rk4" },
+		{ CNNOpt::TimeStep,    0, "",      "dt",           required_arg,      "       --dt           Step size of euler, heun and rk4 (default: 0.0625)"                              },
+		{ CNNOpt::Tile,        0, "",      "tile",         required_arg,      "       --tile         Tile size of the RHS: auto (default), off or WxH"                                },
+		{ CNNOpt::TimeBlock,   0, "",      "time-block",   required_arg,      "       --time-block   Steps of euler or heun per tile (default: 1, no blocking)"                       },
+		{ CNNOpt::UntilSteady, 0, "",      "until-steady", option::Arg::None, "       --until-steady Stop early once the output is steady; -d is the upper bound"                     },
+		{ CNNOpt::SteadyTol,   0, "",      "steady-tol",   required_arg,      "       --steady-tol   Steady if max |dx/dt| is below this (default: 1e-4)"                             },
+		{ CNNOpt::SteadyTime,  0, "",      "steady-time",  required_arg,      "       --steady-time  How long max |dx/dt| must stay below it (default: 1)"                            },
+		{ CNNOpt::ActiveSet,   0, "",      "active-set",   option::Arg::None, "       --active-set   Skip the evaluation of tiles that can't change any more"                         },
+		{ CNNOpt::Incremental, 0, "",      "incremental",  option::Arg::None, "       --incremental  Update the feedback image only where the output changed"                         },
+		{ CNNOpt::FbRefresh,   0, "",      "fb-refresh",   required_arg,      "       --fb-refresh   Recompute the feedback image fully every this many RHS (default: 100)"           },
+		{ CNNOpt::ClosedForm,  0, "",      "closed-form",  required_arg,      "       --closed-form  Solve uncoupled templates exactly: auto (default) or off"                        },
+		{ CNNOpt::Batch,       0, "",      "batch",        required_arg,      "       --batch        Simulate every line of a list file: state, input and output"                     },
+		{ CNNOpt::BatchSize,   0, "",      "batch-size",   required_arg,      "       --batch-size   Images simulated together with --batch (default: 16)"                            },
+		{ CNNOpt::ProgramFile, 0, "",      "program",      required_arg,      "       --program      Run a CNN-UM program of templates, logic and loops on in-memory images"          },
+		{ CNNOpt::Fusion,      0, "",      "fusion",       required_arg,      "       --fusion       Fold pointwise templates into the previous run: auto (default) or off"           },
+		{ CNNOpt::Serve,       0, "",      "serve",        required_arg,      "       --serve        Run as a server, taking jobs on this Unix domain socket"                         },
+		{ CNNOpt::Workers,     0, "",      "workers",      required_arg,      "       --workers      Jobs simulated in parallel by --serve (default: 0, one per CPU)"                 },
+		{ CNNOpt::Queue,       0, "",      "queue",        required_arg,      "       --queue        Jobs waiting for a worker before clients are blocked (default: 2 * workers)"     },
+		{ 0,                   0, nullptr, nullptr,        nullptr,           nullptr                                                                                                 }
+	};
+
+	argc--;
+	argv++;
+
+	// one slot per option kind, not per argument: there are more of the former
+	option::Stats stats(true, desc, argc, argv);
+	std::vector<option::Option> options(stats.options_max);
+	std::vector<option::Option> buffer(std::max(stats.buffer_max, 1u));
+
+	option::Parser parser(true, desc, argc, argv, &options[0], &buffer[0]);
+
+	if (parser.error() || argc <= 0) {
+		option::printUsage(std::cerr, desc);
+		return 1;
+	}
+
+	if (auto opt = options[CNNOpt::Invalid]) {
+		std::fprintf(stderr, "unrecognized option: '%.*s'\n", opt.namelen, opt.name);
+		return 1;
+	}
+
+	// With a batch, the list file names the images instead,
+	// and a program names the images and the templates, too.
+	// A server gets all of them from its clients.
+	if (auto opt = options[CNNOpt::Batch]) {
+		batch_file = opt.last()->arg;
+	}
+
+	if (auto opt = options[CNNOpt::ProgramFile]) {
+		program_file = opt.last()->arg;
+	}
+
+	if (auto opt = options[CNNOpt::Serve]) {
+		socket_path = opt.last()->arg;
+	}
+
+	if (auto opt = options[CNNOpt::State]) {
+		state_arg = opt.last()->arg;
+	} else if (!batch_file && !program_file && !socket_path) {
+		std::fprintf(stderr, "Must specify initial state\n");
+		return 1;
+	}
+
+	if (auto opt = options[CNNOpt::Input]) {
+		input_arg = opt.last()->arg;
+	} else if (!batch_file && !program_file && !socket_path) {
+		std::fprintf(stderr, "Must specify input image\n");
+		return 1;
+	}
+
+	if (auto opt = options[CNNOpt::Templ]) {
+		tem = load_template_file(opt.last()->arg);
+	} else if (!program_file && !socket_path) {
+		std::fprintf(stderr, "Must specify template\n");
+		return 1;
+	}
+
+	if (auto opt = options[CNNOpt::Duration]) {
+		t_max = std::strtod(opt.last()->arg, nullptr);
+	} else if (!program_file && !socket_path) {
+		std::fprintf(stderr, "Must specify duration of simulation\n");
+		return 1;
+	}
+
+	if (auto opt = options[CNNOpt::Output]) {
+		out_file = opt.last()->arg;
+	}
+
+	if (auto opt = options[CNNOpt::RelTol]) {
+		cnn_options.rel_tol = std::strtod(opt.last()->arg, nullptr);
+	}
+
+	if (auto opt = options[CNNOpt::AbsTol]) {
+		cnn_options.abs_tol = std::strtod(opt.last()->arg, nullptr);
+	}
+
+	if (auto opt = options[CNNOpt::Kernel]) {
+		cnn_options.kernel_isa = kernel_isa_from_name(opt.last()->arg);
+
+		if (cnn_options.kernel_isa == NumKernelISAs) {
+			std::fprintf(stderr, "Unknown kernel '%s'\n", opt.last()->arg);
+			return 1;
+		}
+
+		if (!kernel_isa_supported(cnn_options.kernel_isa)) {
+			std::fprintf(stderr, "Kernel '%s' is not supported by this CPU\n", opt.last()->arg);
+			return 1;
+		}
+	}
+
+	if (auto opt = options[CNNOpt::Threads]) {
+		cnn_options.threads = std::strtol(opt.last()->arg, nullptr, 10);
+
+		if (cnn_options.threads < 0) {
+			std::fprintf(stderr, "Number of threads must not be negative\n");
+			return 1;
+		}
+	}
+
+	if (auto opt = options[CNNOpt::Precision]) {
+		if (std::strcmp(opt.last()->arg, "float") == 0) {
+			simulate_fn = simulate<float>;
+			simulate_batch_fn = simulate_batch<float>;
+			run_program_fn = run_program<float>;
+			serve_fn = serve<float>;
+		} else if (std::strcmp(opt.last()->arg, "double") == 0) {
+			simulate_fn = simulate<double>;
+			simulate_batch_fn = simulate_batch<double>;
+			run_program_fn = run_program<double>;
+			serve_fn = serve<double>;
+		} else if (std::strcmp(opt.last()->arg, "int16") == 0) {
+			simulate_fn = simulate_fixed_point;
+
+			if (effective_radius(tem.A) > 1 || effective_radius(tem.B) > 1) {
+				std::fprintf(stderr, "The fixed-point simulator only supports 3x3 templates\n");
+				return 1;
+			}
+		} else {
+			std::fprintf(stderr, "Unknown precision '%s'\n", opt.last()->arg);
+			return 1;
+		}
+	}
+
+	if (auto opt = options[CNNOpt::Method]) {
+		cnn_options.method = integration_method_from_name(opt.last()->arg);
+
+		if (cnn_options.method == NumIntegrationMethods) {
+			std::fprintf(stderr, "Unknown integration method '%s'\n", opt.last()->arg);
+			return 1;
+		}
+
+		if (simulate_fn == simulate_fixed_point && cnn_options.method != MethodEuler) {
+			std::fprintf(stderr, "The fixed-point simulator only supports the euler method\n");
+			return 1;
+		}
+	}
+
+	if (auto opt = options[CNNOpt::TimeStep]) {
+		cnn_options.dt = std::strtod(opt.last()->arg, nullptr);
+
+		if (!(cnn_options.dt > 0)) {
+			std::fprintf(stderr, "Step size must be positive\n");
+			return 1;
+		}
+	}
+
+	if (auto opt = options[CNNOpt::Tile]) {
+		const char *arg = opt.last()->arg;
+		long tw = 0, th = 0;
+		char sep = 0;
+
+		if (std::strcmp(arg, "auto") == 0) {
+			cnn_options.tile_width = cnn_options.tile_height = 0;
+		} else if (std::strcmp(arg, "off") == 0) {
+			cnn_options.tile_width = cnn_options.tile_height = -1;
+		} else if (std::sscanf(arg, "%ld%c%ld", &tw, &sep, &th) == 3 && sep == 'x' && tw > 0 && th > 0) {
+			cnn_options.tile_width = tw;
+			cnn_options.tile_height = th;
+		} else {
+			std::fprintf(stderr, "Invalid tile size '%s'\n", arg);
+			return 1;
+		}
+	}
+
+	if (auto opt = options[CNNOpt::TimeBlock]) {
+		cnn_options.time_block = std::strtol(opt.last()->arg, nullptr, 10);
+
+		if (cnn_options.time_block < 1 || cnn_options.time_block > MaxTimeBlock) {
+			std::fprintf(stderr, "Steps per tile must be between 1 and %td\n", MaxTimeBlock);
+			return 1;
+		}
+	}
+
+	if (options[CNNOpt::UntilSteady]) {
+		cnn_options.stop_when_steady = true;
+
+		if (simulate_fn == simulate_fixed_point) {
+			std::fprintf(stderr, "The fixed-point simulator does not support steady-state detection\n");
+			return 1;
+		}
+	}
+
+	if (options[CNNOpt::ActiveSet]) {
+		cnn_options.active_set = true;
+
+		if (simulate_fn == simulate_fixed_point) {
+			std::fprintf(stderr, "The fixed-point simulator does not support the active set\n");
+			return 1;
+		}
+
+		if (cnn_options.tile_width < 0) {
+			std::fprintf(stderr, "The active set needs tiles\n");
+			return 1;
+		}
+	}
+
+	if (options[CNNOpt::Incremental]) {
+		cnn_options.incremental_feedback = true;
+
+		if (simulate_fn == simulate_fixed_point) {
+			std::fprintf(stderr, "The fixed-point simulator does not support incremental feedback\n");
+			return 1;
+		}
+
+		if (cnn_options.active_set) {
+			std::fprintf(stderr, "Incremental feedback and the active set are mutually exclusive\n");
+			return 1;
+		}
+	}
+
+	if (auto opt = options[CNNOpt::FbRefresh]) {
+		cnn_options.feedback_refresh = std::strtol(opt.last()->arg, nullptr, 10);
+
+		if (cnn_options.feedback_refresh <= 0) {
+			std::fprintf(stderr, "Feedback refresh interval must be positive\n");
+			return 1;
+		}
+	}
+
+	if (auto opt = options[CNNOpt::ClosedForm]) {
+		const char *arg = opt.last()->arg;
+
+		if (std::strcmp(arg, "auto") == 0) {
+			cnn_options.closed_form = true;
+		} else if (std::strcmp(arg, "off") == 0) {
+			cnn_options.closed_form = false;
+		} else {
+			std::fprintf(stderr, "Invalid closed form mode '%s'\n", arg);
+			return 1;
+		}
+	}
+
+	if (auto opt = options[CNNOpt::SteadyTol]) {
+		cnn_options.steady_tol = std::strtod(opt.last()->arg, nullptr);
+
+		if (!(cnn_options.steady_tol >= 0)) {
+			std::fprintf(stderr, "Steady-state tolerance must not be negative\n");
+			return 1;
+		}
+	}
+
+	if (auto opt = options[CNNOpt::SteadyTime]) {
+		cnn_options.steady_time = std::strtod(opt.last()->arg, nullptr);
+
+		if (!(cnn_options.steady_time >= 0)) {
+			std::fprintf(stderr, "Steady-state time must not be negative\n");
+			return 1;
+		}
+	}
+
+	if (auto opt = options[CNNOpt::BatchSize]) {
+		batch_size = std::strtol(opt.last()->arg, nullptr, 10);
+
+		if (batch_size <= 0) {
+			std::fprintf(stderr, "Batch size must be positive\n");
+			return 1;
+		}
+	}
+
+	if (auto opt = options[CNNOpt::Fusion]) {
+		const char *arg = opt.last()->arg;
+
+		if (std::strcmp(arg, "auto") == 0) {
+			fusion = true;
+		} else if (std::strcmp(arg, "off") == 0) {
+			fusion = false;
+		} else {
+			std::fprintf(stderr, "Invalid fusion mode '%s'\n", arg);
+			return 1;
+		}
+	}
+
+	if (auto opt = options[CNNOpt::Workers]) {
+		server_options.workers = std::strtol(opt.last()->arg, nullptr, 10);
+
+		if (server_options.workers < 0) {
+			std::fprintf(stderr, "Number of workers must not be negative\n");
+			return 1;
+		}
+	}
+
+	if (auto opt = options[CNNOpt::Queue]) {
+		server_options.queue_size = std::strtol(opt.last()->arg, nullptr, 10);
+
+		if (server_options.queue_size <= 0) {
+			std::fprintf(stderr, "Queue size must be positive\n");
+			return 1;
+		}
+	}
+
+	if (socket_path) {
+		if (simulate_fn == simulate_fixed_point) {
+			std::fprintf(stderr, "The fixed-point simulator can't be served\n");
+			return 1;
+		}
+
+		// Jobs run in parallel, so each of them is single-threaded by default
+		if (!options[CNNOpt::Threads]) {
+			cnn_options.threads = 1;
+		}
+
+		if (!serve_fn(socket_path, server_options, cnn_options)) {
+			std::fprintf(stderr, "Can't listen on '%s': %s\n", socket_path, std::strerror(errno));
+			return 1;
+		}
+
+		return 0;
+	}
+
+	if (program_file) {
+		if (simulate_fn == simulate_fixed_point) {
+			std::fprintf(stderr, "The fixed-point simulator does not support programs\n");
+			return 1;
+		}
+
+		if (options[CNNOpt::CheckAllocs]) {
+			std::fprintf(stderr, "Allocations can't be checked in programs\n");
+			return 1;
+		}
+
+		return run_program_fn(program_file, cnn_options, fusion, options[CNNOpt::Stats]);
+	}
+
+	if (batch_file) {
+		if (simulate_fn == simulate_fixed_point) {
+			std::fprintf(stderr, "The fixed-point simulator does not support batches\n");
+			return 1;
+		}
+
+		if (cnn_options.method != MethodGSL && cnn_options.method != MethodRKF45 && cnn_options.method != MethodDOPRI5 && cnn_options.method != MethodEuler) {
+			std::fprintf(stderr, "The batch simulator only supports the gsl (as rkf45), rkf45, dopri5 and euler methods\n");
+			return 1;
+		}
+
+		if (cnn_options.stop_when_steady || cnn_options.active_set || cnn_options.incremental_feedback) {
+			std::fprintf(stderr, "The batch simulator does not support steady-state detection, the active set or incremental feedback\n");
+			return 1;
+		}
+
+		return simulate_batch_fn(
+			batch_file,
+			batch_size,
+			tem,
+			t_max,
+			cnn_options,
+			options[CNNOpt::CheckAllocs],
+			options[CNNOpt::Stats]
+		);
+	}
+
+	return simulate_fn(
+		state_arg,
+		input_arg,
+		tem,
+		t_max,
+		cnn_options,
+		out_file,
+		options[CNNOpt::CheckAllocs],
+		options[CNNOpt::Stats]
+	);
+}
@@ -0,0 +1,710 @@
+//
+// program.cc
+// CNNSim, a simple CNN simulator
+//
+// Licensed under the 2-clause BSD License
+//
+
+#include <cstdlib>
+#include <cassert>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <unordered_map>
+
+#include "program.hh"
+
+
+static const char *const opcode_names[] = {
+	"load",
+	"const",
+	"copy",
+	"run",
+	"and",
+	"or",
+	"xor",
+	"not",
+	"save",
+	"repeat",
+	"repeat",
+	"end",
+};
+
+static_assert(
+	sizeof opcode_names / sizeof opcode_names[0] == NumProgramOpcodes,
+	"missing or extra opcode names"
+);
+
+const char *program_opcode_name(ProgramOpcode opcode)
+{
+	assert(0 <= opcode && opcode < NumProgramOpcodes && "invalid opcode");
+	return opcode_names[opcode];
+}
+
+
+bool load_program_file(const char *fname, Program *program, std::string *error)
+{
+	std::ifstream stream(fname);
+	std::string path(fname);
+	std::size_t slash = path.rfind('/');
+
+	if (!stream) {
+		*error = "can't open program file '" + path + "'";
+		return false;
+	}
+
+	return load_program_stream(stream, slash == std::string::npos ? "" : path.substr(0, slash), program, error);
+}
+
+bool load_program_stream(std::istream &stream, const std::string &base_dir, Program *program, std::string *error)
+{
+	static const auto opcodes = std::unordered_map<std::string, ProgramOpcode> {
+		{ "load",   OpLoad   },
+		{ "const",  OpConst  },
+		{ "copy",   OpCopy   },
+		{ "run",    OpRun    },
+		{ "and",    OpAnd    },
+		{ "or",     OpOr     },
+		{ "xor",    OpXor    },
+		{ "not",    OpNot    },
+		{ "save",   OpSave   },
+		{ "repeat", OpRepeat },
+		{ "end",    OpEnd    },
+	};
+
+	// Number of operands, without the opcode; OpRepeatUntil has 2 or 3
+	static const std::size_t operand_counts[NumProgramOpcodes] = { 2, 4, 2, 5, 3, 3, 3, 2, 2, 1, 2, 0 };
+
+	std::unordered_map<std::string, std::ptrdiff_t> registers, templates;
+	std::vector<std::ptrdiff_t> open_loops;
+	std::string line;
+	std::size_t line_number = 0;
+
+	*program = Program();
+
+	auto fail = [&](const std::string &message) {
+		*error = "line " + std::to_string(line_number) + ": " + message;
+		return false;
+	};
+
+	auto resolve_path = [&](const std::string &file) {
+		return base_dir.empty() || file[0] == '/' ? file : base_dir + "/" + file;
+	};
+
+	auto parse_number = [](const std::string &word, double *value) {
+		char *end = nullptr;
+		*value = std::strtod(word.c_str(), &end);
+		return *end == '\0';
+	};
+
+	auto parse_count = [](const std::string &word, std::ptrdiff_t *value) {
+		char *end = nullptr;
+		*value = std::strtol(word.c_str(), &end, 10);
+		return *end == '\0' && *value > 0;
+	};
+
+	while (std::getline(stream, line)) {
+		std::istringstream words(line.substr(0, line.find('#')));
+		std::vector<std::string> operands;
+		std::string name, word;
+
+		line_number++;
+
+		if (!(words >> name)) {
+			continue;
+		}
+
+		while (words >> word) {
+			operands.push_back(word);
+		}
+
+		// Templates are named, just like registers, but they aren't instructions
+		if (name == "template") {
+			if (operands.size() != 2) {
+				return fail("expected 'template NAME FILE'");
+			}
+
+			if (templates.count(operands[0])) {
+				return fail("template '" + operands[0] + "' is already defined");
+			}
+
+			std::ifstream file(resolve_path(operands[1]));
+
+			if (!file) {
+				return fail("can't open template file '" + operands[1] + "'");
+			}
+
+			Template tem;
+			std::string template_error;
+
+			if (!parse_template_stream(file, &tem, &template_error)) {
+				return fail("template file '" + operands[1] + "': " + template_error);
+			}
+
+			templates[operands[0]] = program->templates.size();
+			program->template_names.push_back(operands[0]);
+			program->templates.push_back(tem);
+			continue;
+		}
+
+		auto it = opcodes.find(name);
+
+		if (it == opcodes.end()) {
+			return fail("unknown instruction '" + name + "'");
+		}
+
+		ProgramInstruction ins = {};
+		ins.opcode = it->second;
+		ins.dst = ins.src[0] = ins.src[1] = ins.tem = -1;
+		ins.line = line_number;
+
+		if (ins.opcode == OpRepeat && !operands.empty() && operands[0] == "until-stable") {
+			ins.opcode = OpRepeatUntil;
+		}
+
+		const std::size_t n_operands = operand_counts[ins.opcode];
+
+		if (operands.size() != n_operands && !(ins.opcode == OpRepeatUntil && operands.size() == n_operands + 1)) {
+			return fail("wrong number of operands for '" + name + "'");
+		}
+
+		// Registers come into existence when they are first written, and
+		// must be written before they are read. The bodies of loops run at
+		// least once, so the order of the source text is the order of writes.
+		auto read_register = [&](const std::string &reg, std::ptrdiff_t *index) {
+			auto found = registers.find(reg);
+
+			if (found == registers.end()) {
+				return fail("register '" + reg + "' is read before it is written");
+			}
+
+			*index = found->second;
+			return true;
+		};
+
+		auto write_register = [&](const std::string &reg) {
+			auto found = registers.find(reg);
+
+			if (found != registers.end()) {
+				return found->second;
+			}
+
+			std::ptrdiff_t index = program->registers.size();
+			registers[reg] = index;
+			program->registers.push_back(reg);
+			return index;
+		};
+
+		switch (ins.opcode) {
+		case OpLoad:
+			ins.file = resolve_path(operands[1]);
+			ins.dst = write_register(operands[0]);
+			break;
+
+		case OpConst: {
+			double width = 0, height = 0;
+
+			if (!parse_number(operands[1], &width) || !parse_number(operands[2], &height) || !parse_number(operands[3], &ins.value)) {
+				return fail("expected 'const REG WIDTH HEIGHT VALUE'");
+			}
+
+			ins.width = width;
+			ins.height = height;
+
+			if (ins.width <= 0 || ins.height <= 0 || ins.width != width || ins.height != height) {
+				return fail("invalid image size");
+			}
+
+			ins.dst = write_register(operands[0]);
+			break;
+		}
+
+		case OpRun: {
+			auto tem = templates.find(operands[1]);
+
+			if (tem == templates.end()) {
+				return fail("unknown template '" + operands[1] + "'");
+			}
+
+			if (!parse_number(operands[4], &ins.time) || !(ins.time >= 0)) {
+				return fail("invalid simulation time '" + operands[4] + "'");
+			}
+
+			ins.tem = tem->second;
+
+			if (!read_register(operands[2], &ins.src[0]) || !read_register(operands[3], &ins.src[1])) {
+				return false;
+			}
+
+			ins.dst = write_register(operands[0]);
+			break;
+		}
+
+		case OpAnd:
+		case OpOr:
+		case OpXor:
+			if (!read_register(operands[1], &ins.src[0]) || !read_register(operands[2], &ins.src[1])) {
+				return false;
+			}
+
+			ins.dst = write_register(operands[0]);
+			break;
+
+		case OpCopy:
+		case OpNot:
+			if (!read_register(operands[1], &ins.src[0])) {
+				return false;
+			}
+
+			ins.dst = write_register(operands[0]);
+			break;
+
+		case OpSave:
+			if (!read_register(operands[0], &ins.src[0])) {
+				return false;
+			}
+
+			ins.file = resolve_path(operands[1]);
+			break;
+
+		case OpRepeat:
+			if (!parse_count(operands[0], &ins.count)) {
+				return fail("the number of iterations must be a positive integer");
+			}
+
+			open_loops.push_back(program->instructions.size());
+			break;
+
+		case OpRepeatUntil:
+			if (!read_register(operands[1], &ins.dst)) {
+				return false;
+			}
+
+			if (operands.size() > 2 && !parse_count(operands[2], &ins.count)) {
+				return fail("the largest number of iterations must be a positive integer");
+			}
+
+			open_loops.push_back(program->instructions.size());
+			break;
+
+		case OpEnd:
+			if (open_loops.empty()) {
+				return fail("'end' without 'repeat'");
+			}
+
+			ins.jump = open_loops.back();
+			program->instructions[ins.jump].jump = program->instructions.size();
+			open_loops.pop_back();
+			break;
+
+		default:
+			assert(0 && "unhandled opcode");
+		}
+
+		program->instructions.push_back(ins);
+	}
+
+	if (!open_loops.empty()) {
+		line_number = program->instructions[open_loops.back()].line;
+		return fail("'repeat' without 'end'");
+	}
+
+	return true;
+}
+
+
+// Neither A nor B has any element besides its centre
+static bool is_pointwise(const Template &tem)
+{
+	return effective_radius(tem.A) == 1
+	    && effective_radius(tem.B) == 1
+	    && classify_stencil(&crop_coupling_mat(tem.A, 1)[0][0]) <= StencilCentre
+	    && classify_stencil(&crop_coupling_mat(tem.B, 1)[0][0]) <= StencilCentre;
+}
+
+template<typename T>
+BasicProgramRunner<T>::BasicProgramRunner(const Program &pprogram, const CNNOptions &poptions, bool fusion):
+	program(pprogram),
+	options(poptions),
+	registers(pprogram.registers.size(), BasicGrayscaleImage<T> { {}, 0, 0 }),
+	snapshots(pprogram.instructions.size(), BasicGrayscaleImage<T> { {}, 0, 0 }),
+	iterations(pprogram.instructions.size()),
+	statistics {},
+	pointwise_templates(pprogram.templates.size()),
+	fused_runs(pprogram.instructions.size())
+{
+	const StencilKernels<T> &kernels = get_stencil_kernels<T>(options.kernel_isa);
+	const std::vector<ProgramInstruction> &code = program.instructions;
+
+	if (!fusion || !options.closed_form || options.stop_when_steady) {
+		return;
+	}
+
+	for (std::size_t i = 0; i < program.templates.size(); i++) {
+		const Template &tem = program.templates[i];
+		PointwiseTemplate &pt = pointwise_templates[i];
+
+		pt.pointwise = is_pointwise(tem);
+
+		if (pt.pointwise) {
+			const CouplingMat A = crop_coupling_mat(tem.A, 1);
+			const CouplingMat B = crop_coupling_mat(tem.B, 1);
+
+			pt.self_feedback = A[1][1];
+			pt.feedforward_row = kernels.stencil_row[classify_stencil(&B[0][0])];
+			std::copy_n(&B[0][0], 9, pt.feedforward_coeffs);
+		}
+	}
+
+	// A group starts with any run, followed by pointwise runs, each of which
+	// reads the output of the one before it. A pointwise run on its own is
+	// a group, too: it needs no simulator, just a pass over the image.
+	for (std::size_t i = 0; i < code.size(); i++) {
+		if (code[i].opcode != OpRun) {
+			continue;
+		}
+
+		std::size_t end = i + 1;
+
+		while (
+			end < code.size()
+			&& code[end].opcode == OpRun
+			&& pointwise_templates[code[end].tem].pointwise
+			&& (code[end].src[0] == code[end - 1].dst || code[end].src[1] == code[end - 1].dst)
+		) {
+			end++;
+		}
+
+		if (end - i > 1 || pointwise_templates[code[i].tem].pointwise) {
+			fused_runs[i] = end - i;
+			std::fill(&fused_runs[i + 1], &fused_runs[end], -1);
+		}
+
+		i = end - 1;
+	}
+}
+
+template<typename T>
+bool BasicProgramRunner<T>::run(std::string *error)
+{
+	const std::vector<ProgramInstruction> &code = program.instructions;
+
+	statistics = ProgramStats {};
+
+	for (std::size_t pc = 0; pc < code.size(); pc++) {
+		const ProgramInstruction &ins = code[pc];
+
+		statistics.instructions++;
+
+		switch (ins.opcode) {
+		case OpRepeat:
+			iterations[pc] = 0;
+			break;
+
+		case OpRepeatUntil:
+			iterations[pc] = 0;
+			snapshots[pc] = registers[ins.dst]; // reuses the buffer of earlier runs
+			break;
+
+		case OpEnd: {
+			const ProgramInstruction &loop = code[ins.jump];
+			const std::ptrdiff_t done = ++iterations[ins.jump];
+			bool again = false;
+
+			statistics.loop_iterations++;
+
+			if (loop.opcode == OpRepeat) {
+				again = done < loop.count;
+			} else {
+				BasicGrayscaleImage<T> &before = snapshots[ins.jump];
+				const BasicGrayscaleImage<T> &after = registers[loop.dst];
+
+				// "Stable" means bit for bit: the body is deterministic, so
+				// once it maps the register to itself, it always will.
+				again = (loop.count == 0 || done < loop.count) && before.buf != after.buf;
+
+				if (again) {
+					before = after;
+				}
+			}
+
+			if (again) {
+				pc = ins.jump; // the body begins right after the repeat
+			}
+
+			break;
+		}
+
+		default: {
+			std::size_t failed = pc;
+			bool ok = true;
+
+			if (fused_runs[pc] > 0) {
+				ok = execute_fused(pc, &failed, error);
+			} else if (fused_runs[pc] == 0) {
+				ok = execute(ins, error);
+			}
+
+			if (!ok) {
+				*error = "line " + std::to_string(code[failed].line) + ": " + *error;
+				return false;
+			}
+		}
+		}
+	}
+
+	return true;
+}
+
+template<typename T>
+bool BasicProgramRunner<T>::execute(const ProgramInstruction &ins, std::string *error)
+{
+	BasicGrayscaleImage<T> *dst = ins.dst >= 0 ? &registers[ins.dst] : nullptr;
+	const BasicGrayscaleImage<T> *a = ins.src[0] >= 0 ? &registers[ins.src[0]] : nullptr;
+	const BasicGrayscaleImage<T> *b = ins.src[1] >= 0 ? &registers[ins.src[1]] : nullptr;
+
+	if (a && b && (a->width != b->width || a->height != b->height)) {
+		*error = "the images '" + program.registers[ins.src[0]] + "' and '" + program.registers[ins.src[1]] + "' are of different sizes";
+		return false;
+	}
+
+	// Pixel by pixel operations of two images, into 'dst'
+	auto pointwise = [&](auto op) {
+		dst->width = a->width;
+		dst->height = a->height;
+		dst->buf.resize(a->buf.size());
+		std::transform(a->buf.begin(), a->buf.end(), b->buf.begin(), dst->buf.begin(), op);
+	};
+
+	switch (ins.opcode) {
+	case OpLoad:
+		*dst = load_image_file<T>(ins.file.c_str());
+
+		if (dst->width == 0) {
+			*error = "can't read image '" + ins.file + "'";
+			return false;
+		}
+
+		break;
+
+	case OpConst:
+		dst->width = ins.width;
+		dst->height = ins.height;
+		dst->buf.assign(ins.width * ins.height, T(ins.value));
+		break;
+
+	case OpCopy:
+		if (dst != a) {
+			*dst = *a;
+		}
+
+		break;
+
+	case OpRun: {
+		const Template &tem = program.templates[ins.tem];
+		const std::ptrdiff_t halo = std::max(effective_radius(tem.A), effective_radius(tem.B));
+
+		if (a->width < halo || a->height < halo) {
+			*error = "the image '" + program.registers[ins.src[0]] + "' is smaller than the neighborhood of the template";
+			return false;
+		}
+
+		BasicCNN<T> &cnn = simulate(*a, *b, tem, ins.time);
+		cnn.extract_output(dst);
+
+		const CNNStats &run_stats = cnn.stats();
+		statistics.template_runs++;
+		statistics.closed_form_runs += run_stats.closed_form;
+		statistics.steps += run_stats.steps;
+		statistics.rhs_evaluations += run_stats.rhs_evaluations;
+		break;
+	}
+
+	// Logic on binary images, black (+1) being true. On gray levels,
+	// these are the usual fuzzy extensions: min, max and so on.
+	case OpAnd:
+		pointwise([](T p, T q) { return std::min(p, q); });
+		break;
+
+	case OpOr:
+		pointwise([](T p, T q) { return std::max(p, q); });
+		break;
+
+	case OpXor:
+		pointwise([](T p, T q) { return -p * q; });
+		break;
+
+	case OpNot:
+		dst->width = a->width;
+		dst->height = a->height;
+		dst->buf.resize(a->buf.size());
+		std::transform(a->buf.begin(), a->buf.end(), dst->buf.begin(), [](T p) { return -p; });
+		break;
+
+	case OpSave:
+		if (!save_image_file(ins.file.c_str(), *a)) {
+			*error = "can't write image '" + ins.file + "'";
+			return false;
+		}
+
+		break;
+
+	default:
+		assert(0 && "not a plain instruction");
+	}
+
+	return true;
+}
+
+// A group of runs found by the constructor, the first of which is at 'pc'
+template<typename T>
+bool BasicProgramRunner<T>::execute_fused(std::size_t pc, std::size_t *failed, std::string *error)
+{
+	const ProgramInstruction *group = &program.instructions[pc];
+	const std::ptrdiff_t n_runs = fused_runs[pc];
+	const BasicGrayscaleImage<T> &state = registers[group[0].src[0]];
+	const BasicGrayscaleImage<T> &input = registers[group[0].src[1]];
+	const std::ptrdiff_t width = state.width;
+	const std::ptrdiff_t height = state.height;
+	const BasicCNN<T> *cnn = nullptr;
+
+	if (input.width != width || input.height != height) {
+		*error = "the images '" + program.registers[group[0].src[0]] + "' and '" + program.registers[group[0].src[1]] + "' are of different sizes";
+		return false;
+	}
+
+	// Every image read in the group is either written by an earlier run
+	// of it, or it's an image of the same size as the first one
+	for (std::ptrdiff_t j = 1; j < n_runs; j++) {
+		for (std::ptrdiff_t src : group[j].src) {
+			const BasicGrayscaleImage<T> &img = registers[src];
+			bool written = false;
+
+			for (std::ptrdiff_t i = 0; i < j; i++) {
+				written = written || group[i].dst == src;
+			}
+
+			if (!written && (img.width != width || img.height != height)) {
+				*failed = pc + j;
+				*error = "the image '" + program.registers[src] + "' is of a different size than the output of the previous run";
+				return false;
+			}
+		}
+	}
+
+	// The first run may need a simulation, of which only the output is fused
+	if (!pointwise_templates[group[0].tem].pointwise) {
+		const Template &tem = program.templates[group[0].tem];
+		const std::ptrdiff_t halo = std::max(effective_radius(tem.A), effective_radius(tem.B));
+
+		if (width < halo || height < halo) {
+			*error = "the image '" + program.registers[group[0].src[0]] + "' is smaller than the neighborhood of the template";
+			return false;
+		}
+
+		cnn = &simulate(state, input, tem, group[0].time);
+
+		const CNNStats &run_stats = cnn->stats();
+		statistics.closed_form_runs += run_stats.closed_form;
+		statistics.steps += run_stats.steps;
+		statistics.rhs_evaluations += run_stats.rhs_evaluations;
+	} else {
+		statistics.closed_form_runs++;
+		statistics.steps++;
+	}
+
+	statistics.template_runs += n_runs;
+	statistics.closed_form_runs += n_runs - 1;
+	statistics.fused_runs += n_runs - 1;
+
+	for (std::ptrdiff_t j = 0; j < n_runs; j++) {
+		BasicGrayscaleImage<T> &dst = registers[group[j].dst];
+		dst.width = width;
+		dst.height = height;
+		dst.buf.resize(width * height);
+	}
+
+	// Row by row, every run of the group in order. Rows of the same register
+	// may be read and written by the same run; being pointwise, that's fine.
+	auto evaluate_rows = [&](std::ptrdiff_t r_begin, std::ptrdiff_t r_end, std::ptrdiff_t k) {
+		T *RESTRICT FF = &feedforward_rows[k * width];
+
+		for (std::ptrdiff_t r = r_begin; r < r_end; r++) {
+			const std::ptrdiff_t offset = to_index(r, 0, width);
+
+			for (std::ptrdiff_t j = 0; j < n_runs; j++) {
+				const ProgramInstruction &ins = group[j];
+				T *out = registers[ins.dst].buf.data() + offset;
+
+				if (j == 0 && cnn) {
+					const T *x = cnn->state().data() + offset;
+					std::transform(x, x + width, out, BasicCNN<T>::y);
+					continue;
+				}
+
+				const PointwiseTemplate &pt = pointwise_templates[ins.tem];
+				const T *x = registers[ins.src[0]].buf.data() + offset;
+				const T *u = registers[ins.src[1]].buf.data() + offset;
+
+				std::fill_n(FF, width, T(program.templates[ins.tem].Z));
+				pt.feedforward_row(FF, u, u, u, pt.feedforward_coeffs, width);
+
+				uncoupled_cell_states(x, FF, out, width, pt.self_feedback, ins.time);
+				std::transform(out, out + width, out, BasicCNN<T>::y);
+			}
+		}
+	};
+
+	if (width * height < options.parallel_threshold) {
+		feedforward_rows.resize(std::max<std::size_t>(feedforward_rows.size(), width));
+		evaluate_rows(0, height, 0);
+	} else {
+		if (!pool) {
+			pool.reset(new ThreadPool(options.threads, options.first_cpu));
+		}
+
+		feedforward_rows.resize(std::max<std::size_t>(feedforward_rows.size(), width * pool->size()));
+		pool->parallel_for(height, evaluate_rows);
+	}
+
+	return true;
+}
+
+// Every run reuses the same simulator, so that runs of the same size don't
+// allocate, and repeated runs with the same input and template don't even
+// compute its feed-forward image again
+template<typename T>
+BasicCNN<T> &BasicProgramRunner<T>::simulate(
+	const BasicGrayscaleImage<T> &state,
+	const BasicGrayscaleImage<T> &input,
+	const Template &tem,
+	double time
+)
+{
+	if (cnn) {
+		cnn->reset(state.width, state.height, state.buf, input.buf, tem, time);
+	} else {
+		cnn.reset(new BasicCNN<T>(state.width, state.height, state.buf, input.buf, tem, time, options));
+	}
+
+	cnn->run();
+	return *cnn;
+}
+
+template<typename T>
+const ProgramStats &BasicProgramRunner<T>::stats() const
+{
+	return statistics;
+}
+
+template<typename T>
+const BasicGrayscaleImage<T> *BasicProgramRunner<T>::image(const std::string &name) const
+{
+	auto it = std::find(program.registers.begin(), program.registers.end(), name);
+	return it == program.registers.end() ? nullptr : &registers[it - program.registers.begin()];
+}
+
+
+// Explicit instantiations for single and double precision
+template struct BasicProgramRunner<float>;
+template struct BasicProgramRunner<double>;
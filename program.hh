@@ -0,0 +1,153 @@
+//
+// program.hh
+// CNNSim, a simple CNN simulator
+//
+// Licensed under the 2-clause BSD License
+//
+
+#ifndef CNNSIM_PROGRAM_HH
+#define CNNSIM_PROGRAM_HH
+
+#include <cstddef>
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <istream>
+
+#include "template.hh"
+#include "imgproc.hh"
+#include "CNN.hh"
+#include "kernels.hh"
+#include "threadpool.hh"
+
+
+// Programs of the CNN Universal Machine: sequences of template runs and
+// logic operations on named images ("registers"), which stay in memory
+// for the whole program. See the README for the language itself.
+enum ProgramOpcode {
+	OpLoad,        // load REG FILE
+	OpConst,       // const REG WIDTH HEIGHT VALUE
+	OpCopy,        // copy DST SRC
+	OpRun,         // run DST TEMPLATE STATE INPUT TIME
+	OpAnd,         // and DST SRC1 SRC2
+	OpOr,          // or DST SRC1 SRC2
+	OpXor,         // xor DST SRC1 SRC2
+	OpNot,         // not DST SRC
+	OpSave,        // save REG FILE
+	OpRepeat,      // repeat COUNT
+	OpRepeatUntil, // repeat until-stable REG [MAX]
+	OpEnd,         // end of the innermost repeat
+	NumProgramOpcodes
+};
+
+struct ProgramInstruction {
+	ProgramOpcode opcode;
+	std::ptrdiff_t dst;      // register written, or compared by OpRepeatUntil
+	std::ptrdiff_t src[2];   // registers read; the state and the input of OpRun
+	std::ptrdiff_t tem;      // OpRun: index into Program::templates
+	double time;             // OpRun: simulation time
+	std::ptrdiff_t width;    // OpConst
+	std::ptrdiff_t height;   // ditto
+	double value;            // ditto
+	std::ptrdiff_t count;    // OpRepeat: iterations; OpRepeatUntil: at most this many, 0 if unlimited
+	std::ptrdiff_t jump;     // OpRepeat(Until): index of its OpEnd; OpEnd: index of its repeat
+	std::string file;        // OpLoad, OpSave: relative to the program file
+	std::size_t line;        // in the program file, for error messages
+};
+
+struct Program {
+	std::vector<std::string> registers;      // names, indexed by ProgramInstruction::dst and src
+	std::vector<std::string> template_names; // ditto, by ProgramInstruction::tem
+	std::vector<Template> templates;
+	std::vector<ProgramInstruction> instructions;
+};
+
+// Return false and describe the first error in 'error' if the program is
+// invalid. Relative file names of the program are relative to 'base_dir',
+// which is the directory of the program file for load_program_file().
+bool load_program_file(const char *fname, Program *program, std::string *error);
+bool load_program_stream(std::istream &stream, const std::string &base_dir, Program *program, std::string *error);
+
+const char *program_opcode_name(ProgramOpcode opcode);
+
+// Work counters of a program run, the simulations summed up
+struct ProgramStats {
+	std::size_t instructions;     // executed, including each iteration of loops
+	std::size_t template_runs;    // of which were OpRun
+	std::size_t closed_form_runs; // of which were solved in closed form
+	std::size_t fused_runs;       // of which were folded into the preceding run
+	std::size_t loop_iterations;
+	std::size_t steps;            // as in CNNStats
+	std::size_t rhs_evaluations;  // ditto
+};
+
+// Executes programs in one process, with the images in memory. Registers
+// keep their buffers between instructions and between runs of programs.
+// Every template run uses the same CNNOptions.
+//
+// With fusion, templates without coupling in either A or B ("pointwise"
+// ones, like the logic templates) are not simulated one by one. The output
+// of such a template only depends on the same pixel of its state and input,
+// and it is solved in closed form. So if it reads the output of the run right
+// before it, it is folded into the output stage of that run: a single pass
+// over the image computes the output of the first run, and then the whole
+// chain of pointwise templates after it, pixel by pixel. The results are the
+// same as without fusion, bit for bit, which is why fusion is only done if
+// uncoupled templates are solved in closed form anyway, and not stopped early.
+template<typename T>
+struct BasicProgramRunner {
+public:
+	typedef T Scalar;
+
+private:
+	// Per template: whether it is pointwise, and if so, the centre of A,
+	// and how its feed-forward image is computed, the same way as BasicCNN does
+	struct PointwiseTemplate {
+		bool pointwise;
+		double self_feedback;
+		StencilRowFn<T> feedforward_row;
+		T feedforward_coeffs[9];
+	};
+
+	const Program &program;
+	CNNOptions options;
+	std::vector<BasicGrayscaleImage<T>> registers;
+	std::vector<BasicGrayscaleImage<T>> snapshots; // per OpRepeatUntil: its register before the iteration
+	std::vector<std::ptrdiff_t> iterations;        // per repeat: iterations so far
+	ProgramStats statistics;
+
+	// Fusion: per instruction, the number of runs evaluated together in a
+	// single pass, starting with it; -1 for those after the first one of
+	// such a group, and 0 for everything else
+	std::vector<PointwiseTemplate> pointwise_templates;
+	std::vector<std::ptrdiff_t> fused_runs;
+	std::unique_ptr<ThreadPool> pool; // created for the first large image
+	std::vector<T> feedforward_rows;  // per thread
+
+	std::unique_ptr<BasicCNN<T>> cnn; // created by the first run, and reset for the rest
+
+	bool execute(const ProgramInstruction &ins, std::string *error);
+	BasicCNN<T> &simulate(const BasicGrayscaleImage<T> &state, const BasicGrayscaleImage<T> &input, const Template &tem, double time);
+	bool execute_fused(std::size_t pc, std::size_t *failed, std::string *error);
+
+public:
+	BasicProgramRunner(const Program &pprogram, const CNNOptions &poptions, bool fusion = true);
+
+	BasicProgramRunner(const BasicProgramRunner &) = delete;
+	BasicProgramRunner &operator=(const BasicProgramRunner &) = delete;
+
+	// Returns false and describes the error (with its line) if an instruction
+	// fails: a file can't be read or written, or the sizes of images differ.
+	bool run(std::string *error);
+
+	const ProgramStats &stats() const;
+
+	// The contents of a register after run(), or nullptr if there is no such register
+	const BasicGrayscaleImage<T> *image(const std::string &name) const;
+};
+
+typedef BasicProgramRunner<double> ProgramRunner;
+typedef BasicProgramRunner<float> FloatProgramRunner;
+
+#endif // CNNSIM_PROGRAM_HH
@@ -0,0 +1,658 @@
+//
+// server.cc
+// CNNSim, a simple CNN simulator
+//
+// Licensed under the 2-clause BSD License
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <csignal>
+#include <cerrno>
+#include <cmath>
+
+#include <deque>
+#include <memory>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <sstream>
+#include <unordered_map>
+
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <gsl/gsl_errno.h>
+
+#include "server.hh"
+
+
+ServerOptions::ServerOptions():
+	workers(0),
+	queue_size(0),
+	cache_size(64)
+{
+}
+
+
+SocketReader::SocketReader(int pfd):
+	fd(pfd),
+	begin(0),
+	end(0)
+{
+}
+
+bool SocketReader::fill()
+{
+	ssize_t n;
+
+	do {
+		n = ::read(fd, buf, sizeof buf);
+	} while (n < 0 && errno == EINTR);
+
+	begin = 0;
+	end = n > 0 ? n : 0;
+
+	return n > 0;
+}
+
+bool SocketReader::read_line(std::string *line)
+{
+	line->clear();
+
+	for (;;) {
+		if (begin == end && !fill()) {
+			return false;
+		}
+
+		const char *newline = static_cast<const char *>(std::memchr(buf + begin, '\n', end - begin));
+		const std::size_t n = newline ? newline - (buf + begin) : end - begin;
+
+		if (line->size() + n > MaxLineLength) {
+			return false;
+		}
+
+		line->append(buf + begin, n);
+		begin += n;
+
+		if (newline) {
+			begin++;
+			return true;
+		}
+	}
+}
+
+bool SocketReader::read_bytes(void *data, std::size_t size)
+{
+	char *out = static_cast<char *>(data);
+
+	while (size > 0) {
+		if (begin == end && !fill()) {
+			return false;
+		}
+
+		const std::size_t n = std::min(size, end - begin);
+
+		std::memcpy(out, buf + begin, n);
+		begin += n;
+		out += n;
+		size -= n;
+	}
+
+	return true;
+}
+
+bool write_all(int fd, const void *data, std::size_t size)
+{
+	const char *p = static_cast<const char *>(data);
+
+	while (size > 0) {
+		ssize_t n = ::send(fd, p, size, MSG_NOSIGNAL);
+
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (n <= 0) {
+			return false;
+		}
+
+		p += n;
+		size -= n;
+	}
+
+	return true;
+}
+
+static bool make_unix_address(const char *socket_path, sockaddr_un *addr)
+{
+	std::memset(addr, 0, sizeof *addr);
+	addr->sun_family = AF_UNIX;
+
+	if (std::strlen(socket_path) >= sizeof addr->sun_path) {
+		return false;
+	}
+
+	std::strcpy(addr->sun_path, socket_path);
+	return true;
+}
+
+int connect_unix_socket(const char *socket_path)
+{
+	sockaddr_un addr;
+	int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+
+	if (fd < 0) {
+		return -1;
+	}
+
+	if (!make_unix_address(socket_path, &addr) || ::connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof addr) != 0) {
+		::close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+
+namespace {
+
+// Limits of what a client may ask for: anything larger is a malformed
+// request, rather than a job the server would run out of memory for
+const std::size_t MaxTemplateSize = 1 << 16;   // bytes of the template file
+const long MaxImageSide = 1 << 16;             // width and height, in pixels
+const long MaxImageCells = 1 << 26;            // width * height
+
+// Checks the size of an image sent by a client, before anything is allocated
+bool valid_image_size(long width, long height)
+{
+	return width > 0 && height > 0
+	    && width <= MaxImageSide && height <= MaxImageSide
+	    && width * height <= MaxImageCells;
+}
+
+// Replies to the jobs of a connection are written by the workers, and the
+// socket is closed once neither the reader nor any job refers to it any more
+struct Connection {
+	int fd;
+	std::mutex write_mutex;
+
+	explicit Connection(int pfd): fd(pfd) {}
+	~Connection() { ::close(fd); }
+
+	bool reply(const std::string &header, const void *data = nullptr, std::size_t size = 0)
+	{
+		std::lock_guard<std::mutex> lock(write_mutex);
+		return write_all(fd, header.data(), header.size()) && write_all(fd, data, size);
+	}
+};
+
+template<typename T>
+struct Job {
+	std::shared_ptr<Connection> connection;
+	std::string id;
+	std::shared_ptr<const Template> tem;
+	std::shared_ptr<const BasicGrayscaleImage<T>> state;
+	std::shared_ptr<const BasicGrayscaleImage<T>> input;
+	double t_max;
+	CNNOptions options;
+};
+
+// A decoded image file, and the modification time it had then
+template<typename T>
+struct CachedImage {
+	std::shared_ptr<const BasicGrayscaleImage<T>> image;
+	struct timespec mtime;
+	off_t size;
+};
+
+template<typename T>
+struct Server {
+public:
+	Server(const ServerOptions &server_options, const CNNOptions &poptions);
+
+	void serve_connection(std::shared_ptr<Connection> connection);
+	void work();
+
+private:
+	const CNNOptions options;
+	const std::size_t queue_size;
+	const std::size_t cache_size;
+
+	// Jobs waiting for a worker: readers wait for room, workers for jobs
+	std::mutex queue_mutex;
+	std::condition_variable queue_not_empty;
+	std::condition_variable queue_not_full;
+	std::deque<Job<T>> queue;
+
+	// Parsed templates, by their text, and decoded image files, by their path
+	std::mutex cache_mutex;
+	std::unordered_map<std::string, std::shared_ptr<const Template>> templates;
+	std::unordered_map<std::string, CachedImage<T>> images;
+
+	bool read_image(SocketReader &reader, const std::string &spec, std::shared_ptr<const BasicGrayscaleImage<T>> *image, std::string *error);
+	std::shared_ptr<const BasicGrayscaleImage<T>> load_image(const std::string &path);
+	std::shared_ptr<const Template> parse_template(const std::string &text, std::string *error);
+};
+
+template<typename T>
+Server<T>::Server(const ServerOptions &server_options, const CNNOptions &poptions):
+	options(poptions),
+	queue_size(server_options.queue_size),
+	cache_size(server_options.cache_size)
+{
+}
+
+template<typename T>
+std::shared_ptr<const Template> Server<T>::parse_template(const std::string &text, std::string *error)
+{
+	std::lock_guard<std::mutex> lock(cache_mutex);
+	auto it = templates.find(text);
+
+	if (it != templates.end()) {
+		return it->second;
+	}
+
+	std::istringstream stream(text);
+	auto tem = std::make_shared<Template>();
+
+	if (!parse_template_stream(stream, tem.get(), error)) {
+		return nullptr;
+	}
+
+	if (templates.size() >= cache_size) {
+		templates.clear();
+	}
+
+	templates[text] = tem;
+	return tem;
+}
+
+template<typename T>
+std::shared_ptr<const BasicGrayscaleImage<T>> Server<T>::load_image(const std::string &path)
+{
+	struct stat st;
+
+	if (::stat(path.c_str(), &st) != 0) {
+		return nullptr;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(cache_mutex);
+		auto it = images.find(path);
+
+		if (
+			it != images.end()
+			&& it->second.size == st.st_size
+			&& it->second.mtime.tv_sec == st.st_mtim.tv_sec
+			&& it->second.mtime.tv_nsec == st.st_mtim.tv_nsec
+		) {
+			return it->second.image;
+		}
+	}
+
+	// Decoded without holding the lock; if two readers race for the
+	// same file, both decode it, and the last one ends up in the cache
+	auto image = std::make_shared<BasicGrayscaleImage<T>>(load_image_file<T>(path.c_str()));
+
+	if (image->width == 0) {
+		return nullptr;
+	}
+
+	std::lock_guard<std::mutex> lock(cache_mutex);
+
+	if (images.size() >= cache_size) {
+		images.clear();
+	}
+
+	images[path] = CachedImage<T> { image, st.st_mtim, st.st_size };
+	return image;
+}
+
+template<typename T>
+bool Server<T>::read_image(SocketReader &reader, const std::string &spec, std::shared_ptr<const BasicGrayscaleImage<T>> *image, std::string *error)
+{
+	long width = 0, height = 0;
+	double value = 0;
+	char tail = 0;
+
+	if (spec.compare(0, 4, "raw ") == 0) {
+		if (std::sscanf(spec.c_str() + 4, "%ld %ld %c", &width, &height, &tail) != 2 || !valid_image_size(width, height)) {
+			*error = "invalid raw image size";
+			return false;
+		}
+
+		auto img = std::make_shared<BasicGrayscaleImage<T>>();
+		std::vector<double> pixels(width * height);
+
+		if (!reader.read_bytes(pixels.data(), pixels.size() * sizeof pixels[0])) {
+			*error = "truncated raw image";
+			return false;
+		}
+
+		img->width = width;
+		img->height = height;
+		img->buf.assign(pixels.begin(), pixels.end());
+		*image = img;
+	} else if (spec[0] == '@') {
+		if (std::sscanf(spec.c_str() + 1, "%ld %ld %lf %c", &width, &height, &value, &tail) != 3 || !valid_image_size(width, height)) {
+			*error = "invalid constant image";
+			return false;
+		}
+
+		auto img = std::make_shared<BasicGrayscaleImage<T>>();
+		img->width = width;
+		img->height = height;
+		img->buf.assign(width * height, T(value));
+		*image = img;
+	} else {
+		*image = load_image(spec);
+	}
+
+	// Only a missing file is the fault of the job, not of the request
+	return true;
+}
+
+// Reads the jobs of a connection, and queues them
+template<typename T>
+void Server<T>::serve_connection(std::shared_ptr<Connection> connection)
+{
+	SocketReader reader(connection->fd);
+	std::string line;
+
+	auto protocol_error = [&](const std::string &message) {
+		connection->reply("error - " + message + "\n");
+		::shutdown(connection->fd, SHUT_RD);
+	};
+
+	while (reader.read_line(&line)) {
+		Job<T> job;
+		std::string spec[2];
+		std::string error;
+		bool ok = true;
+
+		if (line.compare(0, 4, "job ") != 0) {
+			return protocol_error("expected 'job ID'");
+		}
+
+		job.connection = connection;
+		job.id = line.substr(4);
+		job.t_max = -1;
+		job.options = options;
+
+		while (reader.read_line(&line) && line != "run") {
+			const std::size_t space = line.find(' ');
+			const std::string key = line.substr(0, space);
+			const std::string value = space == std::string::npos ? "" : line.substr(space + 1);
+			char *end = nullptr;
+
+			if (key == "template") {
+				const unsigned long size = std::strtoul(value.c_str(), &end, 10);
+
+				if (value.empty() || value[0] == '-' || *end != '\0' || size > MaxTemplateSize) {
+					return protocol_error("invalid template size");
+				}
+
+				std::string text(size, '\0');
+
+				if (!reader.read_bytes(&text[0], text.size())) {
+					return protocol_error("truncated template");
+				}
+
+				job.tem = parse_template(text, &error);
+				ok = ok && job.tem;
+			} else if (key == "state" || key == "input") {
+				auto &image = key == "state" ? job.state : job.input;
+
+				if (value.empty() || !read_image(reader, value, &image, &error)) {
+					return protocol_error(error.empty() ? "missing image" : error);
+				}
+
+				if (!image && ok) {
+					error = "can't read image '" + value + "'";
+					ok = false;
+				}
+			} else if (key == "duration") {
+				job.t_max = std::strtod(value.c_str(), &end);
+
+				if (!(job.t_max >= 0 && std::isfinite(job.t_max)) && ok) {
+					error = "invalid duration '" + value + "'";
+					ok = false;
+				}
+			} else if (key == "rel-tol" || key == "abs-tol") {
+				// GSL can't even set up its step size control without these
+				double &tol = key == "rel-tol" ? job.options.rel_tol : job.options.abs_tol;
+				tol = std::strtod(value.c_str(), &end);
+
+				if (!(tol > 0 && std::isfinite(tol)) && ok) {
+					error = "invalid tolerance '" + value + "'";
+					ok = false;
+				}
+			} else if (key == "method") {
+				job.options.method = integration_method_from_name(value.c_str());
+
+				if (job.options.method == NumIntegrationMethods && ok) {
+					error = "unknown integration method '" + value + "'";
+					ok = false;
+				}
+
+				end = nullptr;
+			} else {
+				return protocol_error("unknown key '" + key + "'");
+			}
+
+			if (end && (*end != '\0' || value.empty())) {
+				return protocol_error("invalid number '" + value + "'");
+			}
+		}
+
+		if (line != "run") {
+			return; // connection closed in the middle of a job
+		}
+
+		if (ok && (!job.tem || !job.state || !job.input || job.t_max < 0)) {
+			error = "a job needs a template, a state, an input and a duration";
+			ok = false;
+		}
+
+		if (ok && (job.state->width != job.input->width || job.state->height != job.input->height)) {
+			error = "the state and the input are of different sizes";
+			ok = false;
+		}
+
+		if (ok) {
+			const std::ptrdiff_t halo = std::max(effective_radius(job.tem->A), effective_radius(job.tem->B));
+
+			if (job.state->width < halo || job.state->height < halo) {
+				error = "the image is smaller than the neighborhood of the template";
+				ok = false;
+			}
+		}
+
+		if (!ok) {
+			connection->reply("error " + job.id + " " + error + "\n");
+			continue;
+		}
+
+		// Backpressure: this connection isn't read while the queue is full
+		std::unique_lock<std::mutex> lock(queue_mutex);
+		queue_not_full.wait(lock, [&] { return queue.size() < queue_size; });
+		queue.push_back(std::move(job));
+		lock.unlock();
+		queue_not_empty.notify_one();
+	}
+}
+
+// Whether a simulator made with options 'a' can be reset for a job with
+// options 'b'; jobs can only change these
+bool same_job_options(const CNNOptions &a, const CNNOptions &b)
+{
+	return a.rel_tol == b.rel_tol && a.abs_tol == b.abs_tol && a.method == b.method;
+}
+
+// A worker: simulates jobs, one at a time. The simulator, the output image
+// and the reply buffer are reused from one job to the next, as long as the
+// jobs have the same options.
+template<typename T>
+void Server<T>::work()
+{
+	std::unique_ptr<BasicCNN<T>> cnn;
+	CNNOptions cnn_options;
+	BasicGrayscaleImage<T> output;
+	std::vector<double> pixels;
+	char header[256];
+
+	for (;;) {
+		std::unique_lock<std::mutex> lock(queue_mutex);
+		queue_not_empty.wait(lock, [&] { return !queue.empty(); });
+		Job<T> job = std::move(queue.front());
+		queue.pop_front();
+		lock.unlock();
+		queue_not_full.notify_one();
+
+		auto t0 = std::chrono::steady_clock::now();
+
+		// A job that fails, e.g. for lack of memory, only fails itself;
+		// the simulator is made anew for the next one, just in case
+		try {
+			if (cnn && same_job_options(cnn_options, job.options)) {
+				cnn->reset(job.state->width, job.state->height, job.state->buf, job.input->buf, *job.tem, job.t_max);
+			} else {
+				cnn.reset();
+				cnn.reset(new BasicCNN<T>(job.state->width, job.state->height, job.state->buf, job.input->buf, *job.tem, job.t_max, job.options));
+				cnn_options = job.options;
+			}
+
+			cnn->run();
+			cnn->extract_output(&output);
+			pixels.assign(output.buf.begin(), output.buf.end());
+		} catch (const std::exception &e) {
+			cnn.reset();
+			job.connection->reply("error " + job.id + " " + e.what() + "\n");
+			continue;
+		}
+
+		auto t1 = std::chrono::steady_clock::now();
+
+		std::snprintf(
+			header, sizeof header, " %td %td %.6f\n",
+			output.width,
+			output.height,
+			std::chrono::duration<double>(t1 - t0).count()
+		);
+
+		// A client that went away doesn't concern the other jobs
+		job.connection->reply("done " + job.id + header, pixels.data(), pixels.size() * sizeof pixels[0]);
+	}
+}
+
+std::string server_socket_path;
+
+void remove_socket_and_exit(int)
+{
+	::unlink(server_socket_path.c_str());
+	::_exit(0);
+}
+
+} // namespace
+
+
+template<typename T>
+bool serve(const char *socket_path, const ServerOptions &server_options, const CNNOptions &options)
+{
+	ServerOptions resolved = server_options;
+	sockaddr_un addr;
+	struct stat st;
+
+	if (resolved.workers == 0) {
+		resolved.workers = ThreadPool::hardware_threads();
+	}
+
+	if (resolved.queue_size == 0) {
+		resolved.queue_size = 2 * resolved.workers;
+	}
+
+	int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+
+	if (fd < 0 || !make_unix_address(socket_path, &addr)) {
+		return false;
+	}
+
+	// A socket left behind by a previous server is replaced, anything else isn't
+	if (::lstat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		::unlink(socket_path);
+	}
+
+	if (::bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof addr) != 0 || ::listen(fd, 64) != 0) {
+		::close(fd);
+		return false;
+	}
+
+	server_socket_path = socket_path;
+	std::signal(SIGINT, remove_socket_and_exit);
+	std::signal(SIGTERM, remove_socket_and_exit);
+
+	// GSL's default error handler aborts, which would take every job down
+	// with the one that failed; its return codes are checked instead
+	gsl_set_error_handler_off();
+
+	// Jobs run side by side, so their threads are left to the scheduler
+	CNNOptions job_options = options;
+	job_options.first_cpu = -1;
+
+	Server<T> server(resolved, job_options);
+
+	for (std::ptrdiff_t i = 0; i < resolved.workers; i++) {
+		std::thread([&server] { server.work(); }).detach();
+	}
+
+	std::printf("Listening on %s, with %td worker(s)\n", socket_path, resolved.workers);
+	std::fflush(stdout);
+
+	for (;;) {
+		int client = ::accept(fd, nullptr, nullptr);
+
+		if (client < 0) {
+			// Out of file descriptors or memory: the pending connection
+			// would fail again right away, so wait for others to close
+			if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(100));
+				continue;
+			}
+
+			// Only that connection failed
+			if (errno == EINTR || errno == ECONNABORTED || errno == EPROTO) {
+				continue;
+			}
+
+			// Anything else means the socket itself is unusable. Workers
+			// may still be running jobs, so don't return into destructors.
+			std::fprintf(stderr, "Can't accept connections on '%s': %s\n", socket_path, std::strerror(errno));
+			::unlink(socket_path);
+			::_exit(1);
+		}
+
+		auto connection = std::make_shared<Connection>(client);
+
+		// Not even a malformed request that runs the server out of memory
+		// concerns the other connections
+		std::thread([&server, connection] {
+			try {
+				server.serve_connection(connection);
+			} catch (const std::exception &e) {
+				connection->reply(std::string("error - ") + e.what() + "\n");
+				::shutdown(connection->fd, SHUT_RD);
+			}
+		}).detach();
+	}
+}
+
+
+// Explicit instantiations for single and double precision
+template bool serve<float>(const char *socket_path, const ServerOptions &server_options, const CNNOptions &options);
+template bool serve<double>(const char *socket_path, const ServerOptions &server_options, const CNNOptions &options);
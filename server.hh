@@ -0,0 +1,95 @@
+//
+// server.hh
+// CNNSim, a simple CNN simulator
+//
+// Licensed under the 2-clause BSD License
+//
+
+#ifndef CNNSIM_SERVER_HH
+#define CNNSIM_SERVER_HH
+
+#include <cstddef>
+
+#include <string>
+
+#include "CNN.hh"
+
+
+// A simulation server, listening on a Unix domain socket. Clients send jobs,
+// which are simulated by a pool of workers, and get the outputs back on the
+// same connection, without anything being written to disk. Templates and
+// images read from files are cached, so that a file used by many jobs is only
+// parsed or decoded once (or again, when it changes).
+//
+// The protocol is line-based text, except for the pixels of images, which
+// are sent as 'double's in the byte order of the machine. A job is:
+//
+//     job ID
+//     template SIZE          followed by SIZE bytes: the template file itself
+//     state IMAGE
+//     input IMAGE
+//     duration T
+//     rel-tol X              optional, like the options of the same name
+//     abs-tol X              optional
+//     method NAME            optional
+//     run
+//
+// where IMAGE is the path of an image file (absolute, since the server has a
+// working directory of its own), "@W H VALUE" for a constant image, or
+// "raw W H" followed by the W * H pixels, row by row. The reply to each job,
+// in the order in which they finish, is
+//
+//     done ID W H SECONDS    followed by the W * H pixels of the output
+//
+// or "error ID MESSAGE", if the job couldn't be run, e.g. because the
+// duration is negative, or a tolerance is not positive. A client may send any
+// number of jobs without waiting for the replies. Only 'queue_size' jobs
+// wait for a worker at once, though; beyond that, the server stops reading
+// from the connection until there is room again (backpressure). Malformed
+// requests are answered with "error - MESSAGE", and the connection is closed.
+// So are templates over 64 KiB, images sent with a side over 65536 pixels or
+// over 2^26 pixels in all, and lines over SocketReader::MaxLineLength.
+struct ServerOptions {
+	std::ptrdiff_t workers;     // 0 means one per CPU
+	std::ptrdiff_t queue_size;  // 0 means twice the number of workers
+	std::ptrdiff_t cache_size;  // images decoded from files kept in memory
+
+	ServerOptions(); // defaults
+};
+
+// Serves until the process is terminated, or exits if the socket fails for
+// good. Returns false if it can't listen on 'socket_path'. Every job is
+// simulated with 'options', overridden by the tolerances and the method of
+// the job, if any. Instantiated for T = float and T = double, which is the
+// precision of the simulation, not that of the protocol.
+template<typename T>
+bool serve(const char *socket_path, const ServerOptions &server_options, const CNNOptions &options);
+
+// Buffered reading from a socket, for both ends of a connection
+struct SocketReader {
+public:
+	explicit SocketReader(int pfd);
+
+	// Without the newline. Returns false at the end of the stream, and
+	// for lines longer than MaxLineLength, which no valid message has.
+	static const std::size_t MaxLineLength = 1 << 12;
+
+	bool read_line(std::string *line);
+	bool read_bytes(void *data, std::size_t size);
+
+private:
+	int fd;
+	char buf[1 << 16];
+	std::size_t begin;
+	std::size_t end;
+
+	bool fill();
+};
+
+// Returns false if the connection is closed or broken
+bool write_all(int fd, const void *data, std::size_t size);
+
+// A connected socket, or -1 on failure
+int connect_unix_socket(const char *socket_path);
+
+#endif // CNNSIM_SERVER_HH
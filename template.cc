@@ -7,12 +7,23 @@
 // Licensed under the 2-clause BSD License
 //
 
+#include <cmath>
+#include <cstdlib>
 #include <cassert>
+#include <algorithm>
 #include <unordered_map>
 
 #include "template.hh"
 
 
+CouplingMat::CouplingMat(std::ptrdiff_t pradius):
+	radius(pradius),
+	coeffs {}
+{
+	assert(1 <= radius && radius <= MaxTemplateRadius && "invalid template radius");
+}
+
+
 Template load_template_file(const char *fname)
 {
 	std::ifstream stream(fname);
@@ -30,10 +41,22 @@ Template load_template_stdio(std::FILE *handle)
 }
 
 Template load_template_stream(std::istream &stream)
+{
+	Template tem;
+	std::string error;
+	bool ok = parse_template_stream(stream, &tem, &error);
+
+	assert(ok && "invalid template");
+	(void)ok;
+
+	return tem;
+}
+
+bool parse_template_stream(std::istream &stream, Template *ptem, std::string *error)
 {
 	std::string name;
 	std::string bcond;
-	Template tem = { 0 };
+	Template tem = {};
 
 	static const auto bcond_values = std::unordered_map<std::string, BoundaryCondition> {
 		{ "Constant", BoundaryCondition::Constant },
@@ -41,40 +64,181 @@ Template load_template_stream(std::istream &stream)
 		{ "Periodic", BoundaryCondition::Periodic },
 	};
 
-	auto read_coupling_mat = [&](CouplingMat &mat) {
-		for (auto &row : mat) {
-			for (auto &elem : row) {
-				stream >> elem;
+	// A number that can't be read, because it's malformed or missing,
+	// fails the stream, which would otherwise just end the template
+	auto read_coupling_mat = [&](CouplingMat &mat, const char *what) {
+		for (std::ptrdiff_t k = 0; k < mat.size() * mat.size(); k++) {
+			if (!(stream >> mat.coeffs[k])) {
+				*error = std::string("invalid or missing coefficient of ") + what;
+				return false;
 			}
 		}
+
+		return true;
 	};
 
 	while (stream >> name) {
-		switch (name[0]) {
+		// Items are named by their first letter, except for the long
+		// name of the boundary condition, which some templates use
+		const char item = name == "Boundary" ? 'C' : name[0];
+
+		switch (item) {
+		case 'R': { // Radius, must precede A and B
+			std::ptrdiff_t radius = 0;
+
+			if (!(stream >> radius) || radius < 1 || radius > MaxTemplateRadius) {
+				*error = "invalid template radius";
+				return false;
+			}
+
+			tem.A = CouplingMat(radius);
+			tem.B = CouplingMat(radius);
+			break;
+		}
 		case 'A': // Feed-Forward
-			read_coupling_mat(tem.A);
+			if (!read_coupling_mat(tem.A, "A")) {
+				return false;
+			}
 			break;
 		case 'B': // Feedback
-			read_coupling_mat(tem.B);
+			if (!read_coupling_mat(tem.B, "B")) {
+				return false;
+			}
 			break;
 		case 'Z': // Bias
-			stream >> tem.Z;
+			if (!(stream >> tem.Z)) {
+				*error = "invalid or missing bias";
+				return false;
+			}
 			break;
-		case 'C': // Boundary Condition
+		case 'C': { // Boundary Condition
 			stream >> bcond;
-			tem.boundary_condition = bcond_values.at(bcond);
+			auto it = bcond_values.find(bcond);
 
-			if (tem.boundary_condition == Constant) {
-				stream >> tem.virtual_cell;
+			if (it == bcond_values.end()) {
+				*error = "invalid boundary condition '" + bcond + "'";
+				return false;
+			}
+
+			tem.boundary_condition = it->second;
+
+			if (tem.boundary_condition == Constant && !(stream >> tem.virtual_cell)) {
+				*error = "invalid or missing value of the boundary cells";
+				return false;
 			}
 
 			break;
+		}
 		default:
-			assert(0 && "invalid template item name");
+			*error = "invalid template item name '" + name + "'";
+			return false;
 		}
 	}
 
-	return tem;
+	*ptem = tem;
+	return true;
+}
+
+std::ptrdiff_t effective_radius(const CouplingMat &M)
+{
+	const std::ptrdiff_t n = M.size();
+	std::ptrdiff_t radius = 1;
+
+	for (std::ptrdiff_t i = 0; i < n; i++) {
+		for (std::ptrdiff_t j = 0; j < n; j++) {
+			if (M[i][j] != 0) {
+				std::ptrdiff_t distance = std::max(std::abs(i - M.radius), std::abs(j - M.radius));
+				radius = std::max(radius, distance);
+			}
+		}
+	}
+
+	return radius;
+}
+
+CouplingMat crop_coupling_mat(const CouplingMat &M, std::ptrdiff_t radius)
+{
+	assert(radius <= M.radius && "can't crop a matrix to a larger radius");
+
+	CouplingMat result(radius);
+	const std::ptrdiff_t offset = M.radius - radius;
+
+	for (std::ptrdiff_t i = 0; i < result.size(); i++) {
+		for (std::ptrdiff_t j = 0; j < result.size(); j++) {
+			result[i][j] = M[i + offset][j + offset];
+		}
+	}
+
+	return result;
+}
+
+CouplingFactorization factorize_coupling_mat(const CouplingMat &M)
+{
+	CouplingFactorization result = { CouplingGeneral };
+	const std::ptrdiff_t n = M.size();
+
+	// Point symmetry: compare every element to its mirror image
+	bool symmetric = true;
+
+	for (std::ptrdiff_t i = 0; i < n; i++) {
+		for (std::ptrdiff_t j = 0; j < n; j++) {
+			symmetric = symmetric && M[i][j] == M[n - 1 - i][n - 1 - j];
+		}
+	}
+
+	if (symmetric) {
+		result.structure = CouplingSymmetric;
+		return result;
+	}
+
+	// Rank 1: every row is a multiple of the row containing the element of
+	// largest magnitude, by the ratio of the elements in the pivot column.
+	std::ptrdiff_t p = 0, q = 0;
+
+	for (std::ptrdiff_t i = 0; i < n; i++) {
+		for (std::ptrdiff_t j = 0; j < n; j++) {
+			if (std::fabs(M[i][j]) > std::fabs(M[p][q])) {
+				p = i;
+				q = j;
+			}
+		}
+	}
+
+	const double pivot = M[p][q];
+
+	if (pivot == 0) {
+		return result;
+	}
+
+	for (std::ptrdiff_t k = 0; k < n; k++) {
+		result.col[k] = M[k][q];
+		result.row[k] = M[p][k] / pivot;
+	}
+
+	const double eps = 1.0e-12 * std::fabs(pivot);
+
+	for (std::ptrdiff_t i = 0; i < n; i++) {
+		for (std::ptrdiff_t j = 0; j < n; j++) {
+			if (std::fabs(M[i][j] - result.col[i] * result.row[j]) > eps) {
+				return result;
+			}
+		}
+	}
+
+	result.structure = CouplingSeparable;
+	return result;
+}
+
+const char *coupling_structure_name(CouplingStructure structure)
+{
+	static const char *const names[NumCouplingStructures] = {
+		"general",
+		"symmetric",
+		"separable",
+	};
+
+	assert(0 <= structure && structure < NumCouplingStructures && "invalid coupling structure");
+	return names[structure];
 }
 
 void save_template_file(const char *fname, Template tem)
@@ -93,12 +257,12 @@ void save_template_stdio(std::FILE *handle, Template tem)
 
 void save_template_stream(std::ostream &stream, Template tem)
 {
-	auto write_coupling_mat = [&](const char *name, CouplingMat mat) {
+	auto write_coupling_mat = [&](const char *name, const CouplingMat &mat) {
 		stream << name << "\n";
 
-		for (auto row : mat) {
-			for (auto elem : row) {
-				stream << "\t" << elem;
+		for (std::ptrdiff_t i = 0; i < mat.size(); i++) {
+			for (std::ptrdiff_t j = 0; j < mat.size(); j++) {
+				stream << "\t" << mat[i][j];
 			}
 			stream << "\n";
 		}
@@ -106,6 +270,13 @@ void save_template_stream(std::ostream &stream, Template tem)
 		stream << "\n";
 	};
 
+	assert(tem.A.radius == tem.B.radius && "A and B must have the same radius");
+
+	// Radius 1 is the default, so that 3x3 templates look like they always did
+	if (tem.A.radius != 1) {
+		stream << "R\n\t" << tem.A.radius << "\n\n";
+	}
+
 	write_coupling_mat("A", tem.A);
 	write_coupling_mat("B", tem.B);
 
@@ -20,7 +20,25 @@
 #include <sstream>
 
 
-typedef std::array<std::array<double, 3>, 3> CouplingMat;
+#include <cstddef>
+
+
+// Templates may couple cells within this distance in each direction
+static const std::ptrdiff_t MaxTemplateRadius = 3;
+
+// A (2 * radius + 1) x (2 * radius + 1) matrix, stored packed in row-major
+// order, so that &M[0][0] points to its (2 * radius + 1)^2 coefficients.
+struct CouplingMat {
+	std::ptrdiff_t radius;
+	std::array<double, (2 * MaxTemplateRadius + 1) * (2 * MaxTemplateRadius + 1)> coeffs;
+
+	CouplingMat(std::ptrdiff_t pradius = 1);
+
+	std::ptrdiff_t size() const { return 2 * radius + 1; }
+
+	double *operator[](std::ptrdiff_t i) { return &coeffs[i * size()]; }
+	const double *operator[](std::ptrdiff_t i) const { return &coeffs[i * size()]; }
+};
 
 enum BoundaryCondition {
 	Constant, // or Dirichlet. Template::virtual_cell is only valid when this is set.
@@ -30,6 +48,22 @@ enum BoundaryCondition {
 };
 
 
+// Algebraic structure of a coupling matrix, which
+// the simulator can exploit for using fewer multiplications
+enum CouplingStructure {
+	CouplingGeneral,
+	CouplingSymmetric, // point symmetric: M[i][j] == M[n - 1 - i][n - 1 - j]
+	CouplingSeparable, // rank 1: M[i][j] == col[i] * row[j]
+	NumCouplingStructures
+};
+
+struct CouplingFactorization {
+	CouplingStructure structure;
+	std::array<double, 2 * MaxTemplateRadius + 1> col; // only valid if structure == CouplingSeparable
+	std::array<double, 2 * MaxTemplateRadius + 1> row; // ditto
+};
+
+
 struct Template {
 	CouplingMat A;
 	CouplingMat B;
@@ -42,6 +76,20 @@ Template load_template_file(const char *fname);
 Template load_template_stdio(std::FILE *handle);
 Template load_template_stream(std::istream &stream);
 
+// The same as load_template_stream(), but instead of asserting, returns
+// false and describes the problem if the template is invalid
+bool parse_template_stream(std::istream &stream, Template *tem, std::string *error);
+
+// The smallest radius outside of which all coefficients are zero (at least 1),
+// and the matrix cropped to a smaller radius, keeping the centre.
+std::ptrdiff_t effective_radius(const CouplingMat &M);
+CouplingMat crop_coupling_mat(const CouplingMat &M, std::ptrdiff_t radius);
+
+// If a matrix is both symmetric and separable, it is reported as symmetric,
+// because that needs fewer multiplications (5 instead of 6 for a 3x3 matrix).
+CouplingFactorization factorize_coupling_mat(const CouplingMat &M);
+const char *coupling_structure_name(CouplingStructure structure);
+
 void save_template_file(const char *fname, Template tem);
 void save_template_stdio(std::FILE *handle, Template tem);
 void save_template_stream(std::ostream &stream, Template tem);
@@ -0,0 +1,183 @@
+//
+// threadpool.cc
+// CNNSim, a simple CNN simulator
+//
+// Licensed under the 2-clause BSD License
+//
+
+#include <cassert>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "threadpool.hh"
+
+
+#ifdef __linux__
+// The CPUs the calling thread may run on, as restricted by e.g. taskset
+// or cpusets; all of them if that can't be determined
+static std::vector<int> allowed_cpus()
+{
+	std::vector<int> cpus;
+	cpu_set_t set;
+
+	if (sched_getaffinity(0, sizeof set, &set) == 0) {
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			if (CPU_ISSET(cpu, &set)) {
+				cpus.push_back(cpu);
+			}
+		}
+	}
+
+	if (cpus.empty()) {
+		for (std::ptrdiff_t cpu = 0; cpu < ThreadPool::hardware_threads(); cpu++) {
+			cpus.push_back(cpu);
+		}
+	}
+
+	return cpus;
+}
+#endif
+
+ThreadPool::ThreadPool(std::ptrdiff_t num_threads, std::ptrdiff_t first_cpu):
+	task(nullptr),
+	task_ctx(nullptr),
+	task_size(0),
+	generation(0),
+	pending(0),
+	stopping(false)
+{
+	assert(num_threads >= 0 && "negative number of threads");
+
+	if (num_threads == 0) {
+		num_threads = hardware_threads();
+	}
+
+#ifdef __linux__
+	// Thread i of the pool belongs on allowed CPU first_cpu + i. A pool
+	// that doesn't fit in the allowed CPUs from there isn't pinned at all,
+	// rather than stacking several threads onto the same CPU.
+	const std::vector<int> cpus = allowed_cpus();
+	const bool pin = first_cpu >= 0 && first_cpu + num_threads <= std::ptrdiff_t(cpus.size());
+#else
+	(void)first_cpu;
+#endif
+
+	// The calling thread is #0, it only needs num_threads - 1 workers
+	for (std::ptrdiff_t i = 1; i < num_threads; i++) {
+		workers.emplace_back(&ThreadPool::worker_loop, this, i);
+
+#ifdef __linux__
+		// The calling thread itself is left where it is
+		if (pin) {
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(cpus[first_cpu + i], &set);
+			pthread_setaffinity_np(workers.back().native_handle(), sizeof set, &set);
+		}
+#endif
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+
+	wake_cond.notify_all();
+
+	for (auto &worker : workers) {
+		worker.join();
+	}
+}
+
+std::ptrdiff_t ThreadPool::size() const
+{
+	return workers.size() + 1;
+}
+
+std::ptrdiff_t ThreadPool::hardware_threads()
+{
+#ifdef __linux__
+	cpu_set_t set;
+
+	if (sched_getaffinity(0, sizeof set, &set) == 0 && CPU_COUNT(&set) > 0) {
+		return CPU_COUNT(&set);
+	}
+#endif
+
+	std::ptrdiff_t n = std::thread::hardware_concurrency();
+	return n > 0 ? n : 1;
+}
+
+std::ptrdiff_t ThreadPool::chunk_begin(std::ptrdiff_t index, std::ptrdiff_t n) const
+{
+	return n * index / size();
+}
+
+void ThreadPool::run(std::ptrdiff_t n, Task fn, const void *ctx)
+{
+	if (workers.empty()) {
+		fn(ctx, 0, n, 0);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		task = fn;
+		task_ctx = ctx;
+		task_size = n;
+		pending = workers.size();
+		generation++;
+	}
+
+	wake_cond.notify_all();
+
+	// Do our own share of the work, then wait for the others
+	fn(ctx, chunk_begin(0, n), chunk_begin(1, n), 0);
+
+	std::unique_lock<std::mutex> lock(mutex);
+	done_cond.wait(lock, [this] { return pending == 0; });
+}
+
+void ThreadPool::worker_loop(std::ptrdiff_t index)
+{
+	std::size_t seen_generation = 0;
+
+	while (true) {
+		Task fn;
+		const void *ctx;
+		std::ptrdiff_t n;
+
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			wake_cond.wait(lock, [&] { return stopping || generation != seen_generation; });
+
+			if (stopping) {
+				return;
+			}
+
+			seen_generation = generation;
+			fn = task;
+			ctx = task_ctx;
+			n = task_size;
+		}
+
+		fn(ctx, chunk_begin(index, n), chunk_begin(index + 1, n), index);
+
+		bool last;
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			last = --pending == 0;
+		}
+
+		if (last) {
+			done_cond.notify_one();
+		}
+	}
+}
@@ -0,0 +1,97 @@
+//
+// threadpool.hh
+// CNNSim, a simple CNN simulator
+//
+// Licensed under the 2-clause BSD License
+//
+
+#ifndef CNNSIM_THREADPOOL_HH
+#define CNNSIM_THREADPOOL_HH
+
+#include <cstddef>
+
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+
+// A persistent pool of worker threads, optionally pinned to CPUs where supported.
+// The thread calling parallel_for() takes part in the work as well,
+// so a pool of size 1 has no workers at all and runs everything inline.
+// Dispatching work does not allocate, so it is safe to use from the
+// allocation-free simulation hot path.
+struct ThreadPool {
+public:
+	// 0 means one thread per CPU. The threads are pinned to consecutive
+	// CPUs, starting at the 'first_cpu'-th one the calling thread may run
+	// on, so that pools sharing the machine can be given disjoint ranges.
+	// Negative means not pinning them, leaving them to the scheduler.
+	explicit ThreadPool(std::ptrdiff_t num_threads, std::ptrdiff_t first_cpu = -1);
+
+	ThreadPool(const ThreadPool &) = delete;
+	ThreadPool(ThreadPool &&) = delete;
+
+	~ThreadPool();
+
+	ThreadPool &operator=(const ThreadPool &) = delete;
+	ThreadPool &operator=(ThreadPool &&) = delete;
+
+	std::ptrdiff_t size() const;
+
+	// Split [0, n) into size() contiguous chunks and call fn(begin, end, k)
+	// on each of them in parallel, where k is the index of the chunk (and
+	// of the thread), which can be used e.g. for selecting scratch space.
+	// Returns when all of them are done.
+	template<typename Fn>
+	void parallel_for(std::ptrdiff_t n, const Fn &fn)
+	{
+		run(n, [](const void *ctx, std::ptrdiff_t begin, std::ptrdiff_t end, std::ptrdiff_t k) {
+			(*static_cast<const Fn *>(ctx))(begin, end, k);
+		}, &fn);
+	}
+
+	// For items of very different cost: instead of being split into fixed
+	// chunks, indices are handed out one by one from a shared counter, so
+	// threads that are done with cheap items take over the rest of the work.
+	// Calls fn(i, k) for every i in [0, n), where k is the index of the thread.
+	template<typename Fn>
+	void parallel_for_dynamic(std::ptrdiff_t n, const Fn &fn)
+	{
+		std::atomic<std::ptrdiff_t> next { 0 };
+
+		parallel_for(size(), [&](std::ptrdiff_t, std::ptrdiff_t, std::ptrdiff_t k) {
+			for (std::ptrdiff_t i = next++; i < n; i = next++) {
+				fn(i, k);
+			}
+		});
+	}
+
+	// The number of CPUs the calling thread may run on
+	static std::ptrdiff_t hardware_threads();
+
+private:
+	typedef void (*Task)(const void *ctx, std::ptrdiff_t begin, std::ptrdiff_t end, std::ptrdiff_t k);
+
+	std::vector<std::thread> workers;
+
+	std::mutex mutex;
+	std::condition_variable wake_cond;
+	std::condition_variable done_cond;
+
+	// current job, protected by 'mutex'
+	Task task;
+	const void *task_ctx;
+	std::ptrdiff_t task_size;
+	std::size_t generation; // incremented for every job
+	std::ptrdiff_t pending; // workers still busy with the current job
+	bool stopping;
+
+	void run(std::ptrdiff_t n, Task fn, const void *ctx);
+	void worker_loop(std::ptrdiff_t index);
+
+	std::ptrdiff_t chunk_begin(std::ptrdiff_t index, std::ptrdiff_t n) const;
+};
+
+#endif // CNNSIM_THREADPOOL_HH